@@ -19,41 +19,112 @@
 */
 
 #include <uapi/linux/bpf_perf_event.h>
+#include <linux/sched.h>
 
 /**
  * In the rest of the code we are going to use a selector to read and write
- * events. The idea is that while userspace is reading events
- * for selector 0 we write events using selector 1 and vice versa.
- * This process in handled by the bpf_selector variable.
+ * events. Userspace numbers its windows with an increasing epoch and events
+ * of epoch e are written in slot e % SELECTOR_DIM of a ring, so that while
+ * userspace is reading the slots of the previous epochs we write events in
+ * another one. Every slot is stamped with the epoch that wrote it: data left
+ * there by an older window is reset before being reused and userspace can
+ * tell whether the slot it reads still belongs to the epoch it drains.
  */
-#define SELECTOR_DIM 2 // Use a binary selector
+#ifndef SELECTOR_DIM
+#define SELECTOR_DIM 4 // Depth of the epoch ring
+#endif
 
 /**
- * Slots are array cells we use to store events following the selector idea.
- * Let's take as an example NUM_SOCKETS=2 (2 physical CPUs) and let's keep
- * SELECTOR_DIM=2 as defined above. In this case the array would have four slots
- * and will be partitioned in the following way:
- * [ CPU_0 SELECTOR_0 | CPU_0 SELECTOR_1 | CPU_1 SELECTOR_0 | CPU_1 SELECTOR_1 ]
+ * The weighted cycles of a process are kept per socket, since the power
+ * of each socket is split among the processes that ran on it. A process
+ * nearly always runs on one socket in a window, so its record only holds
+ * the cycles of its home socket in each slot, the socket of the first
+ * slice it ran in the window. The cycles of slices on any other socket go
+ * to the foreign_cycles side map, indexed by the process row and by
+ * (socket, slot) as slot + SELECTOR_DIM * socket. Accounting a slice is then
+ * the same amount of work whatever the number of sockets.
  */
 #define NUM_SLOTS NUM_SOCKETS * SELECTOR_DIM
 
+/**
+ * Capacity of the hash maps, set from userspace (map_sizes in config.yaml).
+ * An insert in a full BPF_HASH fails and is counted in error_counts with
+ * the *_INSERT_FAILED codes. The maps whose rows are never deleted by an
+ * exit (aggregates, graveyard) or that only pair two events (migrations,
+ * foreign_cycles) are LRU: a full one evicts its least recently used row.
+ * The libbpf build (CORE) sizes them at load time like NUM_CPUS, the
+ * defaults are in bpf_build.LOAD_TIME_DEFAULTS
+ */
+#ifndef CORE
+#ifndef PIDS_MAP_SIZE
+#define PIDS_MAP_SIZE 10240
+#endif
+#ifndef AGGREGATES_MAP_SIZE
+#define AGGREGATES_MAP_SIZE 10240
+#endif
+#ifndef GRAVEYARD_MAP_SIZE
+#define GRAVEYARD_MAP_SIZE 1024
+#endif
+#ifndef FOREIGN_CYCLES_MAP_SIZE
+#define FOREIGN_CYCLES_MAP_SIZE 10240
+#endif
+#ifndef MIGRATIONS_MAP_SIZE
+#define MIGRATIONS_MAP_SIZE 10240
+#endif
+#endif
+
+// BCC has no macro for it, the libbpf build (CORE) translates this one
+#ifndef CORE
+#define BPF_LRU_PERCPU_HASH(_name, _key_type, _leaf_type, _size) \
+        BPF_TABLE("lru_percpu_hash", _key_type, _leaf_type, _name, _size)
+#endif
+
+/**
+ * The PMU events are chosen in userspace (pmu_events in config.yaml),
+ * that passes how many they are and the index of the cycles counters
+ * the power attribution is based on: cycles_thread, plus the AnyThread
+ * cycles_core with SMT_OVERLAP_ANY_THREAD. Every other counter is just
+ * summed per process. Without them use the historical set of five counters.
+ */
+#ifdef PERFORMANCE_COUNTERS
+#ifndef NUM_COUNTERS
+#define NUM_COUNTERS 5
+#define COUNTER_CYCLES_THREAD 0
+#define COUNTER_CYCLES_CORE 1
+#endif
+#if !defined(COUNTER_CYCLES_THREAD)
+#error "the power attribution needs the cycles_thread counter"
+#endif
+#if defined(SMT_OVERLAP_ANY_THREAD) && !defined(COUNTER_CYCLES_CORE)
+#error "the AnyThread overlap needs the cycles_core counter"
+#endif
+#if defined(FREQUENCY_WEIGHTING) && !defined(COUNTER_REF_CYCLES)
+#error "the frequency weighting needs the ref_cycles counter"
+#endif
+#define TOPOLOGY_WORDS (10 + NUM_COUNTERS)
+#else
+#define TOPOLOGY_WORDS 10
+#endif
+// always at least one word of padding, so that the array is never empty
+#define TOPOLOGY_PAD (8 - TOPOLOGY_WORDS % 8)
+
 /**
  * pid_status is used to store information about pid X
- * bpf_selector is used for the slot selection described above and is set
- * in the BPF context. PCM arrays like cycles and IR are written by BPF but
- * read and initialized from user space.
+ * epoch stamps each slot described above with the window it belongs to
+ * and is set in the BPF context. The counters array (one row per PMU event) is
+ * written by BPF but read and initialized from user space.
  */
 struct pid_status {
         int pid;                            /**< Process ID */
         int tgid;
         char comm[TASK_COMM_LEN];           /**< Process name */
-        u64 weighted_cycles[NUM_SLOTS];     /**< Number of weighted cycles executed by the process */
-        u64 cycles[SELECTOR_DIM];              /**< Number of unhalted core cycles executed by the process */
-        u64 instruction_retired[SELECTOR_DIM]; /**< Number of instructions executed by the process */
-        u64 cache_misses[SELECTOR_DIM];        /**< Number of Last Level Cache misses executed by the process */
-        u64 cache_refs[SELECTOR_DIM];        /**< Number of Last Level Cache references executed by the process */
+        u64 weighted_cycles[SELECTOR_DIM];  /**< Weighted cycles executed by the process on its home socket */
+        u32 socket[SELECTOR_DIM];           /**< Home socket of the process in each slot */
+#ifdef PERFORMANCE_COUNTERS
+        u64 counters[NUM_COUNTERS][SELECTOR_DIM]; /**< Events counted while the process was running */
+#endif
         u64 time_ns[SELECTOR_DIM];             /**< Execution time of the process (in ns) */
-        unsigned int bpf_selector;          /**< Slot selector */
+        u32 epoch[SELECTOR_DIM];               /**< Epoch of the window stored in each slot */
         u64 ts[SELECTOR_DIM];                  /**< Timestamp of the latest update */
 };
 
@@ -68,15 +139,24 @@ struct proc_topology {
         u64 sibling_id;
         u64 core_id;
         u64 processor_id;
-        u64 cycles_core;
-        u64 cycles_core_delta_sibling;
-        u64 cycles_thread;
-        u64 instruction_thread;
-        u64 cache_misses;
-        u64 cache_refs;
+        u64 overlap_cycles;                 /**< Cycles of the ending slice executed while the sibling was busy */
+        u64 overlap;                        /**< Co-running time (or AnyThread core cycles) accounted by this CPU */
+        u64 overlap_snapshot;               /**< Overlap of the core when the current slice started */
+        u64 busy_since;                     /**< When the CPU left idle, 0 while idle */
         u64 ts;
-        int running_pid;
+        int running_pid;                    /**< Task of the current slice, -1 if it migrated, EXITED_TASK if it exited */
+#ifdef PERFORMANCE_COUNTERS
+        u64 counters[NUM_COUNTERS];         /**< Counter values when the current slice started */
+#endif
+        u64 pad[TOPOLOGY_PAD];              /**< Keep each processor on its own cache lines */
 };
+_Static_assert(sizeof(struct proc_topology) % 64 == 0, "proc_topology must fill whole cache lines");
+
+/**
+ * running_pid of a CPU whose task exited: the final switch out of the
+ * task starts the next slice and accounts nothing, see handle_exit
+ */
+#define EXITED_TASK -2
 
 /**
  * sched_switch_args is the payload of a sched_switch tracepoint event
@@ -105,6 +185,19 @@ struct sched_process_fork_args {
         char child_comm[16];
         int child_pid;
 };
+struct sched_migrate_task_args {
+        __u64 pad; // regs after 4.x?
+        char comm[16];
+        int pid;
+        int prio;
+        int orig_cpu;
+        int dest_cpu;
+};
+struct cpu_idle_args {
+        __u64 pad; // regs after 4.x?
+        u32 state;
+        u32 cpu_id;
+};
 struct sched_process_exit_args {
         __u64 pad; // regs after 4.x?
         char comm[16];
@@ -112,42 +205,177 @@ struct sched_process_exit_args {
         int prio;
 };
 
-#ifdef DEBUG
+#ifdef TRACE_ERRORS
 struct error_code {
         int err;
+        int pid;
 };
 
 BPF_PERF_OUTPUT(err);
 #endif
 
 #ifdef PERFORMANCE_COUNTERS
-BPF_PERF_ARRAY(cycles_core, NUM_CPUS);
-BPF_PERF_ARRAY(cycles_thread, NUM_CPUS);
-BPF_PERF_ARRAY(instr_thread, NUM_CPUS);
-BPF_PERF_ARRAY(cache_misses, NUM_CPUS);
-BPF_PERF_ARRAY(cache_refs, NUM_CPUS);
+/**
+ * A single perf array holds all the counters, counter c of CPU i is at
+ * index c * NUM_CPUS + i
+ */
+BPF_PERF_ARRAY(pmu_counters, NUM_COUNTERS * NUM_CPUS);
+
+/**
+ * The counters are read together with their enabled and running time.
+ * When the PMU is multiplexed a counter only counts while running, so
+ * each delta is scaled by enabled/running and added to the scaled
+ * value of the counter, that is what the rest of the code sees.
+ * counter_states is indexed by CPU id and only written by its CPU.
+ */
+struct counter_state {
+        u64 raw[NUM_COUNTERS];
+        u64 enabled[NUM_COUNTERS];
+        u64 running[NUM_COUNTERS];
+        u64 scaled[NUM_COUNTERS];
+};
+BPF_ARRAY(counter_states, struct counter_state, NUM_CPUS);
+
+/*
+ * per-CPU enabled and running time of the counters in a given time slot,
+ * reset and summed like switch_count. Their ratio tells
+ * how much of the window the counters were actually counting
+ */
+BPF_PERCPU_ARRAY(counters_enabled, u64, SELECTOR_DIM);
+BPF_PERCPU_ARRAY(counters_running, u64, SELECTOR_DIM);
+
+#ifdef COUNTER_REF_CYCLES
+/*
+ * per-CPU cycles and reference cycles of the slices accounted in a given
+ * time slot, reset and summed like switch_count. Their ratio is the
+ * effective frequency of the CPU over the nominal one (APERF/MPERF)
+ */
+BPF_PERCPU_ARRAY(freq_cycles, u64, SELECTOR_DIM);
+BPF_PERCPU_ARRAY(freq_ref_cycles, u64, SELECTOR_DIM);
+#endif
+#endif
+/**
+ * processors and idles are indexed by CPU id, each CPU only writes its own
+ * slot during the sched_switch (processors is also read by the sibling)
+ */
+BPF_ARRAY(processors, struct proc_topology, NUM_CPUS);
+#ifndef TASK_STORAGE
+BPF_HASH(pids, int, struct pid_status, PIDS_MAP_SIZE);
+#endif
+BPF_ARRAY(idles, struct pid_status, NUM_CPUS);
+
+/**
+ * With TASK_STORAGE the status of each thread lives in the task local
+ * storage of its task_struct: the sched_switch path updates it in place
+ * and the kernel releases it when the task exits. There is no pids hash,
+ * userspace reads the statuses with the dump_task_status iterator.
+ */
+#ifdef TASK_STORAGE
+BPF_TASK_STORAGE(task_status, struct pid_status);
+#endif
+
+/**
+ * With AGGREGATE_TGID or AGGREGATE_CGROUP the slices are not accounted per
+ * thread but folded into one row per process (tgid) or per cgroup (cgroup
+ * v2 id of the task), so that userspace reads one row per container
+ * instead of one per thread. Rows are per-CPU: each CPU updates its own
+ * copy without atomics and userspace sums them.
+ */
+#if defined(AGGREGATE_TGID) || defined(AGGREGATE_CGROUP)
+#define AGGREGATE
+BPF_LRU_PERCPU_HASH(aggregates, u64, struct pid_status, AGGREGATES_MAP_SIZE);
+#endif
+
+/**
+ * Without aggregation the status of a thread is deleted when it exits.
+ * What it accumulated in the windows not drained yet is first folded in
+ * the graveyard row of its cgroup, so that short-lived threads are still
+ * accounted. Per-CPU like the aggregates, summed by userspace.
+ */
+#ifndef AGGREGATE
+BPF_LRU_PERCPU_HASH(graveyard, u64, struct pid_status, GRAVEYARD_MAP_SIZE);
 #endif
-BPF_HASH(processors, u64, struct proc_topology);
-BPF_HASH(pids, int, struct pid_status);
-BPF_HASH(idles, u64, struct pid_status);
 
 /**
- * conf struct has 4 integer keys initialized in user space
- * 0: current bpf selector
- * 1: old bpf selector
- * 2: timeslice (dynamic window duration)
- * 3: switch count (global context switch counter). Used to compute the window size
+ * Weighted cycles of the slices that a thread or graveyard row ran out of
+ * its home socket, see NUM_SLOTS. The per-CPU rows (idles, aggregates)
+ * always run on the socket of their CPU and never get here. Entries are
+ * stamped with their epoch like the slots, the LRU drops the ones of the
+ * rows that are gone
+ */
+#define ROW_THREAD 0
+#define ROW_GRAVE 1
+struct socket_cycles_key {
+        u64 row;                            /**< pid or cgroup id of the graveyard row */
+        u32 kind;                           /**< ROW_THREAD or ROW_GRAVE */
+        u32 index;                          /**< slot + SELECTOR_DIM * socket */
+};
+struct socket_cycles {
+        u64 cycles;
+        u32 epoch;
+        u32 pad;
+};
+BPF_LRU_HASH(foreign_cycles, struct socket_cycles_key, struct socket_cycles, FOREIGN_CYCLES_MAP_SIZE);
+
+/**
+ * conf struct has 2 integer keys initialized in user space
+ * 0: current epoch
+ * 1: timeslice (dynamic window duration)
+ * conf is only read from the BPF side, so all the cores can keep it in cache
  */
-#define BPF_SELECTOR_INDEX 0
-#define BPF_SELECTOR_INDEX_OLD 1
-#define BPF_TIMESLICE 2
-#define BPF_SWITCH_COUNT 3
-BPF_ARRAY(conf, u32, 4);
+#define BPF_EPOCH_INDEX 0
+#define BPF_TIMESLICE 1
+BPF_ARRAY(conf, u32, 2);
 
 /*
- * timestamp array to store the last timestamp of a given time slot
+ * per-CPU context switch counter of a given time slot, reset by the CPU
+ * when it enters the slot in a new epoch and summed from userspace. Used
+ * to compute the window size
  */
-BPF_ARRAY(global_timestamps, u64, SELECTOR_DIM);
+BPF_PERCPU_ARRAY(switch_count, u64, SELECTOR_DIM);
+
+/*
+ * per-CPU timestamp array to store the last timestamp of a given time slot,
+ * userspace takes the max over the CPUs
+ */
+BPF_PERCPU_ARRAY(global_timestamps, u64, SELECTOR_DIM);
+
+/*
+ * per-CPU epoch of the values stored in each slot of the per-CPU arrays
+ * above, userspace skips the CPUs whose slot belongs to another epoch
+ */
+BPF_PERCPU_ARRAY(slot_epochs, u32, SELECTOR_DIM);
+
+#ifdef IDLE_STATES
+/**
+ * Total residency (ns) of this CPU in each C-state since the program was
+ * loaded, states deeper than NUM_CSTATES - 1 are counted in the last one.
+ * An idle interval is added when it ends, idle_entries keeps the state the
+ * CPU entered and when, so that userspace splits the interval still open
+ * at the end of each window (a sleeping CPU runs no window code)
+ */
+#ifndef NUM_CSTATES
+#define NUM_CSTATES 8
+#endif
+BPF_PERCPU_ARRAY(cstate_residency, u64, NUM_CSTATES);
+
+struct idle_entry {
+        u64 ts;
+        u32 state;
+};
+BPF_PERCPU_ARRAY(idle_entries, struct idle_entry, 1);
+#endif
+
+/*
+ * latest migration of each thread, used to reopen on the destination CPU
+ * a slice whose switch in was not seen there. Entries are consumed by
+ * the switch out, the LRU drops the threads that never get one
+ */
+struct migration {
+        u32 orig_cpu;
+        u32 dest_cpu;
+};
+BPF_LRU_HASH(migrations, int, struct migration, MIGRATIONS_MAP_SIZE);
 
 
 /**
@@ -159,6 +387,12 @@ BPF_ARRAY(global_timestamps, u64, SELECTOR_DIM);
 #define STEP_MIN 1000000000
 #define STEP_MAX 4000000000
 
+/**
+ * Fixed windows (window_period_ms in userspace) can be shorter than a
+ * dynamic one, the timeslice in conf is accepted down to WINDOW_MIN
+ */
+#define WINDOW_MIN 10000000
+
 #define HAPPY_FACTOR 11/20
 #define STD_FACTOR 1
 
@@ -172,187 +406,228 @@ BPF_ARRAY(global_timestamps, u64, SELECTOR_DIM);
 #define CORRUPTED_TOPOLOGY_MAP -5
 #define WRONG_SIBLING_TOPOLOGY_MAP -6
 #define THREAD_MIGRATED_UNEXPECTEDLY -7
+#define COUNTER_OVERFLOW -8
+// not an error, counted with them to compare with THREAD_MIGRATED_UNEXPECTEDLY
+#define MIGRATED_SLICE_RECOVERED -9
+#define PIDS_INSERT_FAILED -10
+#define AGGREGATES_INSERT_FAILED -11
+#define GRAVEYARD_INSERT_FAILED -12
+#define NUM_ERROR_CODES 13
 
+/*
+ * per-CPU count of each error code (indexed by -code), userspace reads
+ * them once per window. With TRACE_ERRORS each error is also sent to
+ * userspace as an event, together with the pid of the current task
+ */
+BPF_PERCPU_ARRAY(error_counts, u64, NUM_ERROR_CODES);
 
-static void send_error(struct sched_switch_args *ctx, int err_code) {
-#ifdef DEBUG
-        struct error_code error;
-        error.err = err_code;
-        err.perf_submit(ctx, &error, sizeof(error));
+static inline void send_error(void *ctx, int err_code) {
+        int index = -err_code;
+        u64 *count = error_counts.lookup(&index);
+        if (count != NULL) {
+                (*count)++;
+        }
+#ifdef TRACE_ERRORS
+        // timer callbacks have no context to submit events with
+        if (ctx != NULL) {
+                struct error_code error;
+                error.err = err_code;
+                error.pid = bpf_get_current_pid_tgid();
+                err.perf_submit(ctx, &error, sizeof(error));
+        }
 #endif
 }
 
-static void send_perf_error(struct bpf_perf_event_data *ctx, int err_code) {
-#ifdef DEBUG
-        struct error_code error;
-        error.err = err_code;
-        err.perf_submit(ctx, &error, sizeof(error));
-#endif
-}
+/**
+ * Return the slot of epoch in the ring. The first time this CPU enters the
+ * slot in a new epoch the per-CPU values left there by the window
+ * SELECTOR_DIM epochs ago are reset and the slot is stamped
+ */
+static inline u32 enter_epoch(u32 epoch) {
+        u32 bpf_selector = epoch % SELECTOR_DIM;
+        u32 *slot_epoch = slot_epochs.lookup(&bpf_selector);
+        if (slot_epoch == NULL || *slot_epoch == epoch) {
+                return bpf_selector;
+        }
 
-static inline int update_cycles_count(void *ctx,
-        int old_pid, u32 bpf_selector, u32 step, u64 processor_id,
+        u64 *value = switch_count.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value = 0;
+        }
+        value = global_timestamps.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value = 0;
+        }
 #ifdef PERFORMANCE_COUNTERS
-        u64 thread_cycles_sample, u64 core_cycles_sample,
-        u64 instruction_retired_thread, u64 cache_misses_thread,
-        u64 cache_refs_thread,
+        value = counters_enabled.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value = 0;
+        }
+        value = counters_running.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value = 0;
+        }
+#ifdef COUNTER_REF_CYCLES
+        value = freq_cycles.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value = 0;
+        }
+        value = freq_ref_cycles.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value = 0;
+        }
 #endif
-        u64 ts) {
-
-    int ret = 0;
-
-    // Fetch more data about processor where the sched_switch happened
-    struct proc_topology topology_info;
-    ret = bpf_probe_read(&topology_info, sizeof(topology_info), processors.lookup(&processor_id));
-    if(ret!= 0 || topology_info.ht_id > NUM_CPUS) {
-            send_error(ctx, CORRUPTED_TOPOLOGY_MAP);
-            return 0;
-    }
-
-    // Create the struct to hold the pid status we are going to fetch
-    struct pid_status status_old;
-    status_old.pid = -1;
+#endif
+        *slot_epoch = epoch;
+        return bpf_selector;
+}
 
-    /**
-     * Fetch the status of the exiting pid.
-     * If the pid is 0 then use the idles perf_hash
-     */
-    if(old_pid == 0) {
-            ret = bpf_probe_read(&status_old, sizeof(status_old), idles.lookup(&(processor_id)));
-    } else {
-            ret = bpf_probe_read(&status_old, sizeof(status_old), pids.lookup(&(old_pid)));
-    }
+#ifdef COUNTER_REF_CYCLES
+/**
+ * Track the effective frequency of this CPU: the cycles of a slice over
+ * its reference cycles, that tick at the nominal frequency.
+ * With FREQUENCY_WEIGHTING the weighted cycles of the slice are scaled by
+ * the energy of a cycle at that frequency relative to the nominal one:
+ * dynamic power is C * V^2 * f and the voltage follows the frequency, so
+ * a cycle costs about (f / f_nominal)^2. Ratios are in 1/1024
+ */
+static inline u64 frequency_weight(struct proc_topology *topology_info, u64 *samples,
+        u32 bpf_selector, u64 cycles, u64 weighted) {
+        u64 ref_cycles = 0;
+        if (samples[COUNTER_REF_CYCLES] > topology_info->counters[COUNTER_REF_CYCLES]) {
+                ref_cycles = samples[COUNTER_REF_CYCLES] - topology_info->counters[COUNTER_REF_CYCLES];
+        }
+        u64 *value = freq_cycles.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value += cycles;
+        }
+        value = freq_ref_cycles.lookup(&bpf_selector);
+        if (value != NULL) {
+                *value += ref_cycles;
+        }
+#ifdef FREQUENCY_WEIGHTING
+        if (ref_cycles == 0) {
+                return weighted;
+        }
+        u64 ratio = cycles * 1024 / ref_cycles;
+        return weighted * ratio / 1024 * ratio / 1024;
+#else
+        return weighted;
+#endif
+}
+#endif
 
-    if(ret != 0) {
-        // no data for this thread, for now do not account data
-        return 0;
-    }
+/**
+ * Account the slice that just ended on processor topology_info to the
+ * pid_status pointed by status. The status can either live on the stack
+ * (hash engine, written back by the caller) or directly inside the task
+ * local storage (task storage engine).
+ */
+/**
+ * Add weighted cycles executed on socket to the slot of a row, in the row
+ * itself if that is its home socket in the slot, in foreign_cycles if not
+ */
+static inline void add_socket_cycles(struct pid_status *status, u32 kind, u64 row,
+        u32 bpf_selector, u32 epoch, u32 socket, u64 weighted) {
+        if (weighted == 0) {
+                return;
+        }
+        #pragma clang loop unroll(full)
+        for (int slot = 0; slot < SELECTOR_DIM; slot++) {
+                if (slot != bpf_selector) {
+                        continue;
+                }
+                if (status->weighted_cycles[slot] == 0) {
+                        status->socket[slot] = socket;
+                }
+                if (status->socket[slot] == socket) {
+                        status->weighted_cycles[slot] += weighted;
+                        return;
+                }
+        }
 
-    if (topology_info.running_pid != status_old.pid) {
-        // we have some issues
-        send_error(ctx, THREAD_MIGRATED_UNEXPECTEDLY);
-        return 0;
-    }
+        struct socket_cycles_key key = {};
+        key.row = row;
+        key.kind = kind;
+        key.index = bpf_selector + SELECTOR_DIM * socket;
+        struct socket_cycles *value = foreign_cycles.lookup(&key);
+        if (value == NULL) {
+                struct socket_cycles value_new = {};
+                value_new.cycles = weighted;
+                value_new.epoch = epoch;
+                foreign_cycles.update(&key, &value_new);
+                return;
+        }
+        if (value->epoch != epoch) {
+                value->epoch = epoch;
+                value->cycles = 0;
+        }
+        // graveyard rows are shared by the CPUs where their threads exit
+        __sync_fetch_and_add(&value->cycles, weighted);
+}
 
+static inline void account_pid_status(void *ctx, struct pid_status *status,
+        struct proc_topology *topology_info, int old_pid, u32 epoch,
 #ifdef PERFORMANCE_COUNTERS
-    // Retrieving information of the sibling processor
-    u64 sibling_id = topology_info.sibling_id;
-    struct proc_topology sibling_info;
-    ret = bpf_probe_read(&sibling_info, sizeof(sibling_info), processors.lookup(&(sibling_id)));
+        u64 *samples,
+#endif
+        u64 ts) {
 
-    if(ret != 0) {
-        // Wrong info on topology, do nothing
-        send_error(ctx, WRONG_SIBLING_TOPOLOGY_MAP);
-        return 0;
-    }
+    u32 bpf_selector = epoch % SELECTOR_DIM;
 
-    /**
-     * Instead of adding stuff directly, given that we don't have
-     * the measure of the sibling thread cycles, we are summing up
-     * the information on our side to the core cycles of the sibling
-     */
-    // Update sibling process info
-    if(sibling_info.running_pid > 0 && old_pid > 0 && core_cycles_sample > sibling_info.cycles_core) {
-            sibling_info.cycles_core_delta_sibling += core_cycles_sample - sibling_info.cycles_core;
-    }
-    sibling_info.cycles_core = core_cycles_sample;
-    processors.update(&sibling_id, &sibling_info);
-#endif
     /**
      * Get back to our pid and our processor
      * Update the data for proc_topology and pid info
-     * Take the ts marking the beginning of execution of the exiting pid
+     * Take the epoch of the data stored in the slot of the current window
      */
-    u64 last_ts_pid_in = 0;
+    u32 slot_epoch = 0;
     //trick the compiler with loop unrolling
     #pragma clang loop unroll(full)
     for(int array_index = 0; array_index<SELECTOR_DIM; array_index++) {
-            if(array_index == status_old.bpf_selector) {
-                    last_ts_pid_in = status_old.ts[array_index];
+            if(array_index == bpf_selector) {
+                    slot_epoch = status->epoch[array_index];
             }
     }
 
     /**
-     * If we have exceeded the duration of the dynamic window (change
-     * in the bpf_selector or current ts greater than the end of
-     * the window) we need to update the selector and reset PCM counters
+     * If the slot still holds the data of an older window (the ring went
+     * around since the pid last ran) we need to stamp it with the current
+     * epoch and reset PCM counters
      */
-    if(status_old.bpf_selector != bpf_selector || last_ts_pid_in + step < ts) {
-            status_old.bpf_selector = bpf_selector;
-#ifdef PERFORMANCE_COUNTERS
-            //trick the compiler with loop unrolling
-            #pragma clang loop unroll(full)
-            for(int array_index = 0; array_index<NUM_SLOTS; array_index++) {
-                    if(array_index % SELECTOR_DIM == bpf_selector) {
-                            status_old.weighted_cycles[array_index] = 0;
-                    }
-            }
-#endif
+    if(slot_epoch != epoch) {
             #pragma clang loop unroll(full)
             for(int array_index = 0; array_index < SELECTOR_DIM; array_index++) {
                     if(array_index == bpf_selector) {
+                            status->weighted_cycles[array_index] = 0;
 #ifdef PERFORMANCE_COUNTERS
-                            status_old.cycles[array_index] = 0;
-                            status_old.instruction_retired[array_index] = 0;
-                            status_old.cache_misses[array_index] = 0;
-                            status_old.cache_refs[array_index] = 0;
+                            #pragma clang loop unroll(full)
+                            for(int counter = 0; counter < NUM_COUNTERS; counter++) {
+                                    status->counters[counter][array_index] = 0;
+                            }
 #endif
-                            status_old.time_ns[array_index] = 0;
+                            status->time_ns[array_index] = 0;
+                            status->epoch[array_index] = epoch;
                     }
             }
     }
 
-    /**
-     * Start to account PCM values for the exiting pid
-     */
-    // u64 old_thread_cycles = thread_cycles_sample;
-    // u64 cycles_core_delta_sibling = 0;
-    // u64 old_time = ts;
-    // u64 old_instruction_retired = instruction_retired_thread;
-    // u64 old_cache_misses = cache_misses_thread;
-    // u64 old_cache_refs = cache_refs_thread;
-    // if (topology_info.ts > 0) {
-    //         old_time = topology_info.ts;
-    //         old_thread_cycles = topology_info.cycles_thread;
-    //         cycles_core_delta_sibling = topology_info.cycles_core_delta_sibling;
-    //         old_instruction_retired = topology_info.instruction_thread;
-    //         old_cache_misses = topology_info.cache_misses;
-    //         old_cache_refs = topology_info.cache_refs;
-    //         //update the last slice of concurrent execution inside two sibling hyperthreads
-    //         if (old_pid > 0 && sibling_info.running_pid > 0 && core_cycles_sample > topology_info.cycles_core) {
-    //                 cycles_core_delta_sibling += core_cycles_sample - topology_info.cycles_core;
-    //         }
-    // }
-
-    if (topology_info.ts > 0) {
+    if (topology_info->ts > 0) {
             // update per process measurements (aka IR, cache misses, cycles not weighted)
             #pragma clang loop unroll(full)
             for(int array_index = 0; array_index<SELECTOR_DIM; array_index++) {
-                    if(array_index == status_old.bpf_selector){
+                    if(array_index == bpf_selector){
 #ifdef PERFORMANCE_COUNTERS
-                            if (instruction_retired_thread >= topology_info.instruction_thread) {
-                                    status_old.instruction_retired[array_index] += instruction_retired_thread - topology_info.instruction_thread;
-                            } else {
-                                    send_error(ctx, old_pid);
-                            }
-                            if (cache_misses_thread >= topology_info.cache_misses) {
-                                    status_old.cache_misses[array_index] += cache_misses_thread - topology_info.cache_misses;
-                            } else {
-                                    send_error(ctx, old_pid);
-                            }
-                            if (cache_refs_thread >= topology_info.cache_refs) {
-                                    status_old.cache_refs[array_index] += cache_refs_thread - topology_info.cache_refs;
-                            } else {
-                                    send_error(ctx, old_pid);
-                            }
-                            if (thread_cycles_sample >= topology_info.cycles_thread){
-                                    status_old.cycles[array_index] += thread_cycles_sample - topology_info.cycles_thread;
-                            } else {
-                                    send_error(ctx, old_pid);
+                            #pragma clang loop unroll(full)
+                            for(int counter = 0; counter < NUM_COUNTERS; counter++) {
+                                    if (samples[counter] >= topology_info->counters[counter]) {
+                                            status->counters[counter][array_index] += samples[counter] - topology_info->counters[counter];
+                                    } else {
+                                            send_error(ctx, COUNTER_OVERFLOW);
+                                    }
                             }
 #endif
-                            status_old.time_ns[array_index] += ts - topology_info.ts;
-                            status_old.ts[array_index] = ts;
+                            status->time_ns[array_index] += ts - topology_info->ts;
+                            status->ts[array_index] = ts;
                     }
             }
     }
@@ -360,93 +635,393 @@ static inline int update_cycles_count(void *ctx,
 #ifdef PERFORMANCE_COUNTERS
     // trick the compiler with loop unrolling
     // update weighted cycles for our pid
-    if (topology_info.ts > 0) {
-            #pragma clang loop unroll(full)
-            for(int array_index = 0; array_index<NUM_SLOTS; array_index++) {
-                    if(array_index == status_old.bpf_selector + SELECTOR_DIM * topology_info.processor_id) {
-                            //discard sample if cycles counter did overflow
-                            if (thread_cycles_sample > topology_info.cycles_thread){
-                                    u64 cycle1 = thread_cycles_sample - topology_info.cycles_thread;
-                                    u64 cycle_overlap = topology_info.cycles_core_delta_sibling;
-                                    u64 cycle_non_overlap = cycle1 > topology_info.cycles_core_delta_sibling ? cycle1 - topology_info.cycles_core_delta_sibling : 0;
-                                    status_old.weighted_cycles[array_index] += cycle_non_overlap + cycle_overlap*HAPPY_FACTOR;
-                            } else {
-                                    send_error(ctx, old_pid);
-                            }
-                    }
+    if (topology_info->ts > 0) {
+            //discard sample if cycles counter did overflow
+            if (samples[COUNTER_CYCLES_THREAD] > topology_info->counters[COUNTER_CYCLES_THREAD]){
+                    u64 cycle1 = samples[COUNTER_CYCLES_THREAD] - topology_info->counters[COUNTER_CYCLES_THREAD];
+                    u64 cycle_overlap = topology_info->overlap_cycles;
+                    u64 cycle_non_overlap = cycle1 > topology_info->overlap_cycles ? cycle1 - topology_info->overlap_cycles : 0;
+                    u64 weighted = cycle_non_overlap + cycle_overlap*HAPPY_FACTOR;
+#ifdef COUNTER_REF_CYCLES
+                    weighted = frequency_weight(topology_info, samples, bpf_selector, cycle1, weighted);
+#endif
+                    add_socket_cycles(status, ROW_THREAD, old_pid, bpf_selector, epoch,
+                            topology_info->processor_id, weighted);
+            } else {
+                    send_error(ctx, COUNTER_OVERFLOW);
             }
     }
 #endif
-    // update the pid status in our hashmap
+    status->tgid = bpf_get_current_pid_tgid() >> 32;
+}
+
+#ifdef AGGREGATE
+/**
+ * Key of the aggregate row of the current task, the one being switched out
+ */
+static inline u64 aggregate_id() {
+#ifdef AGGREGATE_CGROUP
+        return bpf_get_current_cgroup_id();
+#else
+        return bpf_get_current_pid_tgid() >> 32;
+#endif
+}
+#endif
+
+/**
+ * The switch out of old_pid found another thread running on this CPU:
+ * its switch in was not seen here. If old_pid was migrated to this CPU
+ * it is the thread that ran since the last event seen here, and it gets
+ * the whole slice: its time and its counters both start at that event,
+ * since the counters were not read when the thread arrived. Returns 0
+ * if the slice has to be dropped
+ */
+static inline int reopen_migrated_slice(struct proc_topology *topology_info,
+        int old_pid, u32 processor_id) {
+        struct migration *migration = migrations.lookup(&old_pid);
+        if (migration == NULL || migration->dest_cpu != processor_id) {
+                return 0;
+        }
+        topology_info->running_pid = old_pid;
+        migrations.delete(&old_pid);
+        return 1;
+}
+
+#ifdef PERFORMANCE_COUNTERS
+/**
+ * SMT overlap: the cycles a thread executed while the sibling hyperthread
+ * was busy too get the HAPPY_FACTOR weight. By default the co-running time
+ * comes from the sched state of the two siblings: a CPU is busy from its
+ * switch to a task to its switch to idle, and the CPU whose switch to idle
+ * ends a co-running interval adds it to its own overlap. The co-running
+ * time of a core up to ts is then the overlap of both siblings plus the
+ * interval still open.
+ * With SMT_OVERLAP_ANY_THREAD overlap counts instead the AnyThread
+ * cycles_core executed while the sibling was busy, on the cores that still
+ * have the event. CPUs without a sibling never overlap
+ */
+static inline struct proc_topology *lookup_sibling(struct proc_topology *topology_info) {
+        u32 sibling_id = topology_info->sibling_id;
+        if (topology_info->sibling_id >= NUM_CPUS) {
+                return NULL;
+        }
+        return processors.lookup(&sibling_id);
+}
+
+static inline u64 core_overlap(struct proc_topology *topology_info,
+        struct proc_topology *sibling_info, u64 ts) {
+#ifdef SMT_OVERLAP_ANY_THREAD
+        return sibling_info->overlap;
+#else
+        u64 overlap = topology_info->overlap + sibling_info->overlap;
+        u64 since = topology_info->busy_since > sibling_info->busy_since ?
+                topology_info->busy_since : sibling_info->busy_since;
+        if (topology_info->busy_since > 0 && sibling_info->busy_since > 0 && ts > since) {
+                overlap += ts - since;
+        }
+        return overlap;
+#endif
+}
+
+// cycles_thread of the ending slice executed while the sibling was busy
+static inline u64 slice_overlap_cycles(struct proc_topology *topology_info,
+        struct proc_topology *sibling_info, int old_pid, u64 *samples, u64 ts) {
+        if (sibling_info == NULL || topology_info->ts == 0) {
+                return 0;
+        }
+        u64 thread_cycles = 0;
+        if (samples[COUNTER_CYCLES_THREAD] > topology_info->counters[COUNTER_CYCLES_THREAD]) {
+                thread_cycles = samples[COUNTER_CYCLES_THREAD] - topology_info->counters[COUNTER_CYCLES_THREAD];
+        }
+#ifdef SMT_OVERLAP_ANY_THREAD
+        u64 core_cycles_sample = samples[COUNTER_CYCLES_CORE];
+        if(sibling_info->running_pid > 0 && old_pid > 0 && core_cycles_sample > topology_info->counters[COUNTER_CYCLES_CORE]) {
+                topology_info->overlap += core_cycles_sample - topology_info->counters[COUNTER_CYCLES_CORE];
+        }
+        u64 overlap_cycles = core_overlap(topology_info, sibling_info, ts) - topology_info->overlap_snapshot;
+        return overlap_cycles < thread_cycles ? overlap_cycles : thread_cycles;
+#else
+        // weight the cycles with the co-running share of the slice, in 1/1024
+        u64 slice_ns = ts - topology_info->ts;
+        u64 overlap_ns = core_overlap(topology_info, sibling_info, ts) - topology_info->overlap_snapshot;
+        if (overlap_ns >= slice_ns) {
+                return thread_cycles;
+        }
+        return thread_cycles * (overlap_ns * 1024 / slice_ns) / 1024;
+#endif
+}
+
+#ifndef SMT_OVERLAP_ANY_THREAD
+/**
+ * Track when this CPU leaves and enters idle, see core_overlap
+ */
+static inline void update_busy_state(struct proc_topology *topology_info, int new_pid, u64 ts) {
+        if (new_pid != 0 && topology_info->busy_since == 0) {
+                topology_info->busy_since = ts;
+        } else if (new_pid == 0 && topology_info->busy_since != 0) {
+                struct proc_topology *sibling_info = lookup_sibling(topology_info);
+                if (sibling_info != NULL && sibling_info->busy_since > 0) {
+                        u64 since = topology_info->busy_since > sibling_info->busy_since ?
+                                topology_info->busy_since : sibling_info->busy_since;
+                        if (ts > since) {
+                                topology_info->overlap += ts - since;
+                        }
+                }
+                topology_info->busy_since = 0;
+        }
+}
+#endif
+#endif
+
+static inline int update_cycles_count(void *ctx,
+        int old_pid, u32 epoch, u32 processor_id,
+#ifdef PERFORMANCE_COUNTERS
+        u64 *samples,
+#endif
+        u64 ts) {
+
+    int ret = 0;
+
+    // Fetch more data about processor where the sched_switch happened
+    struct proc_topology *topology_info = processors.lookup(&processor_id);
+    if(topology_info == NULL || topology_info->ht_id > NUM_CPUS) {
+            send_error(ctx, CORRUPTED_TOPOLOGY_MAP);
+            return 0;
+    }
+
+    // the final switch out of a task that exited, its status is gone
+    if (topology_info->running_pid == EXITED_TASK) {
+            return 0;
+    }
+
+    /**
+     * Fetch the status of the exiting pid.
+     * If the pid is 0 then use the slot of this processor in the idles
+     * array and update it in place.
+     * With the task storage engine the status of a regular thread is
+     * attached to its task_struct and accessed in place, it is created
+     * on its first switch out and released by the kernel on exit.
+     * With aggregation the row of its process or cgroup is updated in
+     * place, it is created by the first thread switched out.
+     * Otherwise copy it from the pids hash, it is written back at the end.
+     */
+#if !defined(AGGREGATE) && !defined(TASK_STORAGE)
+    struct pid_status status_old;
+#endif
+    struct pid_status *status_ptr = NULL;
     if(old_pid == 0) {
-            status_old.tgid = bpf_get_current_pid_tgid() >> 32;
-            idles.update(&processor_id, &status_old);
+            status_ptr = idles.lookup(&processor_id);
     } else {
-            status_old.tgid = bpf_get_current_pid_tgid() >> 32;
-            pids.update(&old_pid, &status_old);
+#if defined(AGGREGATE)
+            u64 aggregate_key = aggregate_id();
+            status_ptr = aggregates.lookup(&aggregate_key);
+            if(status_ptr == NULL) {
+                    struct pid_status status_new = {};
+                    status_new.pid = old_pid;
+                    bpf_get_current_comm(&(status_new.comm), sizeof(status_new.comm));
+                    if(aggregates.insert(&aggregate_key, &status_new) != 0) {
+                            send_error(ctx, AGGREGATES_INSERT_FAILED);
+                    }
+                    status_ptr = aggregates.lookup(&aggregate_key);
+            }
+#elif defined(TASK_STORAGE)
+            status_ptr = task_status.task_storage_get(bpf_get_current_task_btf(), 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+            if(status_ptr != NULL && status_ptr->pid != old_pid) {
+                    // storage just created for this thread
+                    status_ptr->pid = old_pid;
+                    bpf_get_current_comm(&(status_ptr->comm), sizeof(status_ptr->comm));
+            }
+#else
+            ret = bpf_probe_read(&status_old, sizeof(status_old), pids.lookup(&(old_pid)));
+            if(ret == 0) {
+                    status_ptr = &status_old;
+            }
+#endif
     }
 
+    if(status_ptr == NULL) {
+        // no data for this thread, for now do not account data
+        return 0;
+    }
+
+    if (topology_info->running_pid != old_pid) {
+        if (!reopen_migrated_slice(topology_info, old_pid, processor_id)) {
+            send_error(ctx, THREAD_MIGRATED_UNEXPECTEDLY);
+            return 0;
+        }
+        send_error(ctx, MIGRATED_SLICE_RECOVERED);
+    }
+
+#ifdef PERFORMANCE_COUNTERS
+    // Retrieving information of the sibling processor, if any
+    struct proc_topology *sibling_info = lookup_sibling(topology_info);
+    if(sibling_info == NULL && topology_info->sibling_id < NUM_CPUS) {
+        // Wrong info on topology, do nothing
+        send_error(ctx, WRONG_SIBLING_TOPOLOGY_MAP);
+        return 0;
+    }
+
+    /**
+     * Each processor only writes its own overlap and reads the sibling
+     * one, so that the siblings never write the same slot
+     */
+    topology_info->overlap_cycles = slice_overlap_cycles(topology_info, sibling_info, old_pid, samples, ts);
+#endif
+
+#ifdef PERFORMANCE_COUNTERS
+    account_pid_status(ctx, status_ptr, topology_info, old_pid, epoch, samples, ts);
+#else
+    account_pid_status(ctx, status_ptr, topology_info, old_pid, epoch, ts);
+#endif
+
+#if !defined(AGGREGATE) && !defined(TASK_STORAGE)
+    // write the pid status back to our hashmap
+    if(old_pid != 0) {
+            if(pids.update(&old_pid, status_ptr) != 0) {
+                    send_error(ctx, PIDS_INSERT_FAILED);
+            }
+    }
+#endif
+
     return 0;
 }
 
-int trace_switch(struct sched_switch_args *ctx) {
+#ifdef PERFORMANCE_COUNTERS
+static inline void scale_counter(struct counter_state *state, int counter,
+                                 struct bpf_perf_event_value *value,
+                                 u64 *window_enabled, u64 *window_running) {
+        u64 delta = value->counter - state->raw[counter];
+        u64 delta_enabled = value->enabled - state->enabled[counter];
+        u64 delta_running = value->running - state->running[counter];
+
+        if (delta_running == delta_enabled) {
+                state->scaled[counter] += delta;
+        } else if (delta_running > 0) {
+                // split the division so that delta * delta_enabled cannot overflow
+                state->scaled[counter] += delta / delta_running * delta_enabled
+                        + (delta % delta_running) * delta_enabled / delta_running;
+        }
+        state->raw[counter] = value->counter;
+        state->enabled[counter] = value->enabled;
+        state->running[counter] = value->running;
+        *window_enabled += delta_enabled;
+        *window_running += delta_running;
+}
+
+/**
+ * Read all the counters of this CPU and store their scaled values
+ * in samples, indexed by counter id
+ */
+static inline void read_counters(u32 processor_id, u32 bpf_selector, u64 *samples) {
+        struct counter_state *state = counter_states.lookup(&processor_id);
+        if (state == NULL) {
+                return;
+        }
+
+        struct bpf_perf_event_value value = {};
+        u64 window_enabled = 0;
+        u64 window_running = 0;
+        #pragma clang loop unroll(full)
+        for (int counter = 0; counter < NUM_COUNTERS; counter++) {
+                if (pmu_counters.perf_counter_value(counter * NUM_CPUS + processor_id, &value, sizeof(value)) == 0) {
+                        scale_counter(state, counter, &value, &window_enabled, &window_running);
+                }
+                samples[counter] = state->scaled[counter];
+        }
+
+        u64 *enabled_ptr = counters_enabled.lookup(&bpf_selector);
+        if (enabled_ptr != NULL) {
+                *enabled_ptr += window_enabled;
+        }
+        u64 *running_ptr = counters_running.lookup(&bpf_selector);
+        if (running_ptr != NULL) {
+                *running_ptr += window_running;
+        }
+}
+
+/**
+ * A new slice starts on processor topology_info: remember the counter
+ * values and the overlap of the core so far
+ */
+static inline void start_slice_counters(struct proc_topology *topology_info, u64 *samples, u64 ts) {
+        #pragma clang loop unroll(full)
+        for (int counter = 0; counter < NUM_COUNTERS; counter++) {
+                topology_info->counters[counter] = samples[counter];
+        }
+
+        struct proc_topology *sibling_info = lookup_sibling(topology_info);
+        if (sibling_info != NULL) {
+                topology_info->overlap_snapshot = core_overlap(topology_info, sibling_info, ts);
+        }
+        topology_info->overlap_cycles = 0;
+}
+#endif
+
+#if !defined(TASK_STORAGE) && !defined(AGGREGATE)
+static inline void create_pid_status(int pid, int tgid, char *comm, u32 epoch, u32 bpf_selector, u64 ts) {
+        struct pid_status status_new;
+        bpf_probe_read(&(status_new.comm), sizeof(status_new.comm), comm);
+
+        #pragma clang loop unroll(full)
+        for(int array_index = 0; array_index<SELECTOR_DIM; array_index++) {
+                status_new.weighted_cycles[array_index] = 0;
+                status_new.socket[array_index] = 0;
+                status_new.ts[array_index] = ts;
+                status_new.time_ns[array_index] = 0;
+                status_new.epoch[array_index] = array_index == bpf_selector ? epoch : 0;
+#ifdef PERFORMANCE_COUNTERS
+                #pragma clang loop unroll(full)
+                for(int counter = 0; counter < NUM_COUNTERS; counter++) {
+                        status_new.counters[counter][array_index] = 0;
+                }
+#endif
+        }
+        status_new.pid = pid;
+        status_new.tgid = tgid;
+        if (pids.insert(&pid, &status_new) != 0) {
+                send_error(NULL, PIDS_INSERT_FAILED);
+        }
+}
+#endif
+
+/**
+ * Account the switch from current_pid to new_pid on this CPU.
+ * Shared by the classic and the raw tracepoint programs, that only
+ * differ in how they get the pids out of their context
+ */
+static inline int handle_switch(void *ctx, int current_pid, int new_pid, int new_tgid, char *next_comm) {
 
         // Keys for the conf hash
-        int selector_key = BPF_SELECTOR_INDEX;
-        int old_selector_key = BPF_SELECTOR_INDEX_OLD;
+        int epoch_key = BPF_EPOCH_INDEX;
         int step_key = BPF_TIMESLICE;
-        int switch_count_key = BPF_SWITCH_COUNT;
 
-        // Slot iterator for the selector
-        int array_index = 0;
-
-        // Binary selector to avoid event overwriting
-        unsigned int bpf_selector = 0;
+        // Epoch of the current window and its slot in the ring
+        unsigned int epoch = 0;
         int ret = 0;
-        ret = bpf_probe_read(&bpf_selector, sizeof(bpf_selector), conf.lookup(&selector_key));
-        // If selector is not in place correctly, signal debug error and stop tracing routine
-        if (ret!= 0 || bpf_selector > 1) {
+        ret = bpf_probe_read(&epoch, sizeof(epoch), conf.lookup(&epoch_key));
+        // If the epoch is not in place correctly, signal debug error and stop tracing routine
+        if (ret!= 0 || epoch == 0) {
                 send_error(ctx, BPF_SELECTOR_NOT_IN_PLACE);
                 return 0;
         }
-
-        // Retrieve general switch count
-        unsigned int switch_count = 0;
-        ret = 0;
-        ret = bpf_probe_read(&switch_count, sizeof(switch_count), conf.lookup(&switch_count_key));
+        u32 bpf_selector = enter_epoch(epoch);
 
         /**
-         * Retrieve old selector to update switch count correctly
-         * If the current selector is still active increase the switch count
-         * otherwise reset the count and update the current selector
+         * Increase the switch count of the current selector on this CPU.
          */
-        unsigned int old_bpf_selector = 0;
-        ret = 0;
-        ret = bpf_probe_read(&old_bpf_selector, sizeof(old_bpf_selector), conf.lookup(&old_selector_key));
-        if (ret!= 0 || old_bpf_selector > 1) {
-                send_error(ctx, OLD_BPF_SELECTOR_NOT_IN_PLACE);
-                return 0;
-        } else if(old_bpf_selector != bpf_selector) {
-                switch_count = 1;
-                conf.update(&old_selector_key, &bpf_selector);
-        } else {
-                switch_count++;
+        u64 *switch_count_ptr = switch_count.lookup(&bpf_selector);
+        if (switch_count_ptr != NULL) {
+                (*switch_count_ptr)++;
         }
-        conf.update(&switch_count_key, &switch_count);
 
         /**
-         * Retrieve sampling step (dynamic window)
-         * We need this because later on we check the timestamp of the
-         * context switch, if it's higher than ts_begin_window + step
-         * we need to account the current pcm in the next time window (so in
-         * another bpf selector w.r.t. to the current one)
-         * BEWARE: increasing the step in userspace means that the next
-         *         sample is invalid. Reducing the step in userspace is not
-         *         an issue, it discards data that has already been collected
+         * Check the sampling step (dynamic window) set by userspace.
+         * The windows are delimited by the epoch, the step is only
+         * validated to catch an uninitialized conf
          */
         unsigned int step = 1000000000;
         ret = bpf_probe_read(&step, sizeof(step), conf.lookup(&step_key));
-        if (ret!= 0 || step < STEP_MIN || step > STEP_MAX) {
+        if (ret!= 0 || step < WINDOW_MIN || step > STEP_MAX) {
                 send_error(ctx, TIMESTEP_NOT_IN_PLACE);
                 return 0;
         }
@@ -456,30 +1031,24 @@ int trace_switch(struct sched_switch_args *ctx) {
          * Collect cycles and IR samples from perf arrays.
          * Save the timestamp and store the exiting pid
          */
-        u64 processor_id = bpf_get_smp_processor_id();
+        u32 processor_id = bpf_get_smp_processor_id();
 #ifdef PERFORMANCE_COUNTERS
-        u64 thread_cycles_sample = cycles_thread.perf_read(processor_id);
-        u64 core_cycles_sample = cycles_core.perf_read(processor_id);
-        u64 instruction_retired_thread = instr_thread.perf_read(processor_id);
-        u64 cache_misses_thread = cache_misses.perf_read(processor_id);
-        u64 cache_refs_thread = cache_refs.perf_read(processor_id);
+        u64 samples[NUM_COUNTERS] = {};
+        read_counters(processor_id, bpf_selector, samples);
 #endif
         u64 ts = bpf_ktime_get_ns();
-        int current_pid = ctx->prev_pid;
 
         if (ret == 0) {
 #ifdef PERFORMANCE_COUNTERS
-                update_cycles_count(ctx, current_pid, bpf_selector, step, processor_id, thread_cycles_sample, core_cycles_sample, instruction_retired_thread, cache_misses_thread, cache_refs_thread, ts);
+                update_cycles_count(ctx, current_pid, epoch, processor_id, samples, ts);
 #else
-                update_cycles_count(ctx, current_pid, bpf_selector, step, processor_id, ts);
+                update_cycles_count(ctx, current_pid, epoch, processor_id, ts);
 #endif
         }
 
         // Fetch more data about processor where the sched_switch happened
-        ret = 0;
-        struct proc_topology topology_info;
-        ret = bpf_probe_read(&topology_info, sizeof(topology_info), processors.lookup(&processor_id));
-        if(ret!= 0 || topology_info.ht_id > NUM_CPUS) {
+        struct proc_topology *topology_info = processors.lookup(&processor_id);
+        if(topology_info == NULL || topology_info->ht_id > NUM_CPUS) {
                 send_error(ctx, CORRUPTED_TOPOLOGY_MAP);
                 return 0;
         }
@@ -487,248 +1056,356 @@ int trace_switch(struct sched_switch_args *ctx) {
         //
         // handle new scheduled process
         //
-        int new_pid = ctx->next_pid;
-        struct pid_status status_new;
         if(new_pid == 0) {
-                ret = bpf_probe_read(&status_new, sizeof(status_new), idles.lookup(&(processor_id)));
-        } else {
-                ret = bpf_probe_read(&status_new, sizeof(status_new), pids.lookup(&(new_pid)));
-        }
-        //If no status for PID, then create one, otherwise update selector
-        if(ret) {
-                bpf_probe_read(&(status_new.comm), sizeof(status_new.comm), ctx->next_comm);
-
-                #pragma clang loop unroll(full)
-                for(array_index = 0; array_index<NUM_SLOTS; array_index++) {
-                        status_new.weighted_cycles[array_index] = 0;
-                }
-                #pragma clang loop unroll(full)
-                for(array_index = 0; array_index<SELECTOR_DIM; array_index++) {
-                        status_new.ts[array_index] = ts;
-                        status_new.time_ns[array_index] = 0;
-#ifdef PERFORMANCE_COUNTERS
-                        status_new.cycles[array_index] = 0;
-                        status_new.instruction_retired[array_index] = 0;
-                        status_new.cache_misses[array_index] = 0;
-                        status_new.cache_refs[array_index] = 0;
-#endif
-                }
-                status_new.pid = new_pid;
-                status_new.bpf_selector = bpf_selector;
-                if(new_pid == 0) {
-                        idles.insert(&processor_id, &status_new);
-                } else {
-                        pids.insert(&new_pid, &status_new);
+                // the idles slots exist from the start and are zeroed, just name them
+                struct pid_status *idle_status = idles.lookup(&processor_id);
+                if(idle_status != NULL && idle_status->comm[0] == '\0') {
+                        bpf_probe_read(&(idle_status->comm), sizeof(idle_status->comm), next_comm);
                 }
         }
+#if !defined(TASK_STORAGE) && !defined(AGGREGATE)
+        //If no status for PID, then create one
+        //(with TASK_STORAGE regular threads get their storage on their first switch out,
+        //with aggregation the rows are created when the first thread is switched out)
+        else if(pids.lookup(&new_pid) == NULL) {
+                create_pid_status(new_pid, new_tgid, next_comm, epoch, bpf_selector, ts);
+        }
+#endif
         //add info on new running pid into processors table
-        topology_info.running_pid = new_pid;
-        topology_info.ts = ts;
+        topology_info->running_pid = new_pid;
+        topology_info->ts = ts;
 #ifdef PERFORMANCE_COUNTERS
-        topology_info.cycles_thread = thread_cycles_sample;
-        topology_info.cycles_core_delta_sibling = 0;
-        topology_info.cycles_core = core_cycles_sample;
-        topology_info.instruction_thread = instruction_retired_thread;
-        topology_info.cache_misses = cache_misses_thread;
-        topology_info.cache_refs = cache_refs_thread;
+#ifndef SMT_OVERLAP_ANY_THREAD
+        update_busy_state(topology_info, new_pid, ts);
+#endif
+        start_slice_counters(topology_info, samples, ts);
 #endif
-        processors.update(&processor_id, &topology_info);
 
-        global_timestamps.update(&bpf_selector, &ts);
+        u64 *last_ts = global_timestamps.lookup(&bpf_selector);
+        if (last_ts != NULL) {
+                *last_ts = ts;
+        }
 
         return 0;
 
 }
 
-int trace_exit(struct sched_process_exit_args *ctx) {
+int trace_switch(struct sched_switch_args *ctx) {
+        // the tracepoint format has no tgid, it is set when the thread is switched out
+        return handle_switch(ctx, ctx->prev_pid, ctx->next_pid, 0, ctx->next_comm);
+}
 
-        // // Keys for the conf hash
-        // int selector_key = BPF_SELECTOR_INDEX;
-        // int old_selector_key = BPF_SELECTOR_INDEX_OLD;
-        // int step_key = BPF_TIMESLICE;
-        // int switch_count_key = BPF_SWITCH_COUNT;
-        //
-        //
-        // // Binary selector to avoid event overwriting
-        // unsigned int bpf_selector = 0;
-        // int ret = 0;
-        // ret = bpf_probe_read(&bpf_selector, sizeof(bpf_selector), conf.lookup(&selector_key));
-        // // If selector is not in place correctly, signal debug error and stop tracing routine
-        // if (ret!= 0 || bpf_selector > 1) {
-        //         //send_error(ctx, BPF_SELECTOR_NOT_IN_PLACE);
-        //         return 0;
-        // }
-        //
-        // unsigned int step = 1000000000;
-        // ret = bpf_probe_read(&step, sizeof(step), conf.lookup(&step_key));
-        // if (ret!= 0 || step < STEP_MIN || step > STEP_MAX) {
-        //         //send_error(ctx, TIMESTEP_NOT_IN_PLACE);
-        //         return 0;
-        // }
+#ifndef AGGREGATE
+/**
+ * Fold the slots of an exiting thread into the graveyard row of its
+ * cgroup. A slot is summed only to the graveyard slot of the same epoch,
+ * a graveyard slot left by an older epoch is replaced
+ */
+static inline void bury_foreign_cycles(struct pid_status *grave, int pid, u64 cgroup_id) {
+        // exits are rare, walking every (socket, slot) here keeps it off the switch path
+        #pragma clang loop unroll(full)
+        for (int index = 0; index < NUM_SLOTS; index++) {
+                struct socket_cycles_key key = {};
+                key.row = pid;
+                key.kind = ROW_THREAD;
+                key.index = index;
+                struct socket_cycles *value = foreign_cycles.lookup(&key);
+                if (value == NULL) {
+                        continue;
+                }
+                u32 slot = index % SELECTOR_DIM;
+                if (slot < SELECTOR_DIM && value->epoch == grave->epoch[slot]) {
+                        add_socket_cycles(grave, ROW_GRAVE, cgroup_id, slot, value->epoch,
+                                index / SELECTOR_DIM, value->cycles);
+                }
+                foreign_cycles.delete(&key);
+        }
+}
 
-        char comm[16];
-        bpf_probe_read(&(comm), sizeof(comm), ctx->comm);
-        int pid = ctx->pid;
+static inline void bury_pid_status(struct pid_status *status) {
+        u64 cgroup_id = bpf_get_current_cgroup_id();
+        struct pid_status *grave = graveyard.lookup(&cgroup_id);
+        if (grave == NULL) {
+                // first thread of the cgroup to exit, it is the whole row
+                if (graveyard.insert(&cgroup_id, status) != 0) {
+                        send_error(NULL, GRAVEYARD_INSERT_FAILED);
+                }
+                grave = graveyard.lookup(&cgroup_id);
+                if (grave != NULL) {
+                        bury_foreign_cycles(grave, status->pid, cgroup_id);
+                }
+                return;
+        }
+
+        #pragma clang loop unroll(full)
+        for (int slot = 0; slot < SELECTOR_DIM; slot++) {
+                u32 epoch = status->epoch[slot];
+                if (epoch == 0 || epoch < grave->epoch[slot]) {
+                        continue;
+                }
+                if (epoch != grave->epoch[slot]) {
+                        grave->epoch[slot] = epoch;
+                        grave->time_ns[slot] = 0;
+#ifdef PERFORMANCE_COUNTERS
+                        #pragma clang loop unroll(full)
+                        for (int counter = 0; counter < NUM_COUNTERS; counter++) {
+                                grave->counters[counter][slot] = 0;
+                        }
+#endif
+                        grave->weighted_cycles[slot] = 0;
+                }
+                grave->time_ns[slot] += status->time_ns[slot];
+                if (status->ts[slot] > grave->ts[slot]) {
+                        grave->ts[slot] = status->ts[slot];
+                }
+#ifdef PERFORMANCE_COUNTERS
+                #pragma clang loop unroll(full)
+                for (int counter = 0; counter < NUM_COUNTERS; counter++) {
+                        grave->counters[counter][slot] += status->counters[counter][slot];
+                }
+#endif
+                add_socket_cycles(grave, ROW_GRAVE, cgroup_id, slot, epoch,
+                        status->socket[slot], status->weighted_cycles[slot]);
+        }
+        grave->tgid = status->tgid;
+        bury_foreign_cycles(grave, status->pid, cgroup_id);
+}
+#endif
+
+static inline int handle_exit(void *ctx, int pid) {
         u64 ts = bpf_ktime_get_ns();
-        u64 processor_id = bpf_get_smp_processor_id();
+        u32 processor_id = bpf_get_smp_processor_id();
 
-        //
-        // // if (ret==0) {
-        // //         u64 thread_cycles_sample = cycles_thread.perf_read(processor_id);
-        // //         u64 core_cycles_sample = cycles_core.perf_read(processor_id);
-        // //         u64 instruction_retired_thread = instr_thread.perf_read(processor_id);
-        // //         update_cycles_count(ctx, pid, bpf_selector, step, processor_id, thread_cycles_sample, core_cycles_sample, instruction_retired_thread, ts);
-        // // }
-        //
-        // //account data to the father
-        // u64 tgid_pid = bpf_get_current_pid_tgid();
-        // int tgid = tgid_pid >> 32;
-        //
-        // struct pid_status tg_status;
-        // if(tgid == 0) {
-        //         ret = bpf_probe_read(&tg_status, sizeof(tg_status), idles.lookup(&(processor_id)));
-        // } else {
-        //         ret = bpf_probe_read(&tg_status, sizeof(tg_status), pids.lookup(&(tgid)));
-        // }
-        //
-        // if(ret == 0) {
-        //
-        //         //retrieve data about the exiting pid
-        //         struct pid_status status_old;
-        //         status_old.pid = -1;
-        //
-        //         /**
-        //          * Fetch the status of the exiting pid.
-        //          * If the pid is 0 then use the idles perf_hash
-        //          */
-        //         if(pid == 0) {
-        //                 ret = bpf_probe_read(&status_old, sizeof(status_old), idles.lookup(&(processor_id)));
-        //         } else {
-        //                 ret = bpf_probe_read(&status_old, sizeof(status_old), pids.lookup(&(pid)));
-        //         }
-        //
-        //         if(ret == 0) {
-        //
-        //                 // do the summation for all the sockets when the data
-        //                 // for a given socket are updated
-        //
-        //                 #pragma clang loop unroll(full)
-        //                 for(int array_index = 0; array_index<NUM_SLOTS; array_index++) {
-        //                         if(array_index % SELECTOR_DIM == bpf_selector) {
-        //                                 u64 last_ts_pid_in = status_old.ts[array_index];
-        //                                 u64 last_ts_tgid_in = tg_status.ts[array_index];
-        //
-        //                                 if(last_ts_tgid_in + step > ts) {
-        //                                         if(last_ts_pid_in + step > ts){
-        //                                                 tg_status.ts[array_index] = ts;
-        //                                                 tg_status.cycles[array_index] += status_old.cycles[array_index];
-        //                                                 tg_status.weighted_cycles[array_index] += status_old.weighted_cycles[array_index];
-        //                                                 tg_status.instruction_retired[array_index] += status_old.instruction_retired[array_index];
-        //                                                 tg_status.time_ns[array_index] += status_old.time_ns[array_index];
-        //                                                 tg_status.bpf_selector = bpf_selector;
-        //                                         }
-        //                                 } else {
-        //                                         if(last_ts_pid_in + step > ts){
-        //                                                 tg_status.ts[array_index] = ts;
-        //                                                 tg_status.cycles[array_index] = status_old.cycles[array_index];
-        //                                                 tg_status.weighted_cycles[array_index] = status_old.weighted_cycles[array_index];
-        //                                                 tg_status.instruction_retired[array_index] = status_old.instruction_retired[array_index];
-        //                                                 tg_status.time_ns[array_index] = status_old.time_ns[array_index];
-        //                                                 tg_status.bpf_selector = bpf_selector;
-        //                                         }
-        //                                 }
-        //                         }
-        //                 }
-        //
-        //                 if(tgid == 0) {
-        //                         idles.update(&processor_id, &tg_status);
-        //                 } else {
-        //                         pids.update(&tgid, &tg_status);
-        //                 }
-        //         }
-        // }
+        int epoch_key = BPF_EPOCH_INDEX;
+        u32 *epoch_ptr = conf.lookup(&epoch_key);
+        u32 epoch = epoch_ptr != NULL ? *epoch_ptr : 0;
+#ifdef PERFORMANCE_COUNTERS
+        u64 samples[NUM_COUNTERS] = {};
+        read_counters(processor_id, enter_epoch(epoch), samples);
+#endif
 
-        //send_error(ctx, tgid);
-        //send_error(ctx, pid);
+        /**
+         * Account the last slice of the thread before its status goes away,
+         * then move what it accumulated in the windows userspace did not
+         * read yet to the graveyard
+         */
+        if (epoch != 0 && pid != 0) {
+#ifdef PERFORMANCE_COUNTERS
+                update_cycles_count(ctx, pid, epoch, processor_id, samples, ts);
+#else
+                update_cycles_count(ctx, pid, epoch, processor_id, ts);
+#endif
+#if defined(TASK_STORAGE)
+                // the exiting task is the current one
+                struct pid_status *status = task_status.task_storage_get(bpf_get_current_task_btf(), 0, 0);
+#elif !defined(AGGREGATE)
+                struct pid_status *status = pids.lookup(&pid);
+#endif
+#ifndef AGGREGATE
+                if (status != NULL) {
+                        bury_pid_status(status);
+                }
+#endif
+        }
 
         //remove the pid from the table if there
+        //(with TASK_STORAGE right away too, the iterator still sees the
+        //task until it is reaped)
+#ifdef TASK_STORAGE
+        task_status.task_storage_delete(bpf_get_current_task_btf());
+#else
         pids.delete(&pid);
+#endif
+        migrations.delete(&pid);
 
-        struct proc_topology topology_info;
-        bpf_probe_read(&topology_info, sizeof(topology_info), processors.lookup(&processor_id));
+        struct proc_topology *topology_info = processors.lookup(&processor_id);
+        if(topology_info == NULL) {
+                return 0;
+        }
 
-        topology_info.running_pid = 0;
-        topology_info.ts = ts;
+        topology_info->running_pid = EXITED_TASK;
+        topology_info->ts = ts;
 #ifdef PERFORMANCE_COUNTERS
-        topology_info.cycles_thread = cycles_thread.perf_read(processor_id);
-        topology_info.cycles_core = cycles_core.perf_read(processor_id);
-        topology_info.instruction_thread = instr_thread.perf_read(processor_id);
-        topology_info.cache_misses = cache_misses.perf_read(processor_id);
-        topology_info.cache_refs = cache_refs.perf_read(processor_id);
-        topology_info.cycles_core_delta_sibling = 0;
+        start_slice_counters(topology_info, samples, ts);
 #endif
 
-        processors.update(&processor_id, &topology_info);
+        return 0;
+}
+
+int trace_exit(struct sched_process_exit_args *ctx) {
+        return handle_exit(ctx, ctx->pid);
+}
 
+#ifdef TASK_STORAGE
+/**
+ * Task iterator (libbpf only): writes the status of every live thread
+ * that has one, userspace reads them back to back once per window
+ */
+int dump_task_status(struct bpf_iter__task *ctx) {
+        struct task_struct *task = ctx->task;
+        if (task == NULL) {
+                return 0;
+        }
+        struct pid_status *status = task_status.task_storage_get(task, 0, 0);
+        if (status != NULL) {
+                bpf_seq_write(ctx->meta->seq, status, sizeof(*status));
+        }
         return 0;
 }
+#endif
 
-int timed_trace(struct bpf_perf_event_data *perf_ctx) {
+#ifdef IDLE_STATES
+#define PWR_EVENT_EXIT ((u32)-1)
 
-        // Keys for the conf hash
-        int selector_key = BPF_SELECTOR_INDEX;
-        int old_selector_key = BPF_SELECTOR_INDEX_OLD;
-        int step_key = BPF_TIMESLICE;
-        int switch_count_key = BPF_SWITCH_COUNT;
+/**
+ * The CPU enters C-state state, or leaves idle with PWR_EVENT_EXIT
+ */
+int trace_cpu_idle(struct cpu_idle_args *ctx) {
+        int zero = 0;
+        struct idle_entry *entry = idle_entries.lookup(&zero);
+        if (entry == NULL) {
+                return 0;
+        }
+
+        u64 ts = bpf_ktime_get_ns();
+        if (ctx->state != PWR_EVENT_EXIT) {
+                entry->ts = ts;
+                entry->state = ctx->state;
+                return 0;
+        }
+        if (entry->ts == 0) {
+                return 0;
+        }
 
-        // Slot iterator for the selector
-        int array_index = 0;
+        int state = entry->state < NUM_CSTATES ? entry->state : NUM_CSTATES - 1;
+        u64 *residency = cstate_residency.lookup(&state);
+        if (residency != NULL) {
+                *residency += ts - entry->ts;
+        }
+        entry->ts = 0;
+        return 0;
+}
+#endif
 
-        // Binary selector to avoid event overwriting
-        unsigned int bpf_selector = 0;
-        int ret = 0;
-        ret = bpf_probe_read(&bpf_selector, sizeof(bpf_selector), conf.lookup(&selector_key));
-        // If selector is not in place correctly, signal debug error and stop tracing routine
-        if (ret!= 0 || bpf_selector > 1) {
-                send_perf_error(perf_ctx, BPF_SELECTOR_NOT_IN_PLACE);
+/**
+ * A thread moved to another CPU. If the source CPU still has an open
+ * slice for it (its switch out there was not seen) the slice is closed:
+ * nobody owns the rest of it. The destination reopens the slice when
+ * the thread is switched out there, see reopen_migrated_slice
+ */
+int trace_migrate(struct sched_migrate_task_args *ctx) {
+        int pid = ctx->pid;
+        u32 orig_cpu = ctx->orig_cpu;
+        if (pid == 0 || ctx->orig_cpu == ctx->dest_cpu) {
                 return 0;
         }
 
+        struct proc_topology *orig_info = processors.lookup(&orig_cpu);
+        if (orig_info != NULL && orig_info->running_pid == pid) {
+                orig_info->running_pid = -1;
+        }
 
-        // Retrieve general switch count
-        unsigned int switch_count = 0;
-        ret = 0;
-        ret = bpf_probe_read(&switch_count, sizeof(switch_count), conf.lookup(&switch_count_key));
+        struct migration migration = {};
+        migration.orig_cpu = orig_cpu;
+        migration.dest_cpu = ctx->dest_cpu;
+        migrations.update(&pid, &migration);
+        return 0;
+}
 
-        /**
-         * Retrieve old selector to update switch count correctly
-         */
-        unsigned int old_bpf_selector = 0;
-        ret = 0;
-        ret = bpf_probe_read(&old_bpf_selector, sizeof(old_bpf_selector), conf.lookup(&old_selector_key));
-        if (ret!= 0 || old_bpf_selector > 1) {
-                send_perf_error(perf_ctx, OLD_BPF_SELECTOR_NOT_IN_PLACE);
+/**
+ * Raw tracepoints get the task_structs of the scheduler instead of the
+ * fields copied into the perf trace buffer for classic tracepoints.
+ * The fields are read with explicit probe reads, bcc leaves them alone
+ * and with libbpf they are relocated against the kernel BTF. With libbpf
+ * the raw mode attaches the BTF tracepoints below instead
+ */
+
+static inline int switch_tasks(void *ctx, struct task_struct *prev, struct task_struct *next) {
+        int prev_pid = 0;
+        int next_pid = 0;
+        int next_tgid = 0;
+        char next_comm[TASK_COMM_LEN] = {};
+        bpf_probe_read_kernel(&prev_pid, sizeof(prev_pid), &prev->pid);
+        bpf_probe_read_kernel(&next_pid, sizeof(next_pid), &next->pid);
+        bpf_probe_read_kernel(&next_tgid, sizeof(next_tgid), &next->tgid);
+        bpf_probe_read_kernel(&next_comm, sizeof(next_comm), &next->comm);
+        return handle_switch(ctx, prev_pid, next_pid, next_tgid, next_comm);
+}
+
+// TP_PROTO(bool preempt, struct task_struct *prev, struct task_struct *next, ...)
+int raw_trace_switch(struct bpf_raw_tracepoint_args *ctx) {
+        return switch_tasks(ctx, (struct task_struct *)ctx->args[1], (struct task_struct *)ctx->args[2]);
+}
+
+// TP_PROTO(struct task_struct *p, ...)
+int raw_trace_exit(struct bpf_raw_tracepoint_args *ctx) {
+        struct task_struct *p = (struct task_struct *)ctx->args[0];
+        int pid = 0;
+        bpf_probe_read_kernel(&pid, sizeof(pid), &p->pid);
+        return handle_exit(ctx, pid);
+}
+
+/**
+ * Account the slice of the task running on this CPU up to now and start
+ * a new one, so that tasks running for longer than a window are split
+ * among the windows they run in. Called by a CPU_CLOCK perf event or by
+ * the window timers
+ */
+#ifdef SAMPLING_ENGINE
+/**
+ * Without the sched_switch programs nothing tracks which task runs on a
+ * CPU: each sample gives the whole interval since the previous sample on
+ * the CPU to the task it interrupted. Cycles, instructions and time are
+ * then statistical estimates, whose error userspace bounds from the
+ * number of samples in the window.
+ */
+static inline void claim_sampled_slice(u32 processor_id, int current_pid,
+        u32 epoch, u32 bpf_selector, u64 ts) {
+        struct proc_topology *topology_info = processors.lookup(&processor_id);
+        if (topology_info == NULL) {
+                return;
+        }
+        topology_info->running_pid = current_pid;
+#if defined(PERFORMANCE_COUNTERS) && !defined(SMT_OVERLAP_ANY_THREAD)
+        update_busy_state(topology_info, current_pid, ts);
+#endif
+#if !defined(TASK_STORAGE) && !defined(AGGREGATE)
+        if (current_pid != 0 && pids.lookup(&current_pid) == NULL) {
+                char comm[TASK_COMM_LEN] = {};
+                bpf_get_current_comm(&comm, sizeof(comm));
+                create_pid_status(current_pid, bpf_get_current_pid_tgid() >> 32, comm,
+                        epoch, bpf_selector, ts);
+        }
+#endif
+}
+#endif
+
+static inline int account_running_task(void *ctx) {
+
+        // Keys for the conf hash
+        int epoch_key = BPF_EPOCH_INDEX;
+        int step_key = BPF_TIMESLICE;
+
+        // Epoch of the current window and its slot in the ring
+        unsigned int epoch = 0;
+        int ret = 0;
+        ret = bpf_probe_read(&epoch, sizeof(epoch), conf.lookup(&epoch_key));
+        // If the epoch is not in place correctly, signal debug error and stop tracing routine
+        if (ret!= 0 || epoch == 0) {
+                send_error(ctx, BPF_SELECTOR_NOT_IN_PLACE);
                 return 0;
-        } else if(old_bpf_selector != bpf_selector) {
-                switch_count = 1;
-                conf.update(&switch_count_key, &switch_count);
-                conf.update(&old_selector_key, &bpf_selector);
         }
+        u32 bpf_selector = enter_epoch(epoch);
+
 
         /**
-         * Retrieve sampling step (dynamic window)
-         * We need this because later on we check the timestamp of the
-         * context switch, if it's higher than ts_begin_window + step
-         * we need to account the current pcm in the next time window (so in
-         * another bpf selector w.r.t. to the current one)
-         * BEWARE: increasing the step in userspace means that the next
-         *         sample is invalid. Reducing the step in userspace is not
-         *         an issue, it discards data that has already been collected
+         * Check the sampling step (dynamic window) set by userspace,
+         * see handle_switch
          */
         unsigned int step = 1000000000;
         ret = bpf_probe_read(&step, sizeof(step), conf.lookup(&step_key));
-        if (ret!= 0 || step < STEP_MIN || step > STEP_MAX) {
-                send_perf_error(perf_ctx, TIMESTEP_NOT_IN_PLACE);
+        if (ret!= 0 || step < WINDOW_MIN || step > STEP_MAX) {
+                send_error(ctx, TIMESTEP_NOT_IN_PLACE);
                 return 0;
         }
 
@@ -737,50 +1414,167 @@ int timed_trace(struct bpf_perf_event_data *perf_ctx) {
         /* Read the values of the performance counters to update the data
          * inside our hashmap
          */
-        u64 processor_id = bpf_get_smp_processor_id();
+        u32 processor_id = bpf_get_smp_processor_id();
 #ifdef PERFORMANCE_COUNTERS
-        u64 thread_cycles_sample = cycles_thread.perf_read(processor_id);
-        u64 core_cycles_sample = cycles_core.perf_read(processor_id);
-        u64 instruction_retired_thread = instr_thread.perf_read(processor_id);
-        u64 cache_misses_thread = cache_misses.perf_read(processor_id);
-        u64 cache_refs_thread = cache_refs.perf_read(processor_id);
+        u64 samples[NUM_COUNTERS] = {};
+        read_counters(processor_id, bpf_selector, samples);
 #endif
         u64 ts = bpf_ktime_get_ns();
+#ifdef SAMPLING_ENGINE
+        claim_sampled_slice(processor_id, current_pid, epoch, bpf_selector, ts);
+#endif
 
         if (ret == 0) {
 #ifdef PERFORMANCE_COUNTERS
-                update_cycles_count(perf_ctx, current_pid, bpf_selector, step, processor_id, thread_cycles_sample, core_cycles_sample, instruction_retired_thread, cache_misses_thread, cache_refs_thread, ts);
+                update_cycles_count(ctx, current_pid, epoch, processor_id, samples, ts);
 #else
-                update_cycles_count(perf_ctx, current_pid, bpf_selector, step, processor_id, ts);
+                update_cycles_count(ctx, current_pid, epoch, processor_id, ts);
 #endif
         }
 
 
         // Fetch more data about processor we are currently dealing with
-        ret = 0;
-        struct proc_topology topology_info;
-        ret = bpf_probe_read(&topology_info, sizeof(topology_info), processors.lookup(&processor_id));
-        if(ret!= 0 || topology_info.ht_id > NUM_CPUS) {
-                send_perf_error(perf_ctx, CORRUPTED_TOPOLOGY_MAP);
+        struct proc_topology *topology_info = processors.lookup(&processor_id);
+        if(topology_info == NULL || topology_info->ht_id > NUM_CPUS) {
+                send_error(ctx, CORRUPTED_TOPOLOGY_MAP);
                 return 0;
         }
 
         //update topology info since we are forcing the update with a timer
-        topology_info.running_pid = current_pid;
-        topology_info.ts = ts;
+        //(a task that exited keeps its mark until its final switch out)
+        if (topology_info->running_pid != EXITED_TASK) {
+                topology_info->running_pid = current_pid;
+        }
+        topology_info->ts = ts;
 #ifdef PERFORMANCE_COUNTERS
-        topology_info.cycles_thread = thread_cycles_sample;
-        topology_info.cycles_core_delta_sibling = 0;
-        topology_info.cycles_core = core_cycles_sample;
-        topology_info.instruction_thread = instruction_retired_thread;
-        topology_info.cache_misses = cache_misses_thread;
-        topology_info.cache_refs = cache_refs_thread;
+        start_slice_counters(topology_info, samples, ts);
 #endif
-        processors.update(&processor_id, &topology_info);
 
-        global_timestamps.update(&bpf_selector, &ts);
+        u64 *last_ts = global_timestamps.lookup(&bpf_selector);
+        if (last_ts != NULL) {
+                *last_ts = ts;
+        }
+
+        return 0;
+}
+
+int timed_trace(struct bpf_perf_event_data *perf_ctx) {
+        return account_running_task(perf_ctx);
+}
+
+#ifdef WINDOW_TIMERS
+/**
+ * In fixed window mode the running slices can be split by per-CPU BPF
+ * timers instead of the CPU_CLOCK perf event, that wakes up idle CPUs
+ * at every period. The timer of a CPU is armed when it switches to a
+ * task and cancelled when it goes idle, and it accounts the running task
+ * only once it has been running for a whole window.
+ * Tracepoint and raw tracepoint programs cannot use timers, the switch
+ * is traced by a BTF tracepoint (libbpf only)
+ */
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+struct window_timer {
+        struct bpf_timer timer;
+        u32 initialized;
+        u32 armed;
+};
+BPF_ARRAY(window_timers, struct window_timer, NUM_CPUS);
+
+// the window length set by userspace, 0 if it is not in place
+static inline u64 window_period() {
+        int step_key = BPF_TIMESLICE;
+        unsigned int step = 0;
+        int ret = bpf_probe_read(&step, sizeof(step), conf.lookup(&step_key));
+        if (ret != 0 || step < WINDOW_MIN || step > STEP_MAX) {
+                return 0;
+        }
+        return step;
+}
 
-        send_perf_error(perf_ctx, BPF_PROCEED_WITH_DEBUG_MODE);
+static int window_timer_fired(void *map, int *key, struct window_timer *window_timer) {
+        u32 processor_id = bpf_get_smp_processor_id();
+        u64 period = window_period();
+        struct proc_topology *topology_info = processors.lookup(&processor_id);
+        // the timer fired away from its CPU, the next switch there arms it again
+        if (period == 0 || *key != processor_id || topology_info == NULL) {
+                window_timer->armed = 0;
+                return 0;
+        }
+
+        // the CPU switched task since the timer was armed: wait until the
+        // current slice is one window long
+        u64 running_ns = bpf_ktime_get_ns() - topology_info->ts;
+        if (running_ns < period) {
+                bpf_timer_start(&window_timer->timer, period - running_ns, 0);
+                return 0;
+        }
 
+        account_running_task(NULL);
+        bpf_timer_start(&window_timer->timer, period, 0);
         return 0;
 }
+
+static inline void arm_window_timer(int next_pid) {
+        u32 processor_id = bpf_get_smp_processor_id();
+        struct window_timer *window_timer = window_timers.lookup(&processor_id);
+        if (window_timer == NULL) {
+                return;
+        }
+
+        if (next_pid == 0) {
+                if (window_timer->armed) {
+                        bpf_timer_cancel(&window_timer->timer);
+                        window_timer->armed = 0;
+                }
+                return;
+        }
+
+        u64 period = window_period();
+        if (window_timer->armed || period == 0) {
+                return;
+        }
+        if (!window_timer->initialized) {
+                bpf_timer_init(&window_timer->timer, &window_timers, CLOCK_MONOTONIC);
+                bpf_timer_set_callback(&window_timer->timer, window_timer_fired);
+                window_timer->initialized = 1;
+        }
+        if (bpf_timer_start(&window_timer->timer, period, 0) == 0) {
+                window_timer->armed = 1;
+        }
+}
+#endif
+
+#if defined(CORE) && !defined(KERNEL_HEADERS)
+/**
+ * BTF tracepoints (libbpf only) get the raw tracepoint arguments typed by
+ * the kernel BTF: the verifier knows that they are task_structs, so their
+ * fields are read directly instead of with probe reads. The raw mode uses
+ * them with libbpf, and the window timers need them. Objects built on the
+ * kernel headers, for kernels without BTF, use the raw tracepoints above
+ */
+struct btf_trace_args {
+        u64 args[3];
+};
+
+// TP_PROTO(bool preempt, struct task_struct *prev, struct task_struct *next, ...)
+int btf_sched_switch(struct btf_trace_args *ctx) {
+        struct task_struct *prev = (struct task_struct *)ctx->args[1];
+        struct task_struct *next = (struct task_struct *)ctx->args[2];
+        char next_comm[TASK_COMM_LEN];
+        __builtin_memcpy(next_comm, next->comm, sizeof(next_comm));
+        handle_switch(ctx, prev->pid, next->pid, next->tgid, next_comm);
+#ifdef WINDOW_TIMERS
+        arm_window_timer(next->pid);
+#endif
+        return 0;
+}
+
+// TP_PROTO(struct task_struct *p)
+int btf_sched_process_exit(struct btf_trace_args *ctx) {
+        struct task_struct *p = (struct task_struct *)ctx->args[0];
+        return handle_exit(ctx, p->pid);
+}
+#endif
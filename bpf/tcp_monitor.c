@@ -19,6 +19,7 @@
 */
 
 #include <uapi/linux/ptrace.h>
+#include <linux/version.h>
 #include <net/sock.h>
 #include <bcc/proto.h>
 //#define KBUILD_MODNAME "foo"
@@ -29,6 +30,32 @@
 #include <linux/netfilter.h>
 #include <net/netfilter/nf_tables.h>
 
+// the libbpf build (CORE) on vmlinux.h has the kernel types, not its macros,
+// without kernel BTF it is built on the kernel headers (KERNEL_HEADERS)
+#if defined(CORE) && !defined(KERNEL_HEADERS)
+#define AF_INET 2
+#define AF_INET6 10
+#define NET_RX_SUCCESS 0
+#define ntohs(x) bpf_ntohs(x)
+
+static inline unsigned char *skb_network_header(const struct sk_buff *skb) {
+  return skb->head + skb->network_header;
+}
+
+static inline unsigned char *skb_transport_header(const struct sk_buff *skb) {
+  return skb->head + skb->transport_header;
+}
+#endif
+
+// BCC turns the dereference of a probe argument into a probe read, fentry
+// programs read it through the kernel BTF, kprobes built on the kernel
+// headers need the explicit probe read
+#ifdef KERNEL_HEADERS
+#define READ_KERNEL(ptr, field) ({ typeof((ptr)->field) __val; bpf_probe_read(&__val, sizeof(__val), &(ptr)->field); __val; })
+#else
+#define READ_KERNEL(ptr, field) ((ptr)->field)
+#endif
+
 // #define LATENCY_SAMPLES 128
 #define PAYLOAD_LEN 68
 
@@ -143,39 +170,96 @@ struct msg_t {
   struct msghdr *msg;
 };
 
-#define BPF_SELECTOR_INDEX 0
+/*
+ * conf[0] holds the epoch of the current window, set by userspace.
+ * Each slot is a separate set of tables that userspace clears once
+ * drained, epoch e writes the tables of slot e % SELECTOR_DIM
+ */
+#define BPF_EPOCH_INDEX 0
+#define SELECTOR_DIM 2
 #define BPF_SELECTOR_ZERO 0
 #define BPF_SELECTOR_ONE 1
 BPF_ARRAY(conf, u32, 2);
 
-BPF_HASH(ipv4_endpoints, struct ipv4_endpoint_key_t, struct endpoint_data_t, 100000);
-BPF_HASH(ipv6_endpoints, struct ipv6_endpoint_key_t, struct endpoint_data_t, 100000);
-BPF_HASH(ipv4_connections, struct ipv4_key_t, struct connection_data_t, 100000);
-BPF_HASH(ipv6_connections, struct ipv6_key_t, struct connection_data_t, 100000);
+static inline unsigned int current_selector() {
+  int epoch_key = BPF_EPOCH_INDEX;
+  unsigned int epoch = 0;
+  bpf_probe_read(&epoch, sizeof(epoch), conf.lookup(&epoch_key));
+  return epoch % SELECTOR_DIM;
+}
+
+/*
+ * Capacity of the maps, set from userspace (map_sizes in config.yaml), the
+ * ipv4 and ipv6 maps and the two selectors of a table share the same one.
+ * The summary, latency and rewritten rules tables are drained every
+ * window: a row that does not fit in a full one is counted in
+ * failed_inserts instead. The endpoints, connections and the caches hold
+ * state that is released on close or on return, they are LRU so that the
+ * rows of a missed event age out instead of filling them. The libbpf build
+ * (CORE) sizes them at load time, with the defaults of
+ * bpf_build.LOAD_TIME_DEFAULTS
+ */
+#ifndef CORE
+#ifndef ENDPOINTS_MAP_SIZE
+#define ENDPOINTS_MAP_SIZE 100000
+#endif
+#ifndef CONNECTIONS_MAP_SIZE
+#define CONNECTIONS_MAP_SIZE 100000
+#endif
+#ifndef SUMMARY_MAP_SIZE
+#define SUMMARY_MAP_SIZE 10240
+#endif
+#ifndef HTTP_SUMMARY_MAP_SIZE
+#define HTTP_SUMMARY_MAP_SIZE 10240
+#endif
+#ifndef LATENCY_MAP_SIZE
+#define LATENCY_MAP_SIZE 60000
+#endif
+#ifndef HTTP_LATENCY_MAP_SIZE
+#define HTTP_LATENCY_MAP_SIZE 60000
+#endif
+#ifndef SET_STATE_CACHE_MAP_SIZE
+#define SET_STATE_CACHE_MAP_SIZE 10240
+#endif
+#ifndef RECV_CACHE_MAP_SIZE
+#define RECV_CACHE_MAP_SIZE 90000
+#endif
+#ifndef REWRITE_CACHE_MAP_SIZE
+#define REWRITE_CACHE_MAP_SIZE 10240
+#endif
+#ifndef REWRITTEN_RULES_MAP_SIZE
+#define REWRITTEN_RULES_MAP_SIZE 10240
+#endif
+#endif
+
+BPF_LRU_HASH(ipv4_endpoints, struct ipv4_endpoint_key_t, struct endpoint_data_t, ENDPOINTS_MAP_SIZE);
+BPF_LRU_HASH(ipv6_endpoints, struct ipv6_endpoint_key_t, struct endpoint_data_t, ENDPOINTS_MAP_SIZE);
+BPF_LRU_HASH(ipv4_connections, struct ipv4_key_t, struct connection_data_t, CONNECTIONS_MAP_SIZE);
+BPF_LRU_HASH(ipv6_connections, struct ipv6_key_t, struct connection_data_t, CONNECTIONS_MAP_SIZE);
 
 // selector 0
-BPF_HASH(ipv4_summary, struct ipv4_key_t, struct summary_data_t);
-BPF_HASH(ipv6_summary, struct ipv6_key_t, struct summary_data_t);
-BPF_HASH(ipv4_http_summary, struct ipv4_http_key_t, struct summary_data_t);
-BPF_HASH(ipv6_http_summary, struct ipv6_http_key_t, struct summary_data_t);
-BPF_HASH(ipv4_latency, struct ipv4_key_t, struct latency_data_t, 60000);
-BPF_HASH(ipv6_latency, struct ipv6_key_t, struct latency_data_t, 60000);
-BPF_HASH(ipv4_http_latency, struct ipv4_http_key_t, struct latency_data_t, 60000);
-BPF_HASH(ipv6_http_latency, struct ipv6_http_key_t, struct latency_data_t, 60000);
+BPF_HASH(ipv4_summary, struct ipv4_key_t, struct summary_data_t, SUMMARY_MAP_SIZE);
+BPF_HASH(ipv6_summary, struct ipv6_key_t, struct summary_data_t, SUMMARY_MAP_SIZE);
+BPF_HASH(ipv4_http_summary, struct ipv4_http_key_t, struct summary_data_t, HTTP_SUMMARY_MAP_SIZE);
+BPF_HASH(ipv6_http_summary, struct ipv6_http_key_t, struct summary_data_t, HTTP_SUMMARY_MAP_SIZE);
+BPF_HASH(ipv4_latency, struct ipv4_key_t, struct latency_data_t, LATENCY_MAP_SIZE);
+BPF_HASH(ipv6_latency, struct ipv6_key_t, struct latency_data_t, LATENCY_MAP_SIZE);
+BPF_HASH(ipv4_http_latency, struct ipv4_http_key_t, struct latency_data_t, HTTP_LATENCY_MAP_SIZE);
+BPF_HASH(ipv6_http_latency, struct ipv6_http_key_t, struct latency_data_t, HTTP_LATENCY_MAP_SIZE);
 
 // selector 1
-BPF_HASH(ipv4_summary_1, struct ipv4_key_t, struct summary_data_t);
-BPF_HASH(ipv6_summary_1, struct ipv6_key_t, struct summary_data_t);
-BPF_HASH(ipv4_http_summary_1, struct ipv4_http_key_t, struct summary_data_t);
-BPF_HASH(ipv6_http_summary_1, struct ipv6_http_key_t, struct summary_data_t);
-BPF_HASH(ipv4_latency_1, struct ipv4_key_t, struct latency_data_t, 60000);
-BPF_HASH(ipv6_latency_1, struct ipv6_key_t, struct latency_data_t, 60000);
-BPF_HASH(ipv4_http_latency_1, struct ipv4_http_key_t, struct latency_data_t, 60000);
-BPF_HASH(ipv6_http_latency_1, struct ipv6_http_key_t, struct latency_data_t, 60000);
+BPF_HASH(ipv4_summary_1, struct ipv4_key_t, struct summary_data_t, SUMMARY_MAP_SIZE);
+BPF_HASH(ipv6_summary_1, struct ipv6_key_t, struct summary_data_t, SUMMARY_MAP_SIZE);
+BPF_HASH(ipv4_http_summary_1, struct ipv4_http_key_t, struct summary_data_t, HTTP_SUMMARY_MAP_SIZE);
+BPF_HASH(ipv6_http_summary_1, struct ipv6_http_key_t, struct summary_data_t, HTTP_SUMMARY_MAP_SIZE);
+BPF_HASH(ipv4_latency_1, struct ipv4_key_t, struct latency_data_t, LATENCY_MAP_SIZE);
+BPF_HASH(ipv6_latency_1, struct ipv6_key_t, struct latency_data_t, LATENCY_MAP_SIZE);
+BPF_HASH(ipv4_http_latency_1, struct ipv4_http_key_t, struct latency_data_t, HTTP_LATENCY_MAP_SIZE);
+BPF_HASH(ipv6_http_latency_1, struct ipv6_http_key_t, struct latency_data_t, HTTP_LATENCY_MAP_SIZE);
 
 
-BPF_HASH(set_state_cache, struct sock *, struct endpoint_data_t);
-BPF_HASH(recv_cache, struct sock *, struct msg_t, 90000);
+BPF_LRU_HASH(set_state_cache, struct sock *, struct endpoint_data_t, SET_STATE_CACHE_MAP_SIZE);
+BPF_LRU_HASH(recv_cache, struct sock *, struct msg_t, RECV_CACHE_MAP_SIZE);
 
 struct iptables_data_t {
   u32 saddr;
@@ -186,9 +270,9 @@ struct iptables_data_t {
   struct sk_buff *skb;
 };
 
-BPF_HASH(iptables_rewrite_cache_in, u64, struct iptables_data_t);
-BPF_HASH(iptables_rewrite_cache_out, u64, struct iptables_data_t);
-BPF_HASH(rewritten_rules, struct ipv4_endpoint_key_t, struct ipv4_endpoint_key_t);
+BPF_LRU_HASH(iptables_rewrite_cache_in, u64, struct iptables_data_t, REWRITE_CACHE_MAP_SIZE);
+BPF_LRU_HASH(iptables_rewrite_cache_out, u64, struct iptables_data_t, REWRITE_CACHE_MAP_SIZE);
+BPF_HASH(rewritten_rules, struct ipv4_endpoint_key_t, struct ipv4_endpoint_key_t, REWRITTEN_RULES_MAP_SIZE);
 
 struct iptables6_data_t {
   unsigned __int128 saddr;
@@ -200,10 +284,58 @@ struct iptables6_data_t {
   struct sk_buff *skb;
 };
 
-BPF_HASH(iptables6_rewrite_cache_in, u64, struct iptables6_data_t);
-BPF_HASH(iptables6_rewrite_cache_out, u64, struct iptables6_data_t);
-BPF_HASH(rewritten_rules_6, struct ipv6_endpoint_key_t, struct ipv6_endpoint_key_t);
+BPF_LRU_HASH(iptables6_rewrite_cache_in, u64, struct iptables6_data_t, REWRITE_CACHE_MAP_SIZE);
+BPF_LRU_HASH(iptables6_rewrite_cache_out, u64, struct iptables6_data_t, REWRITE_CACHE_MAP_SIZE);
+BPF_HASH(rewritten_rules_6, struct ipv6_endpoint_key_t, struct ipv6_endpoint_key_t, REWRITTEN_RULES_MAP_SIZE);
 
+/*
+ * per-CPU count of the rows that did not fit in a full table, indexed by
+ * FAILED_*, userspace reads them once per window
+ */
+#define FAILED_SUMMARY 0
+#define FAILED_HTTP_SUMMARY 1
+#define FAILED_LATENCY 2
+#define FAILED_HTTP_LATENCY 3
+#define FAILED_REWRITTEN_RULES 4
+#define NUM_FAILED_INSERTS 5
+BPF_PERCPU_ARRAY(failed_inserts, u64, NUM_FAILED_INSERTS);
+
+static inline void failed_insert(int table) {
+  u64 *count = failed_inserts.lookup(&table);
+  if(count != NULL) {
+    (*count)++;
+  }
+}
+
+
+// iovec of the data of a message, the iov of an iov_iter is __iov since 6.4
+#if defined(CORE) && !defined(KERNEL_HEADERS)
+struct iov_iter___iov {
+  const struct iovec *iov;
+} __attribute__((preserve_access_index));
+
+struct iov_iter___uiov {
+  const struct iovec *__iov;
+} __attribute__((preserve_access_index));
+
+static inline const struct iovec *msg_iov(struct msghdr *msg) {
+  struct iov_iter___iov *iter = (void *)&msg->msg_iter;
+  if (bpf_core_field_exists(iter->iov)) {
+    return BPF_CORE_READ(iter, iov);
+  }
+  return BPF_CORE_READ((struct iov_iter___uiov *)iter, __iov);
+}
+#else
+static inline const struct iovec *msg_iov(struct msghdr *msg) {
+  struct iov_iter iter;
+  bpf_probe_read(&iter, sizeof(iter), &msg->msg_iter);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+  return iter.__iov;
+#else
+  return iter.iov;
+#endif
+}
+#endif
 
 static void safe_array_write(u32 idx, u64* array, u64 value) {
   #pragma clang loop unroll(full)
@@ -249,20 +381,19 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 #endif
 
   struct latency_data_t latency_zero = {};
-  int write_config = BPF_SELECTOR_INDEX;
   u64 ts = bpf_ktime_get_ns();
   //get dport and lport
   int ret;
-  u16 lport = sk->__sk_common.skc_num;
-  u16 dport = sk->__sk_common.skc_dport;
+  u16 lport = READ_KERNEL(sk, __sk_common.skc_num);
+  u16 dport = READ_KERNEL(sk, __sk_common.skc_dport);
   dport = ntohs(dport);
 
   //detect socket family and then detect tcp socket states
-  u16 family = sk->__sk_common.skc_family;
+  u16 family = READ_KERNEL(sk, __sk_common.skc_family);
 
   if(family == AF_INET) {
-    u32 saddr = sk->__sk_common.skc_rcv_saddr;
-    u32 daddr = sk->__sk_common.skc_daddr;
+    u32 saddr = READ_KERNEL(sk, __sk_common.skc_rcv_saddr);
+    u32 daddr = READ_KERNEL(sk, __sk_common.skc_daddr);
 
     if(state == TCP_SYN_SENT) {
 
@@ -353,8 +484,7 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
               if(selector_value == BPF_SELECTOR_ZERO) {
                 ret = bpf_probe_read(&summary_data, sizeof(summary_data), ipv4_http_summary.lookup(&http_key));
@@ -386,14 +516,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv4_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv4_http_latency.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 }
                 http_key.slot = 0;
@@ -419,14 +553,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv4_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv4_http_latency.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 }
                 http_key.slot = 0;
@@ -438,9 +576,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv4_http_summary_1.update(&http_key, &summary_data);
+                if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               } else {
-                ipv4_http_summary.update(&http_key, &summary_data);
+                if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               }
 
 #ifdef BYPASS
@@ -472,9 +614,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv4_http_summary.update(&http_key, &summary_data);
+                  if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
 
                 rewritten_rules.delete(&endpoint_key);
@@ -509,9 +655,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv4_http_summary.update(&http_key, &summary_data);
+                  if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
 
                 rewritten_rules.delete(&endpoint_key);
@@ -538,8 +688,7 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data = {};
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
               if(connection_data->dyn_port_masking_count < DYN_TCP_CLIENT_PORT_MASKING_THRESHOLD) {
@@ -582,14 +731,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv4_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv4_latency.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_latency.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 }
                 connection_key.slot = 0;
@@ -615,14 +768,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv4_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv4_latency.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv4_latency.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 }
                 connection_key.slot = 0;
@@ -634,9 +791,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv4_summary_1.update(&connection_key, &summary_data);
+                if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               } else {
-                ipv4_summary.update(&connection_key, &summary_data);
+                if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               }
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
@@ -672,9 +833,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_summary_1.update(&connection_key, &summary_data);
+                  if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv4_summary.update(&connection_key, &summary_data);
+                  if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
 
                 rewritten_rules.delete(&endpoint_key);
@@ -703,9 +868,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_summary_1.update(&connection_key, &summary_data);
+                  if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv4_summary.update(&connection_key, &summary_data);
+                  if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
 
                 rewritten_rules.delete(&endpoint_key);
@@ -861,8 +1030,7 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
               if(selector_value == BPF_SELECTOR_ZERO) {
                 ret = bpf_probe_read(&summary_data, sizeof(summary_data), ipv6_http_summary.lookup(&http_key));
@@ -896,14 +1064,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv6_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv6_http_latency.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 }
                 http_key.slot = 0;
@@ -929,14 +1101,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv6_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv6_http_latency.lookup_or_init(&http_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_HTTP_LATENCY);
                   }
                 }
                 http_key.slot = 0;
@@ -948,9 +1124,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv6_http_summary_1.update(&http_key, &summary_data);
+                if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               } else {
-                ipv6_http_summary.update(&http_key, &summary_data);
+                if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               }
 
 #ifdef BYPASS
@@ -983,9 +1163,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv6_http_summary.update(&http_key, &summary_data);
+                  if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
 
                 rewritten_rules_6.delete(&endpoint_key);
@@ -1021,9 +1205,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv6_http_summary.update(&http_key, &summary_data);
+                  if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
 
                 rewritten_rules_6.delete(&endpoint_key);
@@ -1049,8 +1237,7 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data = {};
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
               if(connection_data->dyn_port_masking_count < DYN_TCP_CLIENT_PORT_MASKING_THRESHOLD) {
@@ -1092,14 +1279,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv6_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv6_latency.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_latency.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 }
                 connection_key.slot = 0;
@@ -1125,14 +1316,18 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 
                 // write to the table pointed by the selector
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  struct latency_data_t * row = ipv6_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 } else {
-                  struct latency_data_t * row = ipv6_latency.lookup_or_init(&connection_key, &latency_zero);
+                  struct latency_data_t * row = ipv6_latency.lookup_or_try_init(&connection_key, &latency_zero);
                   if(row != NULL) {
                     safe_array_write(col, row->latency_vector, delta);
+                  } else {
+                    failed_insert(FAILED_LATENCY);
                   }
                 }
                 connection_key.slot = 0;
@@ -1144,9 +1339,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv6_summary_1.update(&connection_key, &summary_data);
+                if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               } else {
-                ipv6_summary.update(&connection_key, &summary_data);
+                if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               }
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
@@ -1180,9 +1379,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_summary_1.update(&connection_key, &summary_data);
+                  if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv6_summary.update(&connection_key, &summary_data);
+                  if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
 
                 rewritten_rules_6.delete(&endpoint_key);
@@ -1210,9 +1413,13 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_summary_1.update(&connection_key, &summary_data);
+                  if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv6_summary.update(&connection_key, &summary_data);
+                  if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
 
                 rewritten_rules_6.delete(&endpoint_key);
@@ -1288,17 +1495,16 @@ TRACEPOINT_PROBE(sock, inet_sock_set_state) {
 int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg, size_t size) {
   u64 ts = bpf_ktime_get_ns();
   struct latency_data_t latency_zero = {};
-  int write_config = BPF_SELECTOR_INDEX;
 
-  u16 lport = sk->__sk_common.skc_num;
-  u16 dport = sk->__sk_common.skc_dport;
+  u16 lport = READ_KERNEL(sk, __sk_common.skc_num);
+  u16 dport = READ_KERNEL(sk, __sk_common.skc_dport);
   dport = ntohs(dport);
 
-  u16 family = sk->__sk_common.skc_family;
+  u16 family = READ_KERNEL(sk, __sk_common.skc_family);
 
   if (family == AF_INET) {
-    u32 saddr = sk->__sk_common.skc_rcv_saddr;
-    u32 daddr = sk->__sk_common.skc_daddr;
+    u32 saddr = READ_KERNEL(sk, __sk_common.skc_rcv_saddr);
+    u32 daddr = READ_KERNEL(sk, __sk_common.skc_daddr);
 
     //check if I am a server or a client
     struct ipv4_endpoint_key_t endpoint_key = {.addr = saddr, .port = lport};
@@ -1366,8 +1572,7 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
               if(selector_value == BPF_SELECTOR_ZERO) {
                 bpf_probe_read(&summary_data, sizeof(summary_data), ipv4_http_summary.lookup(&http_key));
@@ -1395,14 +1600,18 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv4_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv4_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv4_http_latency.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv4_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               }
               http_key.slot = 0;
@@ -1415,9 +1624,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv4_http_summary_1.update(&http_key, &summary_data);
+                if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               } else {
-                ipv4_http_summary.update(&http_key, &summary_data);
+                if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               }
 
 #ifdef BYPASS
@@ -1438,9 +1651,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv4_http_summary.update(&http_key, &summary_data);
+                  if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -1456,9 +1673,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv4_http_summary.update(&http_key, &summary_data);
+                  if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -1471,8 +1692,7 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
               if(connection_data->dyn_port_masking_count < DYN_TCP_CLIENT_PORT_MASKING_THRESHOLD) {
@@ -1507,14 +1727,18 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv4_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv4_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv4_latency.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv4_latency.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               }
               connection_key.slot = 0;
@@ -1527,9 +1751,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv4_summary_1.update(&connection_key, &summary_data);
+                if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               } else {
-                ipv4_summary.update(&connection_key, &summary_data);
+                if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               }
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
@@ -1550,9 +1778,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_summary_1.update(&connection_key, &summary_data);
+                  if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv4_summary.update(&connection_key, &summary_data);
+                  if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -1568,9 +1800,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_summary_1.update(&connection_key, &summary_data);
+                  if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv4_summary.update(&connection_key, &summary_data);
+                  if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -1629,10 +1865,8 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
       }
 
       // ok, now read content of the message and see if it is an http request
-      struct iov_iter iter = msg->msg_iter;
-      //bpf_probe_read(&iter, sizeof(iter), &msg->msg_iter);
       struct iovec data_to_be_read;
-      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), iter.iov);
+      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), msg_iov(msg));
 
       if(data_to_be_read.iov_len >= 7) {
         char p[7];
@@ -1739,8 +1973,7 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
               if(selector_value == BPF_SELECTOR_ZERO) {
                 bpf_probe_read(&summary_data, sizeof(summary_data), ipv6_http_summary.lookup(&http_key));
@@ -1768,14 +2001,18 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv6_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv6_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv6_http_latency.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv6_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               }
               http_key.slot = 0;
@@ -1788,9 +2025,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv6_http_summary_1.update(&http_key, &summary_data);
+                if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               } else {
-                ipv6_http_summary.update(&http_key, &summary_data);
+                if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               }
 
 #ifdef BYPASS
@@ -1811,9 +2052,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv6_http_summary.update(&http_key, &summary_data);
+                  if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -1829,9 +2074,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv6_http_summary.update(&http_key, &summary_data);
+                  if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -1844,8 +2093,7 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
               if(connection_data->dyn_port_masking_count < DYN_TCP_CLIENT_PORT_MASKING_THRESHOLD) {
@@ -1881,14 +2129,18 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv6_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv6_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv6_latency.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv6_latency.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               }
               connection_key.slot = 0;
@@ -1901,9 +2153,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv6_summary_1.update(&connection_key, &summary_data);
+                if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               } else {
-                ipv6_summary.update(&connection_key, &summary_data);
+                if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               }
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
@@ -1925,9 +2181,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_summary_1.update(&connection_key, &summary_data);
+                  if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv6_summary.update(&connection_key, &summary_data);
+                  if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -1943,9 +2203,13 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_summary_1.update(&connection_key, &summary_data);
+                  if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv6_summary.update(&connection_key, &summary_data);
+                  if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -2004,10 +2268,8 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
       }
 
       // ok, now read content of the message and see if it is an http request
-      struct iov_iter iter = msg->msg_iter;
-      //bpf_probe_read(&iter, sizeof(iter), &msg->msg_iter);
       struct iovec data_to_be_read;
-      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), iter.iov);
+      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), msg_iov(msg));
 
       if(data_to_be_read.iov_len >= 7) {
         char p[7];
@@ -2049,7 +2311,7 @@ int kprobe__tcp_sendmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg
 ////////////////////////////////////////////////////////////////////////////////
 
 
-int kprobe__tcp_recvmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg, size_t len, int nonblock, int flags, int *addr_len) {
+int kprobe__tcp_recvmsg(struct pt_regs *ctx, struct sock *sk, struct msghdr *msg) {
   struct msg_t cache_item = {.msg = msg};
   recv_cache.update(&sk, &cache_item);
   return 0;
@@ -2064,23 +2326,22 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
   struct msghdr * msg = cache_item->msg;
   recv_cache.delete(&sk);
 
-  int write_config = BPF_SELECTOR_INDEX;
 
   u64 pid = bpf_get_current_pid_tgid();
   u64 ts = bpf_ktime_get_ns();
 
-  u16 lport = sk->__sk_common.skc_num;
-  u16 dport = sk->__sk_common.skc_dport;
+  u16 lport = READ_KERNEL(sk, __sk_common.skc_num);
+  u16 dport = READ_KERNEL(sk, __sk_common.skc_dport);
   dport = ntohs(dport);
-  u16 family = sk->__sk_common.skc_family;
+  u16 family = READ_KERNEL(sk, __sk_common.skc_family);
 
   if (copied <= 0){
     return 0;
   }
 
   if (family == AF_INET) {
-    u32 saddr = sk->__sk_common.skc_rcv_saddr;
-    u32 daddr = sk->__sk_common.skc_daddr;
+    u32 saddr = READ_KERNEL(sk, __sk_common.skc_rcv_saddr);
+    u32 daddr = READ_KERNEL(sk, __sk_common.skc_daddr);
 
     //check if I am a server or a client
     struct ipv4_endpoint_key_t endpoint_key = {.addr = saddr, .port = lport};
@@ -2129,8 +2390,7 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
               if(selector_value == BPF_SELECTOR_ZERO) {
                 bpf_probe_read(&summary_data, sizeof(summary_data), ipv4_http_summary.lookup(&http_key));
@@ -2158,14 +2418,18 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv4_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv4_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv4_http_latency.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv4_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               }
               http_key.slot = 0;
@@ -2178,9 +2442,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv4_http_summary_1.update(&http_key, &summary_data);
+                if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               } else {
-                ipv4_http_summary.update(&http_key, &summary_data);
+                if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               }
 
 #ifdef BYPASS
@@ -2196,9 +2464,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv4_http_summary.update(&http_key, &summary_data);
+                  if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -2219,9 +2491,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv4_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv4_http_summary.update(&http_key, &summary_data);
+                  if(ipv4_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -2233,8 +2509,7 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data = {};
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
               if(connection_data->dyn_port_masking_count < DYN_TCP_CLIENT_PORT_MASKING_THRESHOLD) {
@@ -2268,14 +2543,18 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv4_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv4_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv4_latency.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv4_latency.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               }
               connection_key.slot = 0;
@@ -2288,9 +2567,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               summary_data.pid = pid;
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv4_summary_1.update(&connection_key, &summary_data);
+                if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               } else {
-                ipv4_summary.update(&connection_key, &summary_data);
+                if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               }
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
@@ -2312,9 +2595,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_summary_1.update(&connection_key, &summary_data);
+                  if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv4_summary.update(&connection_key, &summary_data);
+                  if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -2330,9 +2617,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv4_summary_1.update(&connection_key, &summary_data);
+                  if(ipv4_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv4_summary.update(&connection_key, &summary_data);
+                  if(ipv4_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -2414,10 +2705,8 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
       }
 
       // ok, now read content of the message and see if it is an http request
-      struct iov_iter iter;
-      bpf_probe_read(&iter, sizeof(iter), &msg->msg_iter);
       struct iovec data_to_be_read;
-      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), iter.iov);
+      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), msg_iov(msg));
 
       if(data_to_be_read.iov_len >= 7) {
         char p[7];
@@ -2503,8 +2792,7 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data;
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
               if(selector_value == BPF_SELECTOR_ZERO) {
                 bpf_probe_read(&summary_data, sizeof(summary_data), ipv6_http_summary.lookup(&http_key));
@@ -2532,14 +2820,18 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv6_http_latency_1.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv6_http_latency_1.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv6_http_latency.lookup_or_init(&http_key, &latency_zero);
+                struct latency_data_t * row = ipv6_http_latency.lookup_or_try_init(&http_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_HTTP_LATENCY);
                 }
               }
               http_key.slot = 0;
@@ -2552,9 +2844,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               summary_data.pid = pid;
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv6_http_summary_1.update(&http_key, &summary_data);
+                if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               } else {
-                ipv6_http_summary.update(&http_key, &summary_data);
+                if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                  failed_insert(FAILED_HTTP_SUMMARY);
+                }
               }
 
 #ifdef BYPASS
@@ -2568,9 +2864,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv6_http_summary.update(&http_key, &summary_data);
+                  if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -2591,9 +2891,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_http_summary_1.update(&http_key, &summary_data);
+                  if(ipv6_http_summary_1.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 } else {
-                  ipv6_http_summary.update(&http_key, &summary_data);
+                  if(ipv6_http_summary.update(&http_key, &summary_data) != 0) {
+                    failed_insert(FAILED_HTTP_SUMMARY);
+                  }
                 }
               }
 
@@ -2605,8 +2909,7 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               // choose the bpf table depending on the current selector
               struct summary_data_t summary_data = {};
 
-              unsigned int selector_value = 0;
-              bpf_probe_read(&selector_value, sizeof(selector_value), conf.lookup(&write_config));
+              unsigned int selector_value = current_selector();
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
               if(connection_data->dyn_port_masking_count < DYN_TCP_CLIENT_PORT_MASKING_THRESHOLD) {
@@ -2640,14 +2943,18 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
 
               // write to the table pointed by the selector
               if(selector_value == BPF_SELECTOR_ONE) {
-                struct latency_data_t * row = ipv6_latency_1.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv6_latency_1.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               } else {
-                struct latency_data_t * row = ipv6_latency.lookup_or_init(&connection_key, &latency_zero);
+                struct latency_data_t * row = ipv6_latency.lookup_or_try_init(&connection_key, &latency_zero);
                 if(row != NULL) {
                   safe_array_write(col, row->latency_vector, delta);
+                } else {
+                  failed_insert(FAILED_LATENCY);
                 }
               }
               connection_key.slot = 0;
@@ -2660,9 +2967,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
               summary_data.pid = bpf_get_current_pid_tgid();
 
               if(selector_value == BPF_SELECTOR_ONE) {
-                ipv6_summary_1.update(&connection_key, &summary_data);
+                if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               } else {
-                ipv6_summary.update(&connection_key, &summary_data);
+                if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                  failed_insert(FAILED_SUMMARY);
+                }
               }
 
 #ifdef DYN_TCP_CLIENT_PORT_MASKING
@@ -2684,9 +2995,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_summary_1.update(&connection_key, &summary_data);
+                  if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv6_summary.update(&connection_key, &summary_data);
+                  if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -2702,9 +3017,13 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
                 summary_data.status = STATUS_UNKNOWN;
 
                 if(selector_value == BPF_SELECTOR_ONE) {
-                  ipv6_summary_1.update(&connection_key, &summary_data);
+                  if(ipv6_summary_1.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 } else {
-                  ipv6_summary.update(&connection_key, &summary_data);
+                  if(ipv6_summary.update(&connection_key, &summary_data) != 0) {
+                    failed_insert(FAILED_SUMMARY);
+                  }
                 }
               }
 
@@ -2787,10 +3106,8 @@ int kprobe__tcp_cleanup_rbuf(struct pt_regs *ctx, struct sock *sk, int copied) {
       }
 
       // ok, now read content of the message and see if it is an http request
-      struct iov_iter iter;
-      bpf_probe_read(&iter, sizeof(iter), &msg->msg_iter);
       struct iovec data_to_be_read;
-      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), iter.iov);
+      bpf_probe_read(&data_to_be_read, sizeof(data_to_be_read), msg_iov(msg));
 
       if(data_to_be_read.iov_len >= 7) {
         char p[7];
@@ -2905,7 +3222,9 @@ int kretprobe__ip_rcv(struct pt_regs *ctx){
       if(cache_data->saddr != src_ip || cache_data->lport != src_port){
         struct ipv4_endpoint_key_t key = {.addr = src_ip, .port = src_port};
         struct ipv4_endpoint_key_t value = {.addr = cache_data->saddr, .port = cache_data->lport};
-        rewritten_rules.update(&key, &value);
+        if(rewritten_rules.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
 
       }
 #endif
@@ -2913,7 +3232,9 @@ int kretprobe__ip_rcv(struct pt_regs *ctx){
       if(cache_data->daddr != dest_ip || cache_data->dport != dest_port) {
         struct ipv4_endpoint_key_t key = {.addr = dest_ip, .port = dest_port};
         struct ipv4_endpoint_key_t value = {.addr = cache_data->daddr, .port = cache_data->dport};
-        rewritten_rules.update(&key, &value);
+        if(rewritten_rules.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
 
       }
     }
@@ -3002,7 +3323,9 @@ int kretprobe__ip_output(struct pt_regs *ctx){
       if(cache_data->saddr != src_ip || cache_data->lport != src_port){
         struct ipv4_endpoint_key_t value = {.addr = cache_data->saddr, .port = cache_data->lport};
         struct ipv4_endpoint_key_t key = {.addr = src_ip, .port = src_port};
-        rewritten_rules.update(&key, &value);
+        if(rewritten_rules.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
 
       }
 
@@ -3010,7 +3333,9 @@ int kretprobe__ip_output(struct pt_regs *ctx){
       if(cache_data->daddr != dest_ip || cache_data->dport != dest_port) {
         struct ipv4_endpoint_key_t value = {.addr = cache_data->daddr, .port = cache_data->dport};
         struct ipv4_endpoint_key_t key = {.addr = dest_ip, .port = dest_port};
-        rewritten_rules.update(&key, &value);
+        if(rewritten_rules.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
 
       }
 #endif
@@ -3103,14 +3428,18 @@ int kretprobe__ipv6_rcv(struct pt_regs *ctx){
       if(cache_data->saddr != src_ip || cache_data->lport != src_port){
         struct ipv6_endpoint_key_t key = {.addr = src_ip, .port = src_port};
         struct ipv6_endpoint_key_t value = {.addr = cache_data->saddr, .port = cache_data->lport};
-        rewritten_rules_6.update(&key, &value);
+        if(rewritten_rules_6.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
       }
 #endif
 
       if(cache_data->daddr != dest_ip || cache_data->dport != dest_port) {
         struct ipv6_endpoint_key_t key = {.addr = dest_ip, .port = dest_port};
         struct ipv6_endpoint_key_t value = {.addr = cache_data->daddr, .port = cache_data->dport};
-        rewritten_rules_6.update(&key, &value);
+        if(rewritten_rules_6.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
       }
     }
 
@@ -3200,7 +3529,9 @@ int kretprobe__ip6_output(struct pt_regs *ctx) {
       if(cache_data->saddr != src_ip || cache_data->lport != src_port){
         struct ipv6_endpoint_key_t value = {.addr = cache_data->saddr, .port = cache_data->lport};
         struct ipv6_endpoint_key_t key = {.addr = src_ip, .port = src_port};
-        rewritten_rules_6.update(&key, &value);
+        if(rewritten_rules_6.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
 
       }
 
@@ -3208,7 +3539,9 @@ int kretprobe__ip6_output(struct pt_regs *ctx) {
       if(cache_data->daddr != dest_ip || cache_data->dport != dest_port) {
         struct ipv6_endpoint_key_t value = {.addr = cache_data->daddr, .port = cache_data->dport};
         struct ipv6_endpoint_key_t key = {.addr = dest_ip, .port = dest_port};
-        rewritten_rules_6.update(&key, &value);
+        if(rewritten_rules_6.update(&key, &value) != 0) {
+          failed_insert(FAILED_REWRITTEN_RULES);
+        }
       }
 #endif
     }
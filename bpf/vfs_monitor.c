@@ -26,6 +26,28 @@
 #include <linux/dcache.h>
 #include <linux/mount.h>
 
+// the libbpf build (CORE) on vmlinux.h has the kernel types, not its macros,
+// without kernel BTF it is built on the kernel headers (KERNEL_HEADERS).
+// Both size the name buffers with a number, for the map layouts
+#ifdef CORE
+#define DNAME_INLINE_LEN 32
+#ifndef KERNEL_HEADERS
+#define __user
+#define S_IFMT 00170000
+#define S_IFREG 0100000
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
+#endif
+
+// BCC turns the dereference of a probe argument into a probe read, fentry
+// programs read it through the kernel BTF, kprobes built on the kernel
+// headers need the explicit probe read
+#ifdef KERNEL_HEADERS
+#define READ_KERNEL(ptr, field) ({ typeof((ptr)->field) __val; bpf_probe_read(&__val, sizeof(__val), &(ptr)->field); __val; })
+#else
+#define READ_KERNEL(ptr, field) ((ptr)->field)
+#endif
+
 struct val_t {
     u32 sz;
     u64 ts;
@@ -57,35 +79,79 @@ struct key_file_t {
     char parent2[DNAME_INLINE_LEN];
 };
 
+/*
+ * Capacity of the maps, set from userspace (map_sizes in config.yaml).
+ * The counts are drained every window: a row that does not fit in a full
+ * one is counted in failed_inserts instead. entryinfo only pairs a call
+ * with its return, it is LRU so that the rows of a missed return age out.
+ * The libbpf build (CORE) sizes them at load time, with the defaults of
+ * bpf_build.LOAD_TIME_DEFAULTS
+ */
+#ifndef CORE
+#ifndef COUNTS_BY_PID_MAP_SIZE
+#define COUNTS_BY_PID_MAP_SIZE 10240
+#endif
+#ifndef COUNTS_BY_FILE_MAP_SIZE
+#define COUNTS_BY_FILE_MAP_SIZE 10240
+#endif
+#ifndef ENTRYINFO_MAP_SIZE
+#define ENTRYINFO_MAP_SIZE 10240
+#endif
+#endif
+
+BPF_HASH(counts_by_pid, pid_t, struct val_pid_t, COUNTS_BY_PID_MAP_SIZE);
+BPF_HASH(counts_by_file, struct key_file_t, struct val_file_t, COUNTS_BY_FILE_MAP_SIZE);
+BPF_LRU_HASH(entryinfo, pid_t, struct val_t, ENTRYINFO_MAP_SIZE);
+
+// per-CPU count of the rows that did not fit, indexed by FAILED_*
+#define FAILED_COUNTS_BY_PID 0
+#define FAILED_COUNTS_BY_FILE 1
+#define NUM_FAILED_INSERTS 2
+BPF_PERCPU_ARRAY(failed_inserts, u64, NUM_FAILED_INSERTS);
+
+static inline void failed_insert(int table) {
+    u64 *count = failed_inserts.lookup(&table);
+    if (count != NULL) {
+        (*count)++;
+    }
+}
 
-BPF_HASH(counts_by_pid, pid_t, struct val_pid_t);
-BPF_HASH(counts_by_file, struct key_file_t, struct val_file_t);
-BPF_HASH(entryinfo, pid_t, struct val_t);
-
-int trace_rw_entry(struct pt_regs *ctx, struct file *file, char __user *buf, size_t count) {
+/*
+ * BCC attaches trace_rw_entry and the return programs to vfs_read and
+ * vfs_write from userspace. The libbpf build attaches the kprobe__ and
+ * kretprobe__ programs at the end by their name, as fentry programs that
+ * read the arguments of a single function (kprobes without kernel BTF)
+ */
+#ifdef CORE
+#define RW_ENTRY static inline int
+#else
+#define RW_ENTRY int
+#endif
+RW_ENTRY trace_rw_entry(struct pt_regs *ctx, struct file *file, char __user *buf, size_t count) {
     u32 tgid = bpf_get_current_pid_tgid() >> 32;
     u32 pid = bpf_get_current_pid_tgid();
-    int mode = file->f_inode->i_mode;
-    struct dentry *de = file->f_path.dentry;
-    if (de->d_name.len == 0 || !S_ISREG(mode))
+    struct inode *inode = READ_KERNEL(file, f_inode);
+    int mode = READ_KERNEL(inode, i_mode);
+    struct dentry *de = READ_KERNEL(file, f_path.dentry);
+    struct qstr d_name = READ_KERNEL(de, d_name);
+    if (d_name.len == 0 || !S_ISREG(mode))
         return 0;
     // store size and timestamp by pid
     struct val_t val = {};
     val.sz = count;
     val.ts = bpf_ktime_get_ns();
-    struct qstr d_name = de->d_name;
     val.name_len = d_name.len;
 
     bpf_probe_read(&val.name, sizeof(val.name), d_name.name);
 
-    struct dentry *parent = de->d_parent;
+    struct dentry *parent = READ_KERNEL(de, d_parent);
     if (parent) {
-        struct qstr parent_name = parent->d_name;
+        struct qstr parent_name = READ_KERNEL(parent, d_name);
         bpf_probe_read(&val.parent1, sizeof(val.parent1), parent_name.name);
 
-        struct dentry *second_parent = parent->d_parent;
+        struct dentry *second_parent = READ_KERNEL(parent, d_parent);
 
-        struct qstr second_parent_name = second_parent->d_name;
+        struct qstr second_parent_name = READ_KERNEL(second_parent, d_name);
         bpf_probe_read(&val.parent2, sizeof(val.parent2), second_parent_name.name);
     }
 
@@ -108,7 +174,7 @@ static int trace_rw_return(struct pt_regs *ctx, int type) {
     entryinfo.delete(&pid);
 
     struct val_pid_t *val_pid, zero_pid = {};
-    val_pid = counts_by_pid.lookup_or_init(&pid, &zero_pid);
+    val_pid = counts_by_pid.lookup_or_try_init(&pid, &zero_pid);
     if (val_pid) {
         if (type == 0) {
             val_pid->num_r++;
@@ -119,6 +185,8 @@ static int trace_rw_return(struct pt_regs *ctx, int type) {
         }
         val_pid->sum_ts_deltas += delta_us;
         val_pid->pid = pid;
+    } else {
+        failed_insert(FAILED_COUNTS_BY_PID);
     }
 
     struct key_file_t file_key = {};
@@ -127,7 +195,7 @@ static int trace_rw_return(struct pt_regs *ctx, int type) {
     bpf_probe_read(&file_key.parent2, sizeof(file_key.parent2), valp->parent2);
 
     struct val_file_t *val_file, zero_file = {};
-    val_file = counts_by_file.lookup_or_init(&file_key, &zero_file);
+    val_file = counts_by_file.lookup_or_try_init(&file_key, &zero_file);
 
     if (val_file) {
         if (type == 0) {
@@ -137,13 +205,30 @@ static int trace_rw_return(struct pt_regs *ctx, int type) {
             val_file->num_w++;
             val_file->bytes_w += valp->sz;
         }
+    } else {
+        failed_insert(FAILED_COUNTS_BY_FILE);
     }
     return 0;
 }
 
+#ifdef CORE
+int kprobe__vfs_read(struct pt_regs *ctx, struct file *file, char __user *buf, size_t count) {
+    return trace_rw_entry(NULL, file, buf, count);
+}
+int kprobe__vfs_write(struct pt_regs *ctx, struct file *file, const char __user *buf, size_t count) {
+    return trace_rw_entry(NULL, file, (char *)buf, count);
+}
+int kretprobe__vfs_read(struct pt_regs *ctx) {
+    return trace_rw_return(ctx, 0);
+}
+int kretprobe__vfs_write(struct pt_regs *ctx) {
+    return trace_rw_return(ctx, 1);
+}
+#else
 int trace_read_return(struct pt_regs *ctx) {
     return trace_rw_return(ctx, 0);
 }
 int trace_write_return(struct pt_regs *ctx) {
     return trace_rw_return(ctx, 1);
 }
+#endif
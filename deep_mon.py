@@ -59,6 +59,25 @@ CONTEXT_SETTINGS = dict(default_map=config)
 @click.option("--memory_measure")
 @click.option("--disk_measure")
 @click.option("--file_measure")
+@click.option("--accounting_engine", type=click.Choice(["hash", "task_storage"]), default="hash")
+@click.option("--bpf_loader", type=click.Choice(["auto", "bcc", "core"]), default="auto")
+@click.option("--bpf_cache_dir", default=None)
+@click.option("--sched_attach_mode", type=click.Choice(["auto", "raw", "classic"]), default="auto")
+@click.option("--pmu_events", default="cycles_thread,instr_thread,cache_misses,cache_refs")
+@click.option("--aggregation", type=click.Choice(["thread", "tgid", "cgroup"]), default="thread")
+@click.option("--trace_errors", type=bool, default=False)
+@click.option("--window_trigger", type=click.Choice(["auto", "timer", "perf_event"]), default="auto")
+@click.option("--window_period_ms", type=int, default=500)
+@click.option("--smt_overlap", type=click.Choice(["sched", "any_thread"]), default="sched")
+@click.option("--attribution", type=click.Choice(["cycles", "frequency"]), default="cycles")
+@click.option("--idle_power", type=bool, default=False)
+@click.option("--energy_source", type=click.Choice(["auto", "sysfs", "perf", "replay"]), default="auto")
+@click.option("--energy_replay_file", default=None)
+@click.option("--energy_sample_period_ms", type=int, default=0)
+@click.option("--capture_mode", type=click.Choice(["switch", "sampling"]), default="switch")
+@click.option("--sampling_rate_hz", type=int, default=997)
+@click.option("--counter_backend", type=click.Choice(["bpf", "cgroup_perf"]), default="bpf")
+@click.option("--map_sizes", default="")
 def main(
     window_mode,
     output_format,
@@ -71,6 +90,25 @@ def main(
     memory_measure,
     disk_measure,
     file_measure,
+    accounting_engine,
+    bpf_loader,
+    bpf_cache_dir,
+    sched_attach_mode,
+    pmu_events,
+    aggregation,
+    trace_errors,
+    window_trigger,
+    window_period_ms,
+    smt_overlap,
+    attribution,
+    idle_power,
+    energy_source,
+    energy_replay_file,
+    energy_sample_period_ms,
+    capture_mode,
+    sampling_rate_hz,
+    counter_backend,
+    map_sizes,
 ):
     monitor = MonitorMain(
         output_format,
@@ -84,6 +122,25 @@ def main(
         memory_measure,
         disk_measure,
         file_measure,
+        accounting_engine=accounting_engine,
+        bpf_loader=bpf_loader,
+        bpf_cache_dir=bpf_cache_dir,
+        sched_attach_mode=sched_attach_mode,
+        pmu_events=pmu_events,
+        aggregation=aggregation,
+        trace_errors=trace_errors,
+        window_trigger=window_trigger,
+        window_period_ms=window_period_ms,
+        smt_overlap=smt_overlap,
+        attribution=attribution,
+        idle_power=idle_power,
+        energy_source=energy_source,
+        energy_replay_file=energy_replay_file,
+        energy_sample_period_ms=energy_sample_period_ms,
+        capture_mode=capture_mode,
+        sampling_rate_hz=sampling_rate_hz,
+        counter_backend=counter_backend,
+        map_sizes=map_sizes,
     )
     if output_format == "console":
         monitor.monitor_loop()
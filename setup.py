@@ -29,7 +29,7 @@ setup(
         "deep_mon.userspace",
         "deep_mon.userspace.rapl",
     ],
-    package_data={"deep_mon.bpf": ["*.c"], "deep_mon.userspace": ["*.yaml"]},
+    package_data={"deep_mon.bpf": ["*.c", "obj/*.bpf.o", "obj/*.bpf.json"], "deep_mon.userspace": ["*.yaml"]},
     include_package_data=True,
     install_requires=[
         "Click",
@@ -0,0 +1,541 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Build the BCC flavoured BPF programs into objects that can be loaded with
+# libbpf (see libbpf_loader.py) without running clang at startup.
+#
+# The sources keep the BCC syntax (BPF_HASH, map.lookup(), ...) so that BCC
+# can still compile them. Here they are preprocessed with the compile time
+# cflags and the BCC constructs we use are rewritten into plain libbpf C.
+# The map and struct layouts are stored next to the object in a json file
+# so that the loader can build the ctypes key/leaf types like BCC does.
+#
+# The objects are CO-RE, built on the vmlinux.h of the kernel BTF. Kernels
+# without BTF get objects built on their own headers instead, like BCC and
+# samples/bpf do: they only load on the kernel they were built for (see
+# object_cache.py), trace kernel functions with kprobes and read the probe
+# arguments with probe reads (KERNEL_HEADERS in the sources).
+#
+# Usage: python3 -m userspace.bpf_build bpf/bpf_monitor.c -DPERFORMANCE_COUNTERS ...
+
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+# cflags that are turned into load time constants instead of being part of
+# the compiled object. They can only be used in code and as map sizes.
+LOAD_TIME_CONSTANTS = {
+    "bpf_monitor": [
+        "NUM_CPUS", "PIDS_MAP_SIZE", "AGGREGATES_MAP_SIZE", "GRAVEYARD_MAP_SIZE",
+        "FOREIGN_CYCLES_MAP_SIZE", "MIGRATIONS_MAP_SIZE",
+    ],
+    "tcp_monitor": [
+        "ENDPOINTS_MAP_SIZE", "CONNECTIONS_MAP_SIZE", "SUMMARY_MAP_SIZE",
+        "HTTP_SUMMARY_MAP_SIZE", "LATENCY_MAP_SIZE", "HTTP_LATENCY_MAP_SIZE",
+        "SET_STATE_CACHE_MAP_SIZE", "RECV_CACHE_MAP_SIZE", "REWRITE_CACHE_MAP_SIZE",
+        "REWRITTEN_RULES_MAP_SIZE",
+    ],
+    "vfs_monitor": ["COUNTS_BY_PID_MAP_SIZE", "COUNTS_BY_FILE_MAP_SIZE", "ENTRYINFO_MAP_SIZE"],
+}
+
+# values of the load time constants that are not in the cflags, the same
+# as the #define defaults of the BCC build
+LOAD_TIME_DEFAULTS = {
+    "bpf_monitor": {
+        "PIDS_MAP_SIZE": 10240,
+        "AGGREGATES_MAP_SIZE": 10240,
+        "GRAVEYARD_MAP_SIZE": 1024,
+        "FOREIGN_CYCLES_MAP_SIZE": 10240,
+        "MIGRATIONS_MAP_SIZE": 10240,
+    },
+    "tcp_monitor": {
+        "ENDPOINTS_MAP_SIZE": 100000,
+        "CONNECTIONS_MAP_SIZE": 100000,
+        "SUMMARY_MAP_SIZE": 10240,
+        "HTTP_SUMMARY_MAP_SIZE": 10240,
+        "LATENCY_MAP_SIZE": 60000,
+        "HTTP_LATENCY_MAP_SIZE": 60000,
+        "SET_STATE_CACHE_MAP_SIZE": 10240,
+        "RECV_CACHE_MAP_SIZE": 90000,
+        "REWRITE_CACHE_MAP_SIZE": 10240,
+        "REWRITTEN_RULES_MAP_SIZE": 10240,
+    },
+    "vfs_monitor": {
+        "COUNTS_BY_PID_MAP_SIZE": 10240,
+        "COUNTS_BY_FILE_MAP_SIZE": 10240,
+        "ENTRYINFO_MAP_SIZE": 10240,
+    },
+}
+
+OBJECT_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "bpf", "obj")
+
+BCC_HASH_DEFAULT_SIZE = 10240
+
+CLANG = os.environ.get("CLANG", "clang")
+OPT = os.environ.get("OPT", "opt")
+LLC = os.environ.get("LLC", "llc")
+BPFTOOL = os.environ.get("BPFTOOL", "bpftool")
+
+KERNEL_BTF = "/sys/kernel/btf/vmlinux"
+KERNEL_BUILD_DIR = os.environ.get("KERNEL_BUILD_DIR", "/lib/modules/%s/build" % os.uname().release)
+LIBBPF_INCLUDE_DIRS = ["/usr/local/include", "/usr/include"]
+
+# features whose programs need the kernel BTF: the window timers are armed
+# by a BTF tracepoint, the task storage is dumped by a task iterator
+BTF_FEATURES = ["-DWINDOW_TIMERS", "-DTASK_STORAGE"]
+
+CTYPES = {
+    "u64": "c_ulonglong", "__u64": "c_ulonglong", "unsigned long long": "c_ulonglong",
+    "s64": "c_longlong", "__s64": "c_longlong", "long long": "c_longlong",
+    "u32": "c_uint", "__u32": "c_uint", "unsigned int": "c_uint", "unsigned": "c_uint",
+    "int": "c_int", "s32": "c_int", "__s32": "c_int", "pid_t": "c_int",
+    "u16": "c_ushort", "__u16": "c_ushort", "int16_t": "c_short", "short": "c_short",
+    "u8": "c_ubyte", "__u8": "c_ubyte", "unsigned char": "c_ubyte", "char": "c_char",
+}
+
+MAP_TYPES = {
+    "BPF_HASH": "BPF_MAP_TYPE_HASH",
+    "BPF_LRU_HASH": "BPF_MAP_TYPE_LRU_HASH",
+    "BPF_PERCPU_HASH": "BPF_MAP_TYPE_PERCPU_HASH",
+    "BPF_LRU_PERCPU_HASH": "BPF_MAP_TYPE_LRU_PERCPU_HASH",
+    "BPF_ARRAY": "BPF_MAP_TYPE_ARRAY",
+    "BPF_PERCPU_ARRAY": "BPF_MAP_TYPE_PERCPU_ARRAY",
+    "BPF_PERF_ARRAY": "BPF_MAP_TYPE_PERF_EVENT_ARRAY",
+    "BPF_PERF_OUTPUT": "BPF_MAP_TYPE_PERF_EVENT_ARRAY",
+    "BPF_TASK_STORAGE": "BPF_MAP_TYPE_TASK_STORAGE",
+}
+
+# kernel structs that can be embedded in map values, opaque to userspace
+KERNEL_STRUCTS = {
+    "bpf_timer": [["opaque", "c_ulonglong", ["2"]]],
+}
+
+# map.method(args) -> libbpf call, {m} is the map and {0}, {1}... the arguments
+MAP_METHODS = {
+    "lookup": "bpf_map_lookup_elem(&{m}, {0})",
+    "update": "bpf_map_update_elem(&{m}, {0}, {1}, BPF_ANY)",
+    "insert": "bpf_map_update_elem(&{m}, {0}, {1}, BPF_NOEXIST)",
+    "delete": "bpf_map_delete_elem(&{m}, {0})",
+    "lookup_or_try_init": "bcc_lookup_or_try_init(&{m}, {0}, {1})",
+    "lookup_or_init": "bcc_lookup_or_try_init(&{m}, {0}, {1})",
+    "perf_read": "bpf_perf_event_read(&{m}, {0})",
+    "perf_counter_value": "bpf_perf_event_read_value(&{m}, {0}, {1}, {2})",
+    "perf_submit": "bpf_perf_event_output({0}, &{m}, BPF_F_CURRENT_CPU, {1}, {2})",
+    "task_storage_get": "bpf_task_storage_get(&{m}, {0}, {1}, {2})",
+    "task_storage_delete": "bpf_task_storage_delete(&{m}, {0})",
+}
+
+VMLINUX_INCLUDES = """\
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_endian.h>
+"""
+
+# after the kernel includes of the source
+KERNEL_HEADERS_INCLUDES = """\
+#include <uapi/linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+"""
+
+PRELUDE = """\
+// Generated by userspace/bpf_build.py from %(source)s, do not edit
+%(includes)s
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+char LICENSE[] SEC("license") = "GPL";
+
+static __always_inline void *bcc_lookup_or_try_init(void *map, const void *key, const void *init) {
+        void *value = bpf_map_lookup_elem(map, key);
+        if (value != NULL)
+                return value;
+        bpf_map_update_elem(map, key, init, BPF_NOEXIST);
+        return bpf_map_lookup_elem(map, key);
+}
+
+const volatile struct {
+%(constants)s} deep_mon_constants = {};
+
+"""
+
+
+def kernel_has_btf():
+    return os.path.exists(KERNEL_BTF)
+
+
+def check_features(features, btf):
+    """Raise if features need the kernel BTF and the build has none"""
+    missing = [f for f in features if f in BTF_FEATURES]
+    if missing and not btf:
+        raise ValueError("%s need the kernel BTF" % " ".join(missing))
+
+
+def program_name(src_path):
+    return os.path.basename(src_path).rsplit(".", 1)[0]
+
+
+def split_cflags(program, cflags):
+    """Split cflags in load time constants {name: value} and compile time flags"""
+    constants = dict(LOAD_TIME_DEFAULTS.get(program, {}))
+    features = []
+    load_time = LOAD_TIME_CONSTANTS.get(program, [])
+    for flag in cflags:
+        name, _, value = flag[2:].partition("=")
+        if flag.startswith("-D") and name in load_time:
+            constants[name] = int(value, 0)
+        else:
+            features.append(flag)
+    return constants, features
+
+
+def object_name(program, features):
+    variant = ".".join(
+        sorted(f[2:].lower().replace("=", "_") for f in features if f.startswith("-D"))
+    )
+    return "%s.%s.bpf.o" % (program, variant or "default")
+
+
+def _split_args(text, start):
+    """Split the call arguments starting after the '(' at text[start]"""
+    depth = 0
+    args = []
+    current = ""
+    for i in range(start, len(text)):
+        c = text[i]
+        if c == "(":
+            depth += 1
+        elif c == ")":
+            if depth == 0:
+                args.append(current.strip())
+                return args, i + 1
+            depth -= 1
+        elif c == "," and depth == 0:
+            args.append(current.strip())
+            current = ""
+            continue
+        current += c
+    raise ValueError("unbalanced call at offset %d" % start)
+
+
+def _eval_dim(expr, constants):
+    expr = expr.strip()
+    if not re.match(r"^[\w\s\*\+\-\/\%\(\)]+$", expr):
+        raise ValueError("unsupported array size %s" % expr)
+    # C integer division
+    expr = re.sub(r"/+", "//", expr)
+    return int(eval(expr, {"__builtins__": {}}, dict(constants)))
+
+
+def _parse_structs(text):
+    structs = {}
+    for match in re.finditer(r"struct\s+(\w+)\s*\{(.*?)\}\s*[^;]*;", text, re.S):
+        fields = []
+        for decl in match.group(2).split(";"):
+            decl = re.sub(r"/\*.*?\*/|//[^\n]*", "", decl, flags=re.S).strip()
+            if not decl:
+                continue
+            field = re.match(r"^(.*?)\s*(\**)\s*(\w+)\s*((?:\[[^\]]+\])*)$", decl, re.S)
+            ctype, pointer, name, dims = field.groups()
+            ctype = " ".join(ctype.split())
+            dims = re.findall(r"\[([^\]]+)\]", dims)
+            if ctype == "unsigned __int128":
+                # two u64 like BCC, the structs pad them to 16 bytes
+                ctype, dims = "c_ulonglong", dims + ["2"]
+            fields.append([name, "c_ulonglong" if pointer else ctype, dims])
+        structs[match.group(1)] = fields
+    return structs
+
+
+def _ctype_desc(ctype, structs, constants):
+    ctype = " ".join(ctype.split())
+    if ctype.endswith("*"):
+        # kernel pointers used as keys
+        return "c_ulonglong"
+    if ctype.startswith("struct "):
+        name = ctype[len("struct "):]
+        return {"struct": name, "fields": [
+            [f[0], _ctype_desc(f[1], structs, constants), [_eval_dim(d, constants) for d in f[2]]]
+            for f in structs[name]
+        ]}
+    if ctype in CTYPES:
+        return CTYPES[ctype]
+    if ctype in CTYPES.values():
+        return ctype
+    raise ValueError("unsupported type %s" % ctype)
+
+
+def translate(text, program, source_name="", extra_constants=None, kernel_includes=None):
+    """Rewrite preprocessed BCC C into libbpf C, return (code, description)
+
+    The code includes vmlinux.h, or kernel_includes (the kernel headers of
+    the source) for the objects of kernels without BTF.
+    """
+    constants = LOAD_TIME_CONSTANTS.get(program, [])
+    dims = {"TASK_COMM_LEN": 16}
+    dims.update(extra_constants or {})
+    structs = dict(KERNEL_STRUCTS)
+    structs.update(_parse_structs(text))
+    maps = {}
+
+    def map_decl(match):
+        kind, args = match.group(1), [a.strip() for a in match.group(2).split(",")]
+        name = args[0] if kind in ("BPF_PERF_ARRAY", "BPF_PERF_OUTPUT", "BPF_TASK_STORAGE") else None
+        if kind in ("BPF_HASH", "BPF_LRU_HASH", "BPF_PERCPU_HASH", "BPF_LRU_PERCPU_HASH"):
+            name, key, leaf = args[0], args[1], args[2]
+            size = args[3] if len(args) > 3 else str(BCC_HASH_DEFAULT_SIZE)
+        elif kind in ("BPF_ARRAY", "BPF_PERCPU_ARRAY"):
+            name, key, leaf, size = args[0], "int", args[1], args[2]
+        elif kind == "BPF_PERF_ARRAY":
+            key, leaf, size = "int", "u32", args[1]
+        elif kind == "BPF_PERF_OUTPUT":
+            key, leaf, size = "int", "u32", "0"
+        else:
+            key, leaf, size = "int", args[1], "0"
+        size_expr = None
+        if re.search(r"[A-Za-z_]", size):
+            # sized at load time from a constant
+            size_expr, size = size, "1"
+        else:
+            size = str(_eval_dim(size, {}))
+        maps[name] = {
+            "type": MAP_TYPES[kind],
+            "key": _ctype_desc(key, structs, dims),
+            "leaf": _ctype_desc(leaf, structs, dims),
+            "max_entries": int(size),
+            "max_entries_expr": size_expr,
+        }
+        flags = "        __uint(map_flags, BPF_F_NO_PREALLOC);\n" if kind == "BPF_TASK_STORAGE" else ""
+        return (
+            "struct {\n"
+            "        __uint(type, %s);\n"
+            "        __type(key, %s);\n"
+            "        __type(value, %s);\n"
+            "        __uint(max_entries, %s);\n"
+            "%s"
+            "} %s SEC(\".maps\");"
+        ) % (MAP_TYPES[kind], key, leaf, size, flags, name)
+
+    text = re.sub(r"\b(BPF_[A-Z_]+)\(([^;]*?)\);", lambda m: map_decl(m) if m.group(1) in MAP_TYPES else m.group(0), text)
+
+    # map.method(args) -> helper calls, innermost first
+    call = re.compile(r"\b(\w+)\.(\w+)\(")
+    pos = 0
+    while True:
+        match = call.search(text, pos)
+        if match is None:
+            break
+        m, method = match.group(1), match.group(2)
+        if m not in maps or method not in MAP_METHODS:
+            pos = match.end()
+            continue
+        args, end = _split_args(text, match.end())
+        replacement = MAP_METHODS[method].format(*args, m=m)
+        text = text[:match.start()] + replacement + text[end:]
+        pos = match.start()
+
+    # load time constants live in the read only data of the object
+    for name in constants:
+        text = re.sub(r"\b%s\b" % name, "deep_mon_constants.%s" % name, text)
+
+    # BCC attaches kprobe__<fn> and kretprobe__<fn> by their name, so does
+    # the loader (the "attach" list). Entry probes with arguments become
+    # fentry programs, that dereference the arguments of <fn> like BCC does.
+    # Without kernel BTF they stay kprobes, that take them from the registers
+    def entry_probe(match):
+        name, params = match.group(1), match.group(2).strip()
+        if kernel_includes is None:
+            return 'SEC("fentry/%s")\nint BPF_PROG(%s, %s)' % (name[len("kprobe__"):], name, params)
+        return 'SEC("kprobe/%s")\nint BPF_KPROBE(%s, %s)' % (name[len("kprobe__"):], name, params)
+    text = re.sub(r"^int\s+(kprobe__\w+)\s*\(\s*struct\s+pt_regs\s*\*\s*ctx\s*,([^)]*)\)",
+                  entry_probe, text, flags=re.M)
+    attach = re.findall(r"^int\s+(?:BPF_(?:PROG|KPROBE)\(\s*)?(k(?:ret)?probe__\w+)", text, flags=re.M)
+
+    # entry points get a section, helpers are always inlined
+    def section(match):
+        ctx_type = match.group(2)
+        if match.group(1).startswith(("kprobe__", "kretprobe__")):
+            kind, _, fn = match.group(1).partition("__")
+            sec = "%s/%s" % (kind, fn)
+        elif ctx_type == "bpf_perf_event_data":
+            sec = "perf_event"
+        elif ctx_type == "bpf_raw_tracepoint_args":
+            sec = "raw_tracepoint"
+        elif ctx_type == "btf_trace_args":
+            # btf_<tracepoint> entry points
+            sec = "tp_btf/" + match.group(1)[len("btf_"):]
+        elif ctx_type == "pt_regs":
+            sec = "kprobe"
+        elif ctx_type.startswith("bpf_iter__"):
+            sec = "iter/" + ctx_type[len("bpf_iter__"):]
+        else:
+            sec = "tracepoint"
+        return 'SEC("%s")\n%s' % (sec, match.group(0))
+    text = re.sub(r"^int\s+(\w+)\s*\(\s*struct\s+(\w+)\s*\*", section, text, flags=re.M)
+    text = re.sub(r"\bstatic\s+inline\b", "static __always_inline", text)
+    text = re.sub(r"^static\s+(void|int)\b", r"static __always_inline \1", text, flags=re.M)
+
+    if kernel_includes is None:
+        includes = VMLINUX_INCLUDES
+    else:
+        includes = "".join(line + "\n" for line in kernel_includes) + KERNEL_HEADERS_INCLUDES
+    prelude = PRELUDE % {
+        "source": source_name,
+        "includes": includes,
+        "constants": "".join("        u64 %s;\n" % c for c in constants),
+    }
+    description = {
+        "program": program,
+        "constants": constants,
+        "maps": maps,
+        "attach": attach,
+        "btf": kernel_includes is None,
+    }
+    return prelude + text, description
+
+
+def preprocess(src_path, features, btf=True):
+    """Run the C preprocessor on the source without its kernel includes"""
+    with open(src_path) as f:
+        source = re.sub(r"^\s*#\s*include\s*<[^>]+>.*$", "", f.read(), flags=re.M)
+    # the version checks of the sources are resolved here, with their includes
+    flavor = [] if btf else [
+        "-DKERNEL_HEADERS", "-DLINUX_VERSION_CODE=%d" % kernel_version_code(),
+        "-DKERNEL_VERSION(a,b,c)=(((a) << 16) + ((b) << 8) + ((c) > 255 ? 255 : (c)))",
+    ]
+    result = subprocess.run(
+        [CLANG, "-E", "-P", "-x", "c", "-DCORE", "-DTASK_COMM_LEN=16"] + flavor + features + ["-"],
+        input=source, capture_output=True, text=True, check=True,
+    )
+    return result.stdout
+
+
+def source_includes(src_path):
+    """The kernel includes of the source, BCC has its own helpers"""
+    with open(src_path) as f:
+        includes = [line.strip() for line in f if re.match(r"^\s*#\s*include\s*<(?!bcc/)", line)]
+    return list(dict.fromkeys(includes))
+
+
+def kernel_version_code():
+    """LINUX_VERSION_CODE of the headers of the running kernel"""
+    with open(os.path.join(KERNEL_BUILD_DIR, "include/generated/uapi/linux/version.h")) as f:
+        return int(re.search(r"#define\s+LINUX_VERSION_CODE\s+(\d+)", f.read()).group(1))
+
+
+def kernel_header_cflags(arch):
+    """Compile flags for the headers of the running kernel, like BCC's"""
+    # distributions split the generated headers (build) from the rest (source)
+    source = os.path.join(os.path.dirname(KERNEL_BUILD_DIR), "source")
+    roots = list(dict.fromkeys([source if os.path.isdir(source) else KERNEL_BUILD_DIR, KERNEL_BUILD_DIR]))
+    dirs = ["arch/{0}/include", "arch/{0}/include/generated", "include", "arch/{0}/include/uapi",
+            "arch/{0}/include/generated/uapi", "include/uapi", "include/generated/uapi"]
+    builtin = subprocess.run([CLANG, "-print-file-name=include"], capture_output=True,
+                             text=True, check=True).stdout.strip()
+    return (
+        ["-nostdinc", "-isystem", builtin]
+        + ["-I" + os.path.join(root, d.format(arch)) for d in dirs for root in roots]
+        + [flag for d in LIBBPF_INCLUDE_DIRS for flag in ("-idirafter", d)]
+        + ["-include", os.path.join(roots[0], "include/linux/kconfig.h")]
+        + ["-D__KERNEL__", "-D__BPF_TRACING__", '-DKBUILD_MODNAME="deep_mon"',
+           "-fno-stack-protector", "-fno-asynchronous-unwind-tables",
+           "-Wno-unused-value", "-Wno-pointer-sign", "-Wno-compare-distinct-pointer-types",
+           "-Wno-gnu-variable-sized-type-not-at-end", "-Wno-address-of-packed-member",
+           "-Wno-tautological-compare", "-Wno-unknown-warning-option"]
+    )
+
+
+def generate_vmlinux_header(out_dir):
+    header = os.path.join(out_dir, "vmlinux.h")
+    if not os.path.exists(header):
+        # dump aside and move in place, a failed dump must not leave a header behind
+        fd, tmp_path = tempfile.mkstemp(dir=out_dir, suffix=".h")
+        try:
+            with os.fdopen(fd, "w") as f:
+                subprocess.run(
+                    [BPFTOOL, "btf", "dump", "file", "/sys/kernel/btf/vmlinux", "format", "c"],
+                    stdout=f, check=True,
+                )
+            os.replace(tmp_path, header)
+        except BaseException:
+            os.unlink(tmp_path)
+            raise
+    return header
+
+
+def build(src_path, cflags, out_dir=OBJECT_DIR, include_dirs=(), obj_name=None, btf=True):
+    """Compile src_path for the compile time part of cflags, return the object path
+
+    btf=False builds on the headers of the running kernel instead of vmlinux.h
+    """
+    program = program_name(src_path)
+    _, features = split_cflags(program, cflags)
+    check_features(features, btf)
+    os.makedirs(out_dir, exist_ok=True)
+    obj_path = os.path.join(out_dir, obj_name or object_name(program, features))
+    code, description = translate(preprocess(src_path, features, btf), program, os.path.basename(src_path),
+                                  kernel_includes=None if btf else source_includes(src_path))
+    description["features"] = features
+
+    bpf_src = obj_path[:-len(".o")] + ".c"
+    with open(bpf_src, "w") as f:
+        f.write(code)
+    arch = {"x86_64": "x86", "aarch64": "arm64"}.get(os.uname().machine, os.uname().machine)
+    if btf:
+        subprocess.run(
+            [CLANG, "-g", "-O2", "-target", "bpf", "-D__TARGET_ARCH_%s" % arch]
+            + ["-I" + d for d in (out_dir,) + tuple(include_dirs)]
+            + ["-c", bpf_src, "-o", obj_path],
+            check=True,
+        )
+    else:
+        # the kernel headers only parse for the host target (inline asm),
+        # the IR is then lowered to BPF like samples/bpf does
+        ir = subprocess.run(
+            [CLANG, "-g", "-O2", "-emit-llvm", "-Xclang", "-disable-llvm-passes",
+             "-D__TARGET_ARCH_%s" % arch] + kernel_header_cflags(arch)
+            + ["-c", bpf_src, "-o", "-"],
+            stdout=subprocess.PIPE, check=True,
+        ).stdout
+        ir = subprocess.run([OPT, "-O2", "-mtriple=bpf-pc-linux"], input=ir,
+                            stdout=subprocess.PIPE, check=True).stdout
+        subprocess.run([LLC, "-march=bpf", "-filetype=obj", "-o", obj_path], input=ir, check=True)
+    with open(obj_path[:-len(".o")] + ".json", "w") as f:
+        json.dump(description, f, indent=1)
+    return obj_path
+
+
+def main(argv):
+    if len(argv) < 2:
+        print("usage: %s <program.c> [-DFLAG[=value] ...]" % argv[0])
+        return 1
+    generate_vmlinux_header(OBJECT_DIR)
+    print(build(argv[1], argv[2:]))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
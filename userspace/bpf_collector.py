@@ -18,8 +18,20 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 """
 
-from bcc import BPF, PerfType, PerfHWConfig, PerfSWConfig
-from .proc_topology import BpfProcTopology
+try:
+    from bcc import BPF, PerfType, PerfHWConfig, PerfSWConfig
+except ImportError:
+    # bcc is only needed when the programs are not precompiled
+    BPF = None
+    from .libbpf_loader import PerfType, PerfHWConfig, PerfSWConfig
+from . import libbpf_loader
+from .bpf_stats import BpfProgStats
+from .pmu_events import PmuEventSet, DEFAULT_EVENTS
+from .cgroup_resolver import CgroupResolver
+from .idle_power import IdlePowerModel
+from .power_attribution import PowerAttribution
+from .map_sizes import MapSizes
+from .map_batch import snapshot_of
 from .proc_topology import ProcTopology
 from .process_info import BpfPidStatus
 from .process_info import SocketProcessItem
@@ -28,7 +40,6 @@ from .process_info import ProcessInfo
 from .sample_controller import SampleController
 import ctypes as ct
 import json
-import traceback
 import multiprocessing
 import os
 import time
@@ -44,6 +55,15 @@ class BpfSample:
         total_active_power,
         pid_dict,
         cpu_cores,
+        prog_stats=None,
+        multiplexing_ratio=1.0,
+        epoch=0,
+        overwritten_cpus=0,
+        errors=None,
+        frequency_ratios=None,
+        idle_power=None,
+        idle_fractions=None,
+        sampling_stats=None,
     ):
         self.max_ts = max_ts
         self.total_execution_time = total_time
@@ -52,6 +72,15 @@ class BpfSample:
         self.total_active_power = total_active_power
         self.pid_dict = pid_dict
         self.cpu_cores = cpu_cores
+        self.prog_stats = prog_stats if prog_stats is not None else {}
+        self.multiplexing_ratio = multiplexing_ratio
+        self.epoch = epoch
+        self.overwritten_cpus = overwritten_cpus
+        self.errors = errors if errors is not None else {}
+        self.frequency_ratios = frequency_ratios if frequency_ratios is not None else []
+        self.idle_power = idle_power if idle_power is not None else {}
+        self.idle_fractions = idle_fractions if idle_fractions is not None else {}
+        self.sampling_stats = sampling_stats
 
     def get_max_ts(self):
         return self.max_ts
@@ -74,6 +103,76 @@ class BpfSample:
     def get_cpu_cores(self):
         return self.cpu_cores
 
+    def get_prog_stats(self):
+        return self.prog_stats
+
+    def get_multiplexing_ratio(self):
+        return self.multiplexing_ratio
+
+    def get_epoch(self):
+        return self.epoch
+
+    def get_overwritten_cpus(self):
+        return self.overwritten_cpus
+
+    def get_errors(self):
+        return self.errors
+
+    def add_errors(self, errors):
+        """Add the errors of the other BPF programs in the window"""
+        for name, count in errors.items():
+            self.errors[name] = self.errors.get(name, 0) + count
+
+    def get_frequency_ratios(self):
+        """Return the effective over nominal frequency of each CPU, None if unknown"""
+        return self.frequency_ratios
+
+    def get_frequency_ratio(self):
+        ratios = [ratio for ratio in self.frequency_ratios if ratio is not None]
+        return sum(ratios) / len(ratios) if ratios else 0.0
+
+    def get_idle_power(self):
+        """Return the static core power (mW) of each socket, not attributed to the processes"""
+        return self.idle_power
+
+    def get_idle_fractions(self):
+        """Return the fraction of the window the CPUs of each socket spent idle"""
+        return self.idle_fractions
+
+    def get_sampling_stats(self):
+        """Return (samples, 95% bound on the CPU share of any process) in
+        the sampling capture mode, None when every switch is traced"""
+        return self.sampling_stats
+
+    def _format_sampling_stats(self):
+        return "{:d} samples +-{:.2%} share".format(*self.sampling_stats)
+
+    def _format_idle_power(self):
+        return " ".join(
+            "{:d}: {:.3f} ({:.1%} idle)".format(socket, power, self.idle_fractions.get(socket, 0.0))
+            for socket, power in sorted(self.idle_power.items())
+        )
+
+    def get_migrated_slices(self):
+        """Return the slices recovered and dropped after a migration"""
+        return (
+            self.errors.get("MIGRATED_SLICE_RECOVERED", 0),
+            self.errors.get("THREAD_MIGRATED_UNEXPECTEDLY", 0),
+        )
+
+    def _format_migrated_slices(self):
+        return "{:d} recovered {:d} dropped".format(*self.get_migrated_slices())
+
+    def _logged_errors(self):
+        return sorted(
+            (name, count) for name, count in self.errors.items()
+            if name not in BPFErrors.event_dict.values()
+        )
+
+    def _format_prog_stats(self, run_cnt, run_time_ns):
+        per_run = run_time_ns / run_cnt if run_cnt > 0 else 0
+        return "{:d} runs {:.0f} ns/run".format(run_cnt, per_run)
+
     def __str__(self):
         str_representation = ""
         for key, value in sorted(self.pid_dict.items()):
@@ -88,7 +187,22 @@ class BpfSample:
         d["TIMESLICE"] = str(self.timeslice / 1000000000)
         d["TOTAL PACKAGE ACTIVE POWER"] = "{:.3f}".format(self.total_active_power["package"])
         d["TOTAL CORE ACTIVE POWER"] = "{:.3f}".format(self.total_active_power["core"])
-        # d["TOTAL DRAM ACTIVE POWER"] = "{:.3f}".format(self.total_active_power["dram"])
+        d["TOTAL UNCORE ACTIVE POWER"] = "{:.3f}".format(self.total_active_power["uncore"])
+        d["TOTAL DRAM ACTIVE POWER"] = "{:.3f}".format(self.total_active_power["dram"])
+        d["MULTIPLEXING RATIO"] = "{:.3f}".format(self.multiplexing_ratio)
+        d["EPOCH"] = str(self.epoch)
+        d["OVERWRITTEN CPUS"] = str(self.overwritten_cpus)
+        d["MIGRATED SLICES"] = self._format_migrated_slices()
+        if self.frequency_ratios:
+            d["FREQUENCY RATIO"] = "{:.3f}".format(self.get_frequency_ratio())
+        if self.idle_power:
+            d["IDLE CORE POWER"] = self._format_idle_power()
+        if self.sampling_stats:
+            d["SAMPLING"] = self._format_sampling_stats()
+        for name, (run_cnt, run_time_ns) in sorted(self.prog_stats.items()):
+            d["BPF " + name.upper()] = self._format_prog_stats(run_cnt, run_time_ns)
+        for name, count in self._logged_errors():
+            d["ERROR " + name] = str(count)
         return d
 
     def get_log_line(self):
@@ -108,9 +222,40 @@ class BpfSample:
             + "\n\t"
             + "TOTAL CORE ACTIVE POWER:\t"
             + "{:.3f}".format(self.total_active_power["core"])
-            # + "\n\t"
-            # + "TOTAL DRAM ACTIVE POWER:\t"
-            # + "{:.3f}".format(self.total_active_power["dram"])
+            + "\n\t"
+            + "TOTAL UNCORE ACTIVE POWER:\t"
+            + "{:.3f}".format(self.total_active_power["uncore"])
+            + "\n\t"
+            + "TOTAL DRAM ACTIVE POWER:\t"
+            + "{:.3f}".format(self.total_active_power["dram"])
+            + "\n\t"
+            + "MULTIPLEXING RATIO:\t\t"
+            + "{:.3f}".format(self.multiplexing_ratio)
+            + "\n\t"
+            + "EPOCH:\t\t\t\t"
+            + str(self.epoch)
+            + "\t"
+            + "OVERWRITTEN CPUS: "
+            + str(self.overwritten_cpus)
+            + "\n\t"
+            + "MIGRATED SLICES:\t\t"
+            + self._format_migrated_slices()
+            + (
+                "\n\tFREQUENCY RATIO:\t\t" + "{:.3f}".format(self.get_frequency_ratio())
+                if self.frequency_ratios else ""
+            )
+            + (
+                "\n\tIDLE CORE POWER:\t\t" + self._format_idle_power()
+                if self.idle_power else ""
+            )
+            + (
+                "\n\tSAMPLING:\t\t\t" + self._format_sampling_stats()
+                if self.sampling_stats else ""
+            )
+            + "".join(
+                "\n\tERROR " + name + ":\t" + str(count)
+                for name, count in self._logged_errors()
+            )
         )
         return str_representation
 
@@ -121,13 +266,28 @@ class BpfSample:
             "TIMESLICE": str(self.timeslice),
             "TOTAL PACKAGE ACTIVE POWER": "{:.3f}".format(self.total_active_power["package"]),
             "TOTAL CORE ACTIVE POWER": "{:.3f}".format(self.total_active_power["core"]),
-            # "TOTAL DRAM ACTIVE POWER": "{:.3f}".format(self.total_active_power["dram"]),
+            "TOTAL UNCORE ACTIVE POWER": "{:.3f}".format(self.total_active_power["uncore"]),
+            "TOTAL DRAM ACTIVE POWER": "{:.3f}".format(self.total_active_power["dram"]),
+            "MULTIPLEXING RATIO": "{:.3f}".format(self.multiplexing_ratio),
+            "EPOCH": str(self.epoch),
+            "OVERWRITTEN CPUS": str(self.overwritten_cpus),
+            "MIGRATED SLICES": self._format_migrated_slices(),
         }
+        for name, (run_cnt, run_time_ns) in sorted(self.prog_stats.items()):
+            d["BPF " + name.upper()] = self._format_prog_stats(run_cnt, run_time_ns)
+        if self.frequency_ratios:
+            d["FREQUENCY RATIO"] = "{:.3f}".format(self.get_frequency_ratio())
+        if self.idle_power:
+            d["IDLE CORE POWER"] = self._format_idle_power()
+        if self.sampling_stats:
+            d["SAMPLING"] = self._format_sampling_stats()
+        for name, count in self._logged_errors():
+            d["ERROR " + name] = str(count)
         return json.dumps(d, indent=4)
 
 
 class ErrorCode(ct.Structure):
-    _fields_ = [("err", ct.c_int)]
+    _fields_ = [("err", ct.c_int), ("pid", ct.c_int)]
 
 
 class BPFErrors:
@@ -139,27 +299,86 @@ class BPFErrors:
         -5: "CORRUPTED_TOPOLOGY_MAP",
         -6: "WRONG_SIBLING_TOPOLOGY_MAP",
         -7: "THREAD_MIGRATED_UNEXPECTEDLY",
+        -8: "COUNTER_OVERFLOW",
+        -10: "PIDS_INSERT_FAILED",
+        -11: "AGGREGATES_INSERT_FAILED",
+        -12: "GRAVEYARD_INSERT_FAILED",
+    }
+    # counted together with the errors, but they are not
+    event_dict = {
+        -9: "MIGRATED_SLICE_RECOVERED",
     }
 
 
-class BpfCollector:
-    def __init__(self, topology, debug, power_measure):
+class BpfCollector(PowerAttribution):
+    # kind of the rows in foreign_cycles
+    ROW_THREAD = 0
+    ROW_GRAVE = 1
+    # rows read from the BPF program: one per thread, process or cgroup
+    AGGREGATION_CFLAGS = {
+        "thread": [],
+        "tgid": ["-DAGGREGATE_TGID"],
+        "cgroup": ["-DAGGREGATE_CGROUP"],
+    }
+    # how the cycles executed while the sibling hyperthread was busy are
+    # found: from the sched state of the siblings or the AnyThread cycles
+    SMT_OVERLAP_CFLAGS = {
+        "sched": [],
+        "any_thread": ["-DSMT_OVERLAP_ANY_THREAD"],
+    }
+    # "frequency" scales the weighted cycles by the energy of a cycle at
+    # the effective frequency of the CPU, "cycles" takes them as they are
+    ATTRIBUTION_CFLAGS = {
+        "cycles": [],
+        "frequency": ["-DFREQUENCY_WEIGHTING"],
+    }
+
+    def __init__(self, topology, debug, power_measure, accounting_engine="hash", bpf_loader="auto",
+                 object_cache=None, sched_attach_mode="auto", pmu_events=DEFAULT_EVENTS,
+                 aggregation="thread", trace_errors=False, window_trigger="auto",
+                 smt_overlap="sched", attribution="cycles", idle_power=False,
+                 capture_mode="switch", sampling_rate_hz=997, map_sizes=""):
         self.topology = topology
         self.debug = debug
+        self.trace_errors = trace_errors
+        # "sampling" does not trace sched_switch: the sampling perf event
+        # gives the time since the previous sample to the task it interrupts
+        self.capture_mode = capture_mode
+        self.sampling_rate_hz = sampling_rate_hz
+        if capture_mode == "sampling":
+            if window_trigger == "timer":
+                raise ValueError("the sampling capture mode needs the perf_event window trigger")
+            window_trigger = "perf_event"
+        self.window_trigger = window_trigger
         self.power_measure = power_measure
+        self.accounting_engine = accounting_engine
+        self.bpf_loader = bpf_loader
+        self.object_cache = object_cache
+        self.sched_attach_mode = sched_attach_mode
+        self.aggregation = aggregation
+        self.prog_stats = BpfProgStats()
         bpf_code_path = (
             os.path.dirname(os.path.abspath(__file__)) + "/../bpf/bpf_monitor.c"
         )
         # if debug is False:
             # if self.power_measure == True:
-        self.bpf_program = BPF(
-            src_file=bpf_code_path,
-            cflags=[
-                "-DNUM_CPUS=%d" % multiprocessing.cpu_count(),
+        self.num_cpus = multiprocessing.cpu_count()
+        self.smt_overlap = smt_overlap
+        self.attribution = attribution
+        self.pmu_events = PmuEventSet(pmu_events, smt_overlap, attribution)
+        self.pmu_fds = []
+        self.bpf_program = self._load_bpf_program(
+            bpf_code_path,
+            [
+                "-DNUM_CPUS=%d" % self.num_cpus,
                 "-DNUM_SOCKETS=%d" % len(self.topology.get_sockets()),
                 "-DPERFORMANCE_COUNTERS",
-                "-DDEBUG",
-            ],
+            ] + (["-DTRACE_ERRORS"] if trace_errors else [])
+            + self.pmu_events.get_cflags() + self.AGGREGATION_CFLAGS[aggregation]
+            + self.SMT_OVERLAP_CFLAGS[smt_overlap] + self.ATTRIBUTION_CFLAGS[attribution]
+            + (["-DIDLE_STATES"] if idle_power else [])
+            + (["-DSAMPLING_ENGINE"] if capture_mode == "sampling" else [])
+            + MapSizes(map_sizes).get_cflags("bpf_monitor"),
         )
         # print("Available BPF tables:", list(self.bpf_program.tables.keys()))
         # else:
@@ -173,113 +392,189 @@ class BpfCollector:
         #     )
 
         self.processors = self.bpf_program.get_table("processors")
-        self.pids = self.bpf_program.get_table("pids")
+        # the task storage engine has no pids hash, its statuses are read
+        # by running the dump_task_status task iterator, see _thread_items
+        self.pids = None
+        if self.accounting_engine == "task_storage":
+            self.bpf_program.attach_iter("dump_task_status")
+        else:
+            self.pids = self.bpf_program.get_table("pids")
         self.idles = self.bpf_program.get_table("idles")
         self.bpf_config = self.bpf_program.get_table("conf")
         self.bpf_global_timestamps = self.bpf_program.get_table("global_timestamps")
-        self.selector = 0
-        self.SELECTOR_DIM = 2
+        self.bpf_switch_count = self.bpf_program.get_table("switch_count")
+        self.bpf_counters_enabled = self.bpf_program.get_table("counters_enabled")
+        self.bpf_counters_running = self.bpf_program.get_table("counters_running")
+        self.bpf_slot_epochs = self.bpf_program.get_table("slot_epochs")
+        self.bpf_error_counts = self.bpf_program.get_table("error_counts")
+        self.bpf_foreign_cycles = self.bpf_program.get_table("foreign_cycles")
+        self.bpf_freq_cycles = None
+        self.bpf_freq_ref_cycles = None
+        if "ref_cycles" in self.pmu_events:
+            self.bpf_freq_cycles = self.bpf_program.get_table("freq_cycles")
+            self.bpf_freq_ref_cycles = self.bpf_program.get_table("freq_ref_cycles")
+        # with idle_power the static core power of each socket is estimated
+        # from the C-state residency and only the dynamic one is attributed
+        self.idle_power = idle_power
+        self.bpf_cstate_residency = None
+        self.idle_power_model = None
+        if idle_power:
+            self.bpf_cstate_residency = self.bpf_program.get_table("cstate_residency")
+            self.bpf_idle_entries = self.bpf_program.get_table("idle_entries")
+            self.idle_power_model = IdlePowerModel(self.topology.get_sockets())
+            self.NUM_CSTATES = len(self.bpf_cstate_residency)
+        # (window end, idle ns of each CPU up to it) of the previous sample
+        self.idle_residency = None
+        self.window_end_ts = None
+        self.error_totals = {}
+        self.aggregates = None
+        self.graveyard = None
+        if self.aggregation != "thread":
+            self.aggregates = self.bpf_program.get_table("aggregates")
+        else:
+            self.graveyard = self.bpf_program.get_table("graveyard")
+        self.cgroup_resolver = CgroupResolver()
+        # batch readers of the tables drained every window, by table name
+        self.snapshots = {}
+        # epoch 0 marks the slots that were never written
+        self.epoch = 1
+        self.SELECTOR_DIM = len(self.idles.Leaf().epoch)
         self.timeslice = 1000000000
         self.timed_capture = False
 
-        # self.bpf_program["cpu_cycles"].open_perf_event(PerfType.HARDWARE, \
-        #    PerfHWConfig.CPU_CYCLES)
-        # 4 means RAW_TYPE
-        # int("73003c",16) is the hex for UNHALTED_CORE_CYCLES for any thread
-        # int("53003c",16) is the hex for UNHALTED_CORE_CYCLES
-        # int("5300c0",16) is the hex for INSTRUCTION_RETIRED
-        # if self.power_measure == True:
-        #     self.bpf_program["cycles_core"].open_perf_event(4, int("73003c", 16))
-        #     self.bpf_program["cycles_thread"].open_perf_event(4, int("53003c", 16))
-        #     self.bpf_program["instr_thread"].open_perf_event(4, int("5300c0", 16))
-        #     self.bpf_program["cache_misses"].open_perf_event(
-        #         PerfType.HARDWARE, PerfHWConfig.CACHE_MISSES
-        #     )
-        #     self.bpf_program["cache_refs"].open_perf_event(
-        #         PerfType.HARDWARE, PerfHWConfig.CACHE_REFERENCES
-        #     )
-        #     if self.power_measure == True:
-        try:
-            # print("Opening cycles_core perf event...")
-            # self.bpf_program["cycles_core"].open_perf_event(4, int("73003c", 16))
-            self.bpf_program["cycles_core"].open_perf_event(PerfType.HARDWARE, PerfHWConfig.CPU_CYCLES)
-            # print("cycles_core opened successfully.")
-        except Exception as e:
-            print(f"Error opening cycles_core: {e}")
-            traceback.print_exc()
+        self._open_pmu_counters()
+
+    def _open_pmu_counters(self):
+        # Counter c of CPU i goes at index c * NUM_CPUS + i of pmu_counters.
+        # Raw events can be used in pmu_events with type 4, e.g.
+        # 0x73003c is UNHALTED_CORE_CYCLES for any thread, 0x53003c is
+        # UNHALTED_CORE_CYCLES and 0x5300c0 is INSTRUCTION_RETIRED
+        pmu_counters = self.bpf_program["pmu_counters"]
+        for index, event in enumerate(self.pmu_events):
+            for cpu in range(self.num_cpus):
+                try:
+                    fd = libbpf_loader.perf_event_open(event.ev_type, event.ev_config, cpu)
+                except OSError as e:
+                    print(f"Error opening {event.name} on cpu {cpu}: {e}")
+                    continue
+                self.pmu_fds.append(fd)
+                pmu_counters[ct.c_int(index * self.num_cpus + cpu)] = ct.c_int(fd)
+
+    def _load_bpf_program(self, bpf_code_path, cflags):
+        # The task storage engine needs the core loader, for the task
+        # iterator that reads the statuses, and task local storage helpers
+        # for tracing programs in the kernel (>= 5.11), so load the programs
+        # right away and fall back to the pids hash if they are rejected
+        if self.accounting_engine == "task_storage":
+            try:
+                return self._compile_and_load(bpf_code_path, cflags + ["-DTASK_STORAGE"])
+            except Exception as e:
+                print("Task storage engine not available, falling back to hash: %s" % e)
+                self.accounting_engine = "hash"
+        return self._compile_and_load(bpf_code_path, cflags)
+
+    def _compile_and_load(self, bpf_code_path, cflags):
+        # "core" loads the objects built by `make bpf-objects` (or by a
+        # previous run, from the object cache) through libbpf, "bcc" compiles
+        # the source at startup, "auto" tries them in this order
+        if self.bpf_loader in ("core", "auto"):
+            try:
+                bpf_program = self._load_core(bpf_code_path, cflags)
+                self.bpf_loader = "core"
+                return bpf_program
+            except Exception as e:
+                if self.bpf_loader == "core" or BPF is None:
+                    raise
+                print("Precompiled BPF program not available, compiling with bcc: %s" % e)
+        if self.window_trigger == "timer":
+            raise ValueError("the timer window trigger needs the core BPF loader")
+        if "-DTASK_STORAGE" in cflags:
+            raise ValueError("the task storage engine needs the core BPF loader")
+        bpf_program = BPF(src_file=bpf_code_path, cflags=cflags)
+        bpf_program.load_func("trace_switch", BPF.TRACEPOINT)
+        bpf_program.load_func("timed_trace", BPF.PERF_EVENT)
+        self.bpf_loader = "bcc"
+        self.window_trigger = "perf_event"
+        return bpf_program
+
+    def _load_core(self, bpf_code_path, cflags):
+        # Fixed windows are split by BPF timers on kernels that let BTF
+        # tracepoints use them (>= 5.15), "auto" falls back to the CPU_CLOCK
+        # perf event that also wakes up the idle CPUs
+        if self.window_trigger in ("timer", "auto"):
+            try:
+                bpf_program = libbpf_loader.load(
+                    bpf_code_path, cflags + ["-DWINDOW_TIMERS"], cache=self.object_cache
+                )
+                self.window_trigger = "timer"
+                return bpf_program
+            except Exception as e:
+                if self.window_trigger == "timer":
+                    raise
+                print("BPF timers not available, using a CPU_CLOCK perf event: %s" % e)
+        bpf_program = libbpf_loader.load(bpf_code_path, cflags, cache=self.object_cache)
+        self.window_trigger = "perf_event"
+        return bpf_program
 
-        try:
-            # print("Opening cycles_thread perf event...")
-            # self.bpf_program["cycles_thread"].open_perf_event(4, int("53003c", 16))
-            self.bpf_program["cycles_thread"].open_perf_event(PerfType.HARDWARE, PerfHWConfig.CPU_CYCLES)
-            # print("cycles_thread opened successfully.")
-        except Exception as e:
-            print(f"Error opening cycles_thread: {e}")
+    def get_bpf_loader(self):
+        return self.bpf_loader
 
-        try:
-            # print("Opening instr_thread perf event...")
-            # self.bpf_program["instr_thread"].open_perf_event(4, int("5300c0", 16))
-            self.bpf_program["instr_thread"].open_perf_event(PerfType.HARDWARE, PerfHWConfig.INSTRUCTIONS)
-            # print("instr_thread opened successfully.")
-        except Exception as e:
-            print(f"Error opening instr_thread: {e}")
+    def get_accounting_engine(self):
+        return self.accounting_engine
 
-        try:
-            # print("Opening cache_misses perf event...")
-            self.bpf_program["cache_misses"].open_perf_event(
-                PerfType.HARDWARE, PerfHWConfig.CACHE_MISSES
-            )
-            # print("cache_misses opened successfully.")
-        except Exception as e:
-            print(f"Error opening cache_misses: {e}")
+    def get_window_trigger(self):
+        return self.window_trigger
 
-        try:
-            # print("Opening cache_refs perf event...")
-            self.bpf_program["cache_refs"].open_perf_event(
-                PerfType.HARDWARE, PerfHWConfig.CACHE_REFERENCES
-            )
-            # print("cache_refs opened successfully.")
-        except Exception as e:
-            print(f"Error opening cache_refs: {e}")
+    def get_capture_mode(self):
+        return self.capture_mode
 
     def print_event(self, cpu, data, size):
         event = ct.cast(data, ct.POINTER(ErrorCode)).contents
-        if event.err >= 0:
-            print(
-                "core: "
-                + str(cpu)
-                + " topology counters overflow or initialized with pid: "
-                + str(event.err)
-            )
-        elif event.err < -1:
-            # exclude the BPF_PROCEED_WITH_DEBUG_MODE event, since it is used
-            # just to advance computation for the timed capture
-            print("core: " + str(cpu) + " " + str(BPFErrors.error_dict[event.err]))
+        print(
+            "core: "
+            + str(cpu)
+            + " "
+            + str(BPFErrors.error_dict.get(event.err, BPFErrors.event_dict.get(event.err, event.err)))
+            + " pid: "
+            + str(event.pid)
+        )
+
+    def _read_error_counts(self):
+        # error_counts holds per-CPU running totals indexed by -code, report
+        # the errors raised since the previous window
+        errors = {}
+        codes = dict(BPFErrors.error_dict)
+        codes.update(BPFErrors.event_dict)
+        for code, name in codes.items():
+            total = self.bpf_error_counts.sum(ct.c_int(-code)).value
+            count = total - self.error_totals.get(code, 0)
+            self.error_totals[code] = total
+            if count > 0:
+                errors[name] = count
+        return errors
 
     def start_capture(self, timeslice):
-        for key, value in self.topology.get_new_bpf_topology().items():
-            self.processors[ct.c_ulonglong(key)] = value
+        if self.capture_mode == "sampling":
+            # dynamic windows are sized by the context switches, which are
+            # not traced when sampling
+            raise ValueError("the sampling capture mode needs the fixed window mode")
+        for key, value in self.topology.get_new_bpf_topology(self.processors.Leaf).items():
+            self.processors[ct.c_int(key)] = value
 
         self.timed_capture = False
         self.timeslice = timeslice
-        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.selector)  # current selector
-        self.bpf_config[ct.c_int(1)] = ct.c_uint(self.selector)  # old selector
-        self.bpf_config[ct.c_int(2)] = ct.c_uint(self.timeslice)  # timeslice
-        self.bpf_config[ct.c_int(3)] = ct.c_uint(0)  # switch count
+        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.epoch)  # current epoch
+        self.bpf_config[ct.c_int(1)] = ct.c_uint(self.timeslice)  # timeslice
 
-        if self.debug == True:
+        if self.trace_errors == True:
             self.bpf_program["err"].open_perf_buffer(self.print_event, page_cnt=256)
 
-        self.bpf_program.attach_tracepoint(
-            tp="sched:sched_switch", fn_name="trace_switch"
-        )
-        self.bpf_program.attach_tracepoint(
-            tp="sched:sched_process_exit", fn_name="trace_exit"
-        )
+        self._attach_sched_programs()
+        self._attach_idle_program()
 
     def start_timed_capture(self, count=0, frequency=0):
         if frequency:
-            sample_freq = frequency
+            sample_freq = max(1, int(round(frequency)))
             sample_period = 0
             self.timeslice = int((1 / float(frequency)) * 1000000000)
         elif count:
@@ -294,50 +589,170 @@ class BpfCollector:
 
         self.timed_capture = True
 
-        for key, value in self.topology.get_new_bpf_topology().items():
-            self.processors[ct.c_ulonglong(key)] = value
+        for key, value in self.topology.get_new_bpf_topology(self.processors.Leaf).items():
+            self.processors[ct.c_int(key)] = value
 
-        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.selector)  # current selector
-        self.bpf_config[ct.c_int(1)] = ct.c_uint(self.selector)  # old selector
-        self.bpf_config[ct.c_int(2)] = ct.c_uint(self.timeslice)  # timeslice
-        self.bpf_config[ct.c_int(3)] = ct.c_uint(0)  # switch count
+        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.epoch)  # current epoch
+        self.bpf_config[ct.c_int(1)] = ct.c_uint(self.timeslice)  # timeslice
 
-        if self.debug == True:
+        if self.trace_errors == True:
             self.bpf_program["err"].open_perf_buffer(self.print_event, page_cnt=256)
 
+        self._attach_idle_program()
+        if self.capture_mode == "sampling":
+            # the windows are split by the samples
+            self._attach_sampling_programs()
+            return
+        if self.window_trigger == "timer":
+            self._attach_timer_programs()
+            return
+
+        self._attach_sched_programs()
+        self.bpf_program.attach_perf_event(
+            ev_type=PerfType.SOFTWARE,
+            ev_config=PerfSWConfig.CPU_CLOCK,
+            fn_name="timed_trace",
+            sample_period=sample_period,
+            sample_freq=sample_freq,
+        )
+
+        self.prog_stats.add("timed_trace", self.bpf_program.load_func("timed_trace", self.bpf_program.PERF_EVENT).fd)
+
+    def _attach_sched_programs(self):
+        # Raw tracepoints (>= 4.17) skip the copy of the sched_switch fields
+        # into the perf trace buffer, "auto" falls back to classic tracepoints.
+        # With libbpf the raw mode attaches the BTF tracepoints, that read
+        # the task_structs without probe reads, when the kernel has BTF
+        if self.sched_attach_mode in ("raw", "auto"):
+            try:
+                if self._btf_tracepoints():
+                    self._attach_btf_programs(["sched_switch", "sched_process_exit"])
+                else:
+                    self.bpf_program.attach_raw_tracepoint(tp="sched_switch", fn_name="raw_trace_switch")
+                    self.bpf_program.attach_raw_tracepoint(tp="sched_process_exit", fn_name="raw_trace_exit")
+                    self.sched_attach_mode = "raw"
+                    self._add_prog_stats(["raw_trace_switch", "raw_trace_exit"], self.bpf_program.RAW_TRACEPOINT)
+                self._attach_migrate_program()
+                return
+            except Exception as e:
+                if self.sched_attach_mode == "raw":
+                    raise
+                print("Raw tracepoints not available, using classic tracepoints: %s" % e)
+                self._detach_sched_programs("btf" if self._btf_tracepoints() else "raw")
         self.bpf_program.attach_tracepoint(
             tp="sched:sched_switch", fn_name="trace_switch"
         )
         self.bpf_program.attach_tracepoint(
             tp="sched:sched_process_exit", fn_name="trace_exit"
         )
+        self.sched_attach_mode = "classic"
+        self._add_prog_stats(["trace_switch", "trace_exit"], self.bpf_program.TRACEPOINT)
+        self._attach_migrate_program()
+
+    def _attach_sampling_programs(self):
+        # only the exits are traced, to release the status of the threads
+        if self.sched_attach_mode in ("raw", "auto"):
+            try:
+                if self._btf_tracepoints():
+                    self._attach_btf_programs(["sched_process_exit"])
+                else:
+                    self.bpf_program.attach_raw_tracepoint(tp="sched_process_exit", fn_name="raw_trace_exit")
+                    self.sched_attach_mode = "raw"
+                    self._add_prog_stats(["raw_trace_exit"], self.bpf_program.RAW_TRACEPOINT)
+            except Exception as e:
+                if self.sched_attach_mode == "raw":
+                    raise
+                print("Raw tracepoints not available, using classic tracepoints: %s" % e)
+        if self.sched_attach_mode not in ("raw", "btf"):
+            self.bpf_program.attach_tracepoint(tp="sched:sched_process_exit", fn_name="trace_exit")
+            self.sched_attach_mode = "classic"
+            self._add_prog_stats(["trace_exit"], self.bpf_program.TRACEPOINT)
         self.bpf_program.attach_perf_event(
             ev_type=PerfType.SOFTWARE,
             ev_config=PerfSWConfig.CPU_CLOCK,
             fn_name="timed_trace",
-            sample_period=sample_period,
-            sample_freq=sample_freq,
+            sample_period=0,
+            sample_freq=self.sampling_rate_hz,
         )
+        self.prog_stats.add("timed_trace", self.bpf_program.load_func("timed_trace", self.bpf_program.PERF_EVENT).fd)
+
+    def _attach_migrate_program(self):
+        # migrations are rare enough for the classic tracepoint, whose
+        # format has the source CPU in every attach mode
+        self.bpf_program.attach_tracepoint(
+            tp="sched:sched_migrate_task", fn_name="trace_migrate"
+        )
+        self._add_prog_stats(["trace_migrate"], self.bpf_program.TRACEPOINT)
+
+    def _attach_idle_program(self):
+        if not self.idle_power:
+            return
+        self.bpf_program.attach_tracepoint(tp="power:cpu_idle", fn_name="trace_cpu_idle")
+        self._add_prog_stats(["trace_cpu_idle"], self.bpf_program.TRACEPOINT)
+
+    def _attach_timer_programs(self):
+        # The window timers are armed and cancelled at each switch by a BTF
+        # tracepoint, raw and classic tracepoints cannot use BPF timers
+        self._attach_btf_programs(["sched_switch", "sched_process_exit"])
+        self._attach_migrate_program()
+
+    def _btf_tracepoints(self):
+        # objects built on the kernel headers (no kernel BTF) only have the
+        # raw tracepoints of BCC
+        return self.bpf_loader == "core" and self.bpf_program.btf
+
+    def _attach_btf_programs(self, tps):
+        # the program of tracepoint tp is btf_<tp>
+        for tp in tps:
+            self.bpf_program.attach_btf_tracepoint(tp=tp, fn_name="btf_" + tp)
+        self.sched_attach_mode = "btf"
+        self._add_prog_stats(["btf_" + tp for tp in tps], self.bpf_program.TRACING)
+
+    def _detach_sched_programs(self, mode):
+        for tp in ["sched_switch", "sched_process_exit"]:
+            try:
+                if mode == "btf":
+                    self.bpf_program.detach_btf_tracepoint(tp=tp)
+                elif mode == "raw":
+                    self.bpf_program.detach_raw_tracepoint(tp=tp)
+                else:
+                    self.bpf_program.detach_tracepoint(tp="sched:" + tp)
+            except Exception:
+                pass
+        try:
+            self.bpf_program.detach_tracepoint(tp="sched:sched_migrate_task")
+        except Exception:
+            pass
+
+    def _add_prog_stats(self, fn_names, prog_type):
+        for fn_name in fn_names:
+            self.prog_stats.add(fn_name, self.bpf_program.load_func(fn_name, prog_type).fd)
+
+    def get_sched_attach_mode(self):
+        return self.sched_attach_mode
 
     def stop_capture(self):
-        self.bpf_program.detach_tracepoint(tp="sched:sched_switch")
-        self.bpf_program.detach_tracepoint(tp="sched:sched_process_exit")
+        self._detach_sched_programs(self.sched_attach_mode)
+        if self.idle_power:
+            try:
+                self.bpf_program.detach_tracepoint(tp="power:cpu_idle")
+            except Exception:
+                pass
 
     def get_new_sample(self, sample_controller, rapl_monitor):
         sample = self._get_new_sample(rapl_monitor)
         if not self.timed_capture:
             sample_controller.compute_sleep_time(sample.get_sched_switch_count())
             self.timeslice = sample_controller.get_timeslice()
-            self.bpf_config[ct.c_int(2)] = ct.c_uint(self.timeslice)  # timeslice
+            self.bpf_config[ct.c_int(1)] = ct.c_uint(self.timeslice)  # timeslice
 
-        if self.debug == True:
+        if self.trace_errors == True:
             self.bpf_program.kprobe_poll()
 
         return sample
 
     def _get_new_sample(self, rapl_monitor):
         total_execution_time = 0.0
-        sched_switch_count = self.bpf_config[ct.c_int(3)].value
         tsmax = 0
 
         # Initialize the weighted cycles for each core to 0
@@ -345,77 +760,102 @@ class BpfCollector:
         for socket in self.topology.get_sockets():
             total_weighted_cycles.append(0)
 
-        # We use a binary selector so that while userspace is reading events
-        # using selector 0 we write events using selector 1 and vice versa.
-        # Here we initialize it to 0 and set the number of slots used for
-        # read/write equal to the number of sockets * the number of selectors
-        read_selector = 0
-        total_slots_length = len(self.topology.get_sockets()) * self.SELECTOR_DIM
-
-        # Every time we get a new sample we want to switch the selector we are using
-        if self.selector == 0:
-            self.selector = 1
-            read_selector = 0
-        else:
-            self.selector = 0
-            read_selector = 1
+        # eBPF writes the events of epoch e in slot e % SELECTOR_DIM of a
+        # ring, so that while userspace is reading the epoch that just ended
+        # events are written in the next slot. The slots are stamped with
+        # their epoch, data of older windows is never taken for this one.
+        read_epoch = self.epoch
+        read_selector = read_epoch % self.SELECTOR_DIM
+
+        # Every time we get a new sample we want to move to the next epoch
+        self.epoch = self.epoch + 1
 
         rapl_measurement = []
         package_diff = 0
         core_diff = 0
         dram_diff = 0
         # if self.power_measure == True:
-            # Get new sample from rapl right before changing selector in eBPF
-        rapl_measurement = rapl_monitor.get_rapl_measure()
-
-        package_diff = rapl_measurement["package"]
-        core_diff = rapl_measurement["core"]
-        dram_diff = rapl_measurement["dram"]
+            # Get new sample from rapl right before changing selector in eBPF,
+            # the background sampler is read over the window span below
+        if not rapl_monitor.is_sampling():
+            rapl_measurement = rapl_monitor.get_rapl_measure()
 
-        # Propagate the update of the selector to the eBPF program
-        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.selector)
+        # Propagate the update of the epoch to the eBPF program
+        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.epoch)
 
         pid_dict = {}
 
-        tsmax = self.bpf_global_timestamps[ct.c_int(read_selector)].value
+        # Switch counts and timestamps are per-CPU: reduce them now that the
+        # eBPF side writes another slot. Each CPU resets the slot when it
+        # enters it in a new epoch, so only take the CPUs whose slot is
+        # stamped with the epoch we read. A later stamp means that the ring
+        # went around before this read and the data of that CPU is lost
+        slot_epochs = [
+            getattr(epoch, "value", epoch)
+            for epoch in self.bpf_slot_epochs[ct.c_int(read_selector)]
+        ]
+        overwritten_cpus = sum(1 for epoch in slot_epochs if epoch > read_epoch)
 
-        # Add the count of clock cycles for each active process to the total
-        # number of clock cycles of the socket
-        for key, data in self.pids.items():
-            if data.ts[read_selector] + self.timeslice > tsmax:
-                total_execution_time = (
-                    total_execution_time + float(data.time_ns[read_selector]) / 1000000
-                )
+        tsmax = self._reduce_slot(
+            self.bpf_global_timestamps, read_selector, slot_epochs, read_epoch, max
+        )
+        sched_switch_count = self._reduce_slot(
+            self.bpf_switch_count, read_selector, slot_epochs, read_epoch, sum
+        )
 
-            # if self.power_measure == True:
-            for multisocket_selector in range(
-                    read_selector, total_slots_length, self.SELECTOR_DIM
-                ):
-                    # Compute the number of total weighted cycles per socket
-                    cycles_index = int(multisocket_selector / self.SELECTOR_DIM)
-                    # if data.ts[read_selector] + self.timeslice > tsmax:
-                    total_weighted_cycles[cycles_index] = (total_weighted_cycles[cycles_index]+ data.weighted_cycles[multisocket_selector])
-                        
-
-        # Add the count of clock cycles for each idle process to the total
-        # number of clock cycles of the socket
-        for key, data in self.idles.items():
-            if data.ts[read_selector] + self.timeslice > tsmax:
+        # the window spans from the latest event of the previous one to its
+        # own latest event, on the clock of the energy readings
+        if rapl_monitor.is_sampling():
+            rapl_measurement = rapl_monitor.get_rapl_measure(
+                self.window_end_ts, tsmax if tsmax > 0 else None
+            )
+            if tsmax > 0:
+                self.window_end_ts = tsmax
+
+        package_diff = rapl_measurement["package"]
+        core_diff = rapl_measurement["core"]
+        dram_diff = rapl_measurement["dram"]
+
+        # Fraction of the window in which the counters were on the PMU,
+        # below 1 the counters are multiplexed and their values are scaled
+        counters_enabled = self._reduce_slot(
+            self.bpf_counters_enabled, read_selector, slot_epochs, read_epoch, sum
+        )
+        counters_running = self._reduce_slot(
+            self.bpf_counters_running, read_selector, slot_epochs, read_epoch, sum
+        )
+        multiplexing_ratio = 1.0
+        if counters_enabled > 0:
+            multiplexing_ratio = float(counters_running) / counters_enabled
+
+        frequency_ratios = self._read_frequency_ratios(read_selector, slot_epochs, read_epoch)
+        idle_fractions = self._read_idle_fractions(tsmax)
+
+        foreign_cycles = self._read_foreign_cycles(read_selector, read_epoch)
+        pid_rows = self._read_pid_rows(read_selector, read_epoch, foreign_cycles)
+        idle_rows = [
+            (-1 * (1 + getattr(key, "value", key)), data, self._socket_cycles([data], read_selector))
+            for key, data in self._table_items(self.idles)
+        ]
+
+        # A single pass over the rows of the window builds their ProcessInfo
+        # and adds their clock cycles to the total of each socket, the power
+        # that needs the totals is set once they are known
+        idle_keys = set()
+        for rows, idle in ((pid_rows, False), (idle_rows, True)):
+            for key, data, socket_cycles in rows:
+                if data.epoch[read_selector] != read_epoch:
+                    continue
                 total_execution_time = (
                     total_execution_time + float(data.time_ns[read_selector]) / 1000000
                 )
-
-            # if self.power_measure == True:
-            for multisocket_selector in range(
-                    read_selector, total_slots_length, self.SELECTOR_DIM
-                ):
-                    # Compute the number of total weighted cycles per socket
-                    cycles_index = int(multisocket_selector / self.SELECTOR_DIM)
-                    # if data.ts[read_selector] + self.timeslice > tsmax:
-                    total_weighted_cycles[cycles_index] = (
-                            total_weighted_cycles[cycles_index]
-                            + data.weighted_cycles[multisocket_selector]
-                        )
+                for socket, cycles in enumerate(socket_cycles):
+                    total_weighted_cycles[socket] += cycles
+                if idle:
+                    pid_dict[key] = self._build_proc_info(key, data.pid, key, data, socket_cycles, read_selector)
+                    idle_keys.add(key)
+                else:
+                    pid_dict[key] = self._build_proc_info(key, key, data.tgid, data, socket_cycles, read_selector)
 
         # Compute package/core/dram power in mW from RAPL samples
         package_power = [
@@ -431,114 +871,49 @@ class BpfCollector:
         ]
         # print("DRAM power: ", dram_power)
 
+        # the package domain holds the cores and the uncore (LLC, ring,
+        # memory controller), that is shared by whatever misses in the cores
+        uncore_power = [
+            max(package_power[skt] - core_power[skt], 0.0) for skt in self.topology.get_sockets()
+        ]
+
         total_power = {
             "package": sum(package_power),
             "core": sum(core_power),
+            "uncore": sum(uncore_power),
             "dram": sum(dram_power),
         }
 
-        for key, data in self.pids.items():
-            proc_info = ProcessInfo(len(self.topology.get_sockets()))
-            proc_info.set_pid(data.pid)
-            proc_info.set_tgid(data.tgid)
-            proc_info.set_comm(data.comm)
-            proc_info.set_cycles(data.cycles[read_selector])
-            proc_info.set_instruction_retired(data.instruction_retired[read_selector])
-            proc_info.set_cache_misses(data.cache_misses[read_selector])
-            proc_info.set_cache_refs(data.cache_refs[read_selector])
-            proc_info.set_time_ns(data.time_ns[read_selector])
-            add_proc = False
-
-            for multisocket_selector in range(
-                read_selector, total_slots_length, self.SELECTOR_DIM
-            ):
-                if data.ts[read_selector] + self.timeslice > tsmax:
-                    socket_info = SocketProcessItem()
-                    socket_info.set_weighted_cycles(
-                        data.weighted_cycles[multisocket_selector]
-                    )
-                    socket_info.set_ts(data.ts[read_selector])
-                    proc_info.set_socket_data(
-                        int(multisocket_selector / self.SELECTOR_DIM), socket_info
-                    )
-                    add_proc = True
-
-            # --- ADD THIS BLOCK ---
-            # Try to set container_id using cgroup_id
-            try:
-                cgroup_id = ProcTable.find_cgroup_id(data.pid, data.tgid)
-                if cgroup_id is not None:
-                    proc_info.set_cgroup_id(cgroup_id)
-                    proc_info.set_container_id(cgroup_id[0:12])
-            except Exception:
-                pass
-            # After: cgroup_id = ProcTable.find_cgroup_id_static(data.pid, data.tgid)
-            # print(f"DEBUG: PID {data.pid} TGID {data.tgid} cgroup_id: {cgroup_id}")
-            # --- END BLOCK ---
-
-            if add_proc:
-                pid_dict[data.pid] = proc_info
-
-                proc_info.set_power(
-                    self._get_pid_power(
-                        proc_info, total_weighted_cycles, core_power
-                    )
+        # only the dynamic core power goes to the processes, the static one
+        # is reported per socket
+        idle_power = {}
+        if self.idle_power_model is not None and idle_fractions:
+            for skt in self.topology.get_sockets():
+                idle_power[skt] = self.idle_power_model.update(
+                    skt, 1.0 - idle_fractions[skt], core_power[skt]
                 )
-                # print("DEBUG: total_weighted_cycles:", total_weighted_cycles)
-                # print("DEBUG: core_power:", core_power)
-                # else:
-                #     proc_info.set_power(0)
+            core_power = [
+                core_power[skt] - idle_power[skt] for skt in self.topology.get_sockets()
+            ]
+
+        for key, proc_info in pid_dict.items():
+            proc_info.set_power(
+                self._get_pid_power(proc_info, total_weighted_cycles, core_power)
+            )
+            if key not in idle_keys:
                 proc_info.compute_cpu_usage_millis(
                     float(total_execution_time), multiprocessing.cpu_count()
                 )
 
-        for key, data in self.idles.items():
-            proc_info = ProcessInfo(len(self.topology.get_sockets()))
-            proc_info.set_pid(data.pid)
-            proc_info.set_tgid(-1 * (1 + int(key.value)))
-            proc_info.set_comm(data.comm)
-            proc_info.set_cycles(data.cycles[read_selector])
-            proc_info.set_instruction_retired(data.instruction_retired[read_selector])
-            proc_info.set_cache_misses(data.cache_misses[read_selector])
-            proc_info.set_cache_refs(data.cache_refs[read_selector])
-            proc_info.set_time_ns(data.time_ns[read_selector])
-            add_proc = False
-
-            for multisocket_selector in range(
-                read_selector, total_slots_length, self.SELECTOR_DIM
-            ):
-                if data.ts[read_selector] + self.timeslice > tsmax:
-                    socket_info = SocketProcessItem()
-                    socket_info.set_weighted_cycles(
-                        data.weighted_cycles[multisocket_selector]
-                    )
-                    socket_info.set_ts(data.ts[read_selector])
-                    proc_info.set_socket_data(
-                        int(multisocket_selector / self.SELECTOR_DIM), socket_info
-                    )
-                    add_proc = True
-
-            # --- ADD THIS BLOCK ---
-            # Try to set container_id using cgroup_id
-            try:
-                cgroup_id = ProcTable.find_cgroup_id(data.pid, data.tgid)
-                if cgroup_id is not None:
-                    proc_info.set_cgroup_id(cgroup_id)
-                    proc_info.set_container_id(cgroup_id[0:12])
-            except Exception:
-                pass
-            # After: cgroup_id = ProcTable.find_cgroup_id_static(data.pid, data.tgid)
-            # print(f"DEBUG: PID {data.pid} TGID {data.tgid} cgroup_id: {cgroup_id}")
-            # --- END BLOCK ---
-
-            if add_proc:
-                pid_dict[-1 * (1 + int(key.value))] = proc_info
-                proc_info.set_power(
-                    self._get_pid_power(
-                        proc_info, total_weighted_cycles, core_power
-                    )
-                )
-                # print(f"DEBUG: PID {data.pid} power: {proc_info.get_power()}")  
+        self._set_domain_power(pid_dict, total_power["uncore"], total_power["dram"])
+
+        sampling_stats = None
+        if self.capture_mode == "sampling":
+            # each sample stands for a sampling period of one CPU. The share
+            # p of a process estimated from n samples is off by at most
+            # 1.96 * sqrt(p * (1 - p) / n) <= 0.98 / sqrt(n) (95%)
+            samples = int(round(total_execution_time * self.sampling_rate_hz / 1000.0))
+            sampling_stats = (samples, 0.98 / samples ** 0.5 if samples > 0 else 1.0)
 
         return BpfSample(
             tsmax,
@@ -548,6 +923,15 @@ class BpfCollector:
             total_power,
             pid_dict,
             self.topology.get_hyperthread_count(),
+            self.prog_stats.sample(),
+            multiplexing_ratio,
+            read_epoch,
+            overwritten_cpus,
+            self._read_error_counts(),
+            frequency_ratios,
+            idle_power,
+            idle_fractions,
+            sampling_stats,
         )
 
     # def _get_pid_power(self, pid, total_cycles, core_power):
@@ -563,13 +947,206 @@ class BpfCollector:
     #             )
     #     return pid_power
 
-    def _get_pid_power(self, pid, total_cycles, core_power):
-        pid_power = 0.0
-        for socket in self.topology.get_sockets():
-            tc = float(total_cycles[socket])
-            if tc > 0:
-                wc = float(pid.get_socket_data(socket).get_weighted_cycles())
-                pid_power += core_power[socket] * (wc / tc)
-        return pid_power
+    def _table_items(self, table):
+        # (key, value) of every entry of a table drained every window, read
+        # in batches into buffers reused from a window to the next. Tables
+        # the kernel cannot read in batches are iterated entry by entry
+        snapshot = self.snapshots.get(table.name)
+        if snapshot is None:
+            snapshot = self.snapshots[table.name] = snapshot_of(table)
+        items = snapshot.read()
+        if items is None:
+            return list(table.items())
+        return items
+
+    def _build_proc_info(self, key, pid, tgid, data, socket_cycles, read_selector):
+        proc_info = ProcessInfo(len(self.topology.get_sockets()))
+        proc_info.set_pid(pid)
+        proc_info.set_tgid(tgid)
+        proc_info.set_comm(data.comm)
+        self._set_counters(proc_info, data, read_selector)
+        proc_info.set_time_ns(data.time_ns[read_selector])
+        for socket, cycles in enumerate(socket_cycles):
+            socket_info = SocketProcessItem()
+            socket_info.set_weighted_cycles(cycles)
+            socket_info.set_ts(data.ts[read_selector])
+            proc_info.set_socket_data(socket, socket_info)
+
+        # container of the row, from its cgroup id or from /proc
+        try:
+            if key < -1 * self.num_cpus:
+                # cgroup rows
+                cgroup_id = self.cgroup_resolver.resolve(self._cgroup_key(key))
+            else:
+                cgroup_id = ProcTable.find_cgroup_id(data.pid, data.tgid)
+            if cgroup_id is not None:
+                proc_info.set_cgroup_id(cgroup_id)
+                proc_info.set_container_id(cgroup_id[0:12])
+        except Exception:
+            pass
+        return proc_info
+
+    def _read_foreign_cycles(self, read_selector, read_epoch):
+        # Return {(row kind, row id): {socket: weighted cycles}} of the
+        # slices the rows ran out of their home socket in read_epoch
+        foreign = {}
+        for key, value in self._table_items(self.bpf_foreign_cycles):
+            if key.index % self.SELECTOR_DIM != read_selector or value.epoch != read_epoch:
+                continue
+            sockets = foreign.setdefault((key.kind, key.row), {})
+            socket = key.index // self.SELECTOR_DIM
+            sockets[socket] = sockets.get(socket, 0) + value.cycles
+        return foreign
+
+    def _socket_cycles(self, values, read_selector, foreign=None):
+        # weighted cycles per socket of a row: the home socket cycles of
+        # each (per-CPU) value of the row, plus its foreign cycles
+        socket_cycles = [0] * len(self.topology.get_sockets())
+        for value in values:
+            if value.socket[read_selector] < len(socket_cycles):
+                socket_cycles[value.socket[read_selector]] += value.weighted_cycles[read_selector]
+        for socket, cycles in (foreign or {}).items():
+            if socket < len(socket_cycles):
+                socket_cycles[socket] += cycles
+        return socket_cycles
+
+    def _read_pid_rows(self, read_selector, read_epoch, foreign_cycles):
+        # Return (key, pid_status, weighted cycles per socket) for each
+        # thread, process or cgroup row.
+        # Process rows are keyed by tgid, cgroup rows (aggregates or the
+        # graveyard of the exited threads) by a negative key after the
+        # idles ones, see _cgroup_key
+        rows = []
+        if self.aggregates is None:
+            rows = [
+                (data.pid, data, self._socket_cycles(
+                    [data], read_selector, foreign_cycles.get((self.ROW_THREAD, data.pid))
+                ))
+                for _, data in self._thread_items()
+            ]
+            for cgroup_id, data, socket_cycles in self._read_aggregate_rows(
+                    self.graveyard, read_selector, read_epoch, foreign_cycles, self.ROW_GRAVE):
+                rows.append((self._cgroup_key(cgroup_id), data, socket_cycles))
+            return rows
+
+        for row_id, data, socket_cycles in self._read_aggregate_rows(
+                self.aggregates, read_selector, read_epoch):
+            if self.aggregation == "cgroup":
+                row_id = self._cgroup_key(row_id)
+            else:
+                data.pid = row_id
+                data.tgid = row_id
+            rows.append((row_id, data, socket_cycles))
+        return rows
+
+    def _thread_items(self):
+        if self.pids is not None:
+            return self._table_items(self.pids)
+        # the iterator writes the pid_status of each thread back to back
+        data = self.bpf_program.read_iter("dump_task_status")
+        rows = (self.idles.Leaf * (len(data) // ct.sizeof(self.idles.Leaf))).from_buffer_copy(data)
+        return [(row.pid, row) for row in rows]
+
+    def _read_aggregate_rows(self, table, read_selector, read_epoch, foreign_cycles=None, kind=None):
+        # Return (key, pid_status, weighted cycles per socket) for each row
+        # of a per-CPU table, summed over the CPUs that wrote it in read_epoch
+        rows = []
+        for key, values in self._table_items(table):
+            row = table.sLeaf()
+            newest_epoch = 0
+            written = []
+            for value in values:
+                newest_epoch = max([newest_epoch] + list(value.epoch))
+                if value.comm and not row.comm:
+                    row.pid = value.pid
+                    row.tgid = value.tgid
+                    row.comm = value.comm
+                if value.epoch[read_selector] != read_epoch:
+                    continue
+                row.epoch[read_selector] = read_epoch
+                row.time_ns[read_selector] += value.time_ns[read_selector]
+                row.ts[read_selector] = max(row.ts[read_selector], value.ts[read_selector])
+                row.weighted_cycles[read_selector] += value.weighted_cycles[read_selector]
+                written.append(value)
+                for index in range(len(row.counters)):
+                    row.counters[index][read_selector] += value.counters[index][read_selector]
+
+            # the row was not written for a whole ring: its process or
+            # cgroup is gone, or idle, and it holds no data to read
+            key = getattr(key, "value", key)
+            if newest_epoch + self.SELECTOR_DIM <= read_epoch:
+                try:
+                    del table[table.Key(key)]
+                except KeyError:
+                    pass
+                continue
+
+            foreign = foreign_cycles.get((kind, key)) if foreign_cycles else None
+            rows.append((key, row, self._socket_cycles(written, read_selector, foreign)))
+        return rows
+
+    def _reduce_slot(self, table, read_selector, slot_epochs, read_epoch, reducer):
+        # reduce the per-CPU values of a slot over the CPUs that wrote it in read_epoch
+        values = table[ct.c_int(read_selector)]
+        return reducer([0] + [
+            getattr(value, "value", value)
+            for value, epoch in zip(values, slot_epochs) if epoch == read_epoch
+        ])
+
+    def _read_frequency_ratios(self, read_selector, slot_epochs, read_epoch):
+        # cycles over reference cycles of the slices each CPU accounted in
+        # the window, that is its effective frequency over the nominal one
+        if self.bpf_freq_cycles is None:
+            return []
+        ratios = []
+        cycles = self.bpf_freq_cycles[ct.c_int(read_selector)]
+        ref_cycles = self.bpf_freq_ref_cycles[ct.c_int(read_selector)]
+        for cpu_cycles, cpu_ref_cycles, epoch in zip(cycles, ref_cycles, slot_epochs):
+            cpu_cycles = getattr(cpu_cycles, "value", cpu_cycles)
+            cpu_ref_cycles = getattr(cpu_ref_cycles, "value", cpu_ref_cycles)
+            if epoch != read_epoch or cpu_ref_cycles == 0:
+                ratios.append(None)
+            else:
+                ratios.append(float(cpu_cycles) / cpu_ref_cycles)
+        return ratios
+
+    def _read_idle_fractions(self, window_end):
+        # C-state residency of the CPUs of each socket over the window, that
+        # ends at its latest BPF event like the rest of the sample. The BPF
+        # side adds an idle interval when it ends, the interval still open
+        # is counted here up to the end of the window, so that a CPU is idle
+        # in each window it sleeps through. Whatever is read late shows up
+        # in the next window, the differences of the totals add up
+        if self.bpf_cstate_residency is None or window_end == 0:
+            return {}
+        residency = [0] * len(self.bpf_idle_entries[ct.c_int(0)])
+        for state in range(self.NUM_CSTATES):
+            for cpu, value in enumerate(self.bpf_cstate_residency[ct.c_int(state)]):
+                residency[cpu] += getattr(value, "value", value)
+        for cpu, entry in enumerate(self.bpf_idle_entries[ct.c_int(0)]):
+            if entry.ts != 0 and entry.ts < window_end:
+                residency[cpu] += window_end - entry.ts
+        previous, self.idle_residency = self.idle_residency, (window_end, residency)
+        if previous is None or window_end <= previous[0]:
+            return {}
+        window_ns = window_end - previous[0]
+        topology = self.topology.get_topology()
+        idle_ns = {skt: 0 for skt in self.topology.get_sockets()}
+        cpus = {skt: 0 for skt in self.topology.get_sockets()}
+        for cpu, core in topology.items():
+            cpus[core[3]] += 1
+        for cpu, (total, previous_total) in enumerate(zip(residency, previous[1])):
+            if cpu in topology:
+                idle_ns[topology[cpu][3]] += max(0, total - previous_total)
+        return {
+            skt: min(1.0, idle_ns[skt] / (cpus[skt] * window_ns)) if cpus[skt] else 0.0
+            for skt in self.topology.get_sockets()
+        }
 
- 
+    def _set_counters(self, proc_info, data, read_selector):
+        for index, event in enumerate(self.pmu_events):
+            value = data.counters[index][read_selector]
+            if event.field is not None:
+                getattr(proc_info, "set_" + event.field)(value)
+            elif event.name != "cycles_core":
+                proc_info.set_counter(event.name, value)
@@ -0,0 +1,139 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Run count and run time of our BPF programs as accounted by the kernel
+# (bpf_prog_info.run_cnt/run_time_ns). Accounting is enabled through
+# BPF_ENABLE_STATS (>= 5.8), that keeps it on as long as the fd is open,
+# or through the kernel.bpf_stats_enabled sysctl on older kernels.
+
+import ctypes as ct
+import os
+import platform
+
+SYS_BPF = {"x86_64": 321, "aarch64": 280}
+BPF_OBJ_GET_INFO_BY_FD = 15
+BPF_ENABLE_STATS = 32
+BPF_STATS_RUN_TIME = 0
+BPF_STATS_SYSCTL = "/proc/sys/kernel/bpf_stats_enabled"
+
+
+class BpfProgInfo(ct.Structure):
+    _fields_ = [
+        ("type", ct.c_uint),
+        ("id", ct.c_uint),
+        ("tag", ct.c_ubyte * 8),
+        ("jited_prog_len", ct.c_uint),
+        ("xlated_prog_len", ct.c_uint),
+        ("jited_prog_insns", ct.c_ulonglong),
+        ("xlated_prog_insns", ct.c_ulonglong),
+        ("load_time", ct.c_ulonglong),
+        ("created_by_uid", ct.c_uint),
+        ("nr_map_ids", ct.c_uint),
+        ("map_ids", ct.c_ulonglong),
+        ("name", ct.c_char * 16),
+        ("ifindex", ct.c_uint),
+        ("gpl_compatible", ct.c_uint),
+        ("netns_dev", ct.c_ulonglong),
+        ("netns_ino", ct.c_ulonglong),
+        ("nr_jited_ksyms", ct.c_uint),
+        ("nr_jited_func_lens", ct.c_uint),
+        ("jited_ksyms", ct.c_ulonglong),
+        ("jited_func_lens", ct.c_ulonglong),
+        ("btf_id", ct.c_uint),
+        ("func_info_rec_size", ct.c_uint),
+        ("func_info", ct.c_ulonglong),
+        ("nr_func_info", ct.c_uint),
+        ("nr_line_info", ct.c_uint),
+        ("line_info", ct.c_ulonglong),
+        ("jited_line_info", ct.c_ulonglong),
+        ("nr_jited_line_info", ct.c_uint),
+        ("line_info_rec_size", ct.c_uint),
+        ("jited_line_info_rec_size", ct.c_uint),
+        ("nr_prog_tags", ct.c_uint),
+        ("prog_tags", ct.c_ulonglong),
+        ("run_time_ns", ct.c_ulonglong),
+        ("run_cnt", ct.c_ulonglong),
+    ]
+
+
+class BpfInfoAttr(ct.Structure):
+    _fields_ = [
+        ("bpf_fd", ct.c_uint),
+        ("info_len", ct.c_uint),
+        ("info", ct.c_ulonglong),
+    ]
+
+
+class BpfEnableStatsAttr(ct.Structure):
+    _fields_ = [("type", ct.c_uint)]
+
+
+_libc = ct.CDLL(None, use_errno=True)
+
+
+def _bpf(cmd, attr):
+    return _libc.syscall(SYS_BPF[platform.machine()], cmd, ct.byref(attr), ct.sizeof(attr))
+
+
+class BpfProgStats:
+
+    def __init__(self):
+        self.programs = {}
+        self.last = {}
+        self.stats_fd = _bpf(BPF_ENABLE_STATS, BpfEnableStatsAttr(BPF_STATS_RUN_TIME))
+        self.enabled = self.stats_fd >= 0
+        if not self.enabled:
+            try:
+                with open(BPF_STATS_SYSCTL, "w") as f:
+                    f.write("1")
+                self.enabled = True
+            except IOError:
+                print("BPF program run time not available")
+
+    def add(self, name, prog_fd):
+        self.programs[name] = prog_fd
+
+    def remove(self, name):
+        self.programs.pop(name, None)
+        self.last.pop(name, None)
+
+    def read(self, prog_fd):
+        info = BpfProgInfo()
+        attr = BpfInfoAttr(prog_fd, ct.sizeof(info), ct.addressof(info))
+        if _bpf(BPF_OBJ_GET_INFO_BY_FD, attr) < 0:
+            return 0, 0
+        return info.run_cnt, info.run_time_ns
+
+    def sample(self):
+        """Return {name: (run count, run time ns)} since the previous sample"""
+        stats = {}
+        if not self.enabled:
+            return stats
+        for name, prog_fd in self.programs.items():
+            run_cnt, run_time_ns = self.read(prog_fd)
+            last_cnt, last_time_ns = self.last.get(name, (0, 0))
+            stats[name] = (run_cnt - last_cnt, run_time_ns - last_time_ns)
+            self.last[name] = (run_cnt, run_time_ns)
+        return stats
+
+    def close(self):
+        if self.stats_fd >= 0:
+            os.close(self.stats_fd)
+            self.stats_fd = -1
@@ -0,0 +1,253 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Counter backend without BPF programs (counter_backend: cgroup_perf in
+# config.yaml). The PMU events of each container are counted by cgroup
+# perf events, one per container, event and CPU, so that the kernel does
+# the bookkeeping at each context switch, and a system wide event per CPU
+# counts the whole host. Each window the counts are read and the power is
+# attributed per container as BpfCollector does per thread. Nothing is
+# known of the sibling hyperthreads here: cycles are not weighted.
+
+from .bpf_collector import BpfSample
+from .cgroup_resolver import CgroupResolver
+from .libbpf_loader import PerfType, PerfSWConfig
+from .libbpf_loader import perf_event_open
+from .libbpf_loader import PERF_FLAG_PID_CGROUP
+from .libbpf_loader import PERF_FORMAT_TOTAL_TIME_ENABLED, PERF_FORMAT_TOTAL_TIME_RUNNING
+from .pmu_events import PmuEventSet, PmuEvent, DEFAULT_EVENTS
+from .power_attribution import PowerAttribution
+from .process_info import ProcessInfo, SocketProcessItem
+import multiprocessing
+import os
+import struct
+import time
+
+READ_FORMAT = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING
+# new containers are found every RESCAN_WINDOWS windows
+RESCAN_WINDOWS = 10
+HOST_KEY = 0
+
+
+class PerfCounterGroup:
+    """Counts of some events on every CPU for a cgroup, or the whole host"""
+
+    def __init__(self, events, cpus, cgroup_fd=-1):
+        self.fds = []
+        self.last = {}
+        flags = PERF_FLAG_PID_CGROUP if cgroup_fd >= 0 else 0
+        try:
+            for event in events:
+                self.fds.append([
+                    perf_event_open(event.ev_type, event.ev_config, cpu, pid=cgroup_fd,
+                                    read_format=READ_FORMAT, flags=flags)
+                    for cpu in range(cpus)
+                ])
+        except OSError:
+            self.close()
+            raise
+
+    def read(self):
+        """Return the count of each event on each CPU since the previous read,
+        scaled up when the events were multiplexed"""
+        counts = []
+        for index, fds in enumerate(self.fds):
+            event_counts = []
+            for cpu, fd in enumerate(fds):
+                value, enabled, running = struct.unpack("QQQ", os.read(fd, 24))
+                last_value, last_enabled, last_running = self.last.get((index, cpu), (0, 0, 0))
+                self.last[(index, cpu)] = (value, enabled, running)
+                delta = value - last_value
+                delta_running = running - last_running
+                if delta_running > 0:
+                    delta = delta * float(enabled - last_enabled) / delta_running
+                event_counts.append(delta)
+            counts.append(event_counts)
+        return counts
+
+    def close(self):
+        for fds in self.fds:
+            for fd in fds:
+                os.close(fd)
+        self.fds = []
+
+
+class CgroupPerfCollector(PowerAttribution):
+
+    def __init__(self, topology, pmu_events=DEFAULT_EVENTS):
+        self.topology = topology
+        self.num_cpus = multiprocessing.cpu_count()
+        self.pmu_events = PmuEventSet(pmu_events)
+        # task-clock gives the CPU time of each container
+        self.events = list(self.pmu_events) + [
+            PmuEvent("task_clock", PerfType.SOFTWARE, PerfSWConfig.TASK_CLOCK)
+        ]
+        self.cycles_index = self.pmu_events.index("cycles_thread")
+        self.cgroup_resolver = CgroupResolver()
+        self.host = PerfCounterGroup(self.events, self.num_cpus)
+        # context switches of the host, that size the dynamic windows
+        self.switches = PerfCounterGroup([
+            PmuEvent("context_switches", PerfType.SOFTWARE, PerfSWConfig.CONTEXT_SWITCHES)
+        ], self.num_cpus)
+        self.containers = {}
+        self.cgroup_fds = {}
+        # pid_dict key of each container, from its cgroup id
+        self.cgroup_keys = {}
+        self.windows = 0
+        self.timeslice = 1000000000
+        self.timed_capture = False
+        self.last_ts = time.monotonic_ns()
+        self.epoch = 1
+
+    def _rescan_containers(self):
+        paths = self.cgroup_resolver.containers()
+        for container_id in list(self.containers):
+            if container_id not in paths:
+                self.containers.pop(container_id).close()
+                os.close(self.cgroup_fds.pop(container_id))
+                self.cgroup_keys.pop(container_id)
+        for container_id, path in paths.items():
+            cgroup_id = self.cgroup_resolver.cgroup_id(container_id)
+            if container_id in self.containers or cgroup_id is None:
+                continue
+            try:
+                cgroup_fd = os.open(path, os.O_RDONLY)
+            except OSError:
+                continue
+            try:
+                self.containers[container_id] = PerfCounterGroup(self.events, self.num_cpus, cgroup_fd)
+                self.cgroup_fds[container_id] = cgroup_fd
+                self.cgroup_keys[container_id] = self._cgroup_key(cgroup_id)
+            except OSError as e:
+                print("Cannot count the events of container %s: %s" % (container_id[0:12], e))
+                os.close(cgroup_fd)
+
+    def start_capture(self, timeslice):
+        self.timeslice = timeslice
+        self.timed_capture = False
+        self._rescan_containers()
+
+    def start_timed_capture(self, count=0, frequency=0):
+        self.timeslice = int((1 / float(frequency or 49)) * 1000000000)
+        self.timed_capture = True
+        self._rescan_containers()
+
+    def stop_capture(self):
+        for container_id in list(self.containers):
+            self.containers.pop(container_id).close()
+            os.close(self.cgroup_fds.pop(container_id))
+        self.cgroup_keys = {}
+        self.host.close()
+        self.switches.close()
+
+    def get_new_sample(self, sample_controller, rapl_monitor):
+        sample = self._get_new_sample(rapl_monitor)
+        if not self.timed_capture:
+            sample_controller.compute_sleep_time(sample.get_sched_switch_count())
+            self.timeslice = sample_controller.get_timeslice()
+        return sample
+
+    def _socket_totals(self, event_counts):
+        totals = [0] * len(self.topology.get_sockets())
+        topology = self.topology.get_topology()
+        for cpu, count in enumerate(event_counts):
+            if cpu in topology and topology[cpu][3] < len(totals):
+                totals[topology[cpu][3]] += count
+        return totals
+
+    def _build_proc_info(self, key, comm, counts, ts):
+        proc_info = ProcessInfo(len(self.topology.get_sockets()))
+        proc_info.set_pid(key)
+        proc_info.set_tgid(key)
+        proc_info.set_comm(comm)
+        for index, event in enumerate(self.pmu_events):
+            value = int(sum(counts[index]))
+            if event.field is not None:
+                getattr(proc_info, "set_" + event.field)(value)
+            else:
+                proc_info.set_counter(event.name, value)
+        proc_info.set_time_ns(int(sum(counts[-1])))
+        for socket, cycles in enumerate(self._socket_totals(counts[self.cycles_index])):
+            socket_info = SocketProcessItem()
+            socket_info.set_weighted_cycles(int(cycles))
+            socket_info.set_ts(ts)
+            proc_info.set_socket_data(socket, socket_info)
+        return proc_info
+
+    def _get_new_sample(self, rapl_monitor):
+        self.windows += 1
+        if self.windows % RESCAN_WINDOWS == 0:
+            self._rescan_containers()
+
+        rapl_measurement = rapl_monitor.get_rapl_measure()
+        ts = time.monotonic_ns()
+        window_ns = ts - self.last_ts
+        self.last_ts = ts
+
+        host_counts = self.host.read()
+        sched_switch_count = int(sum(self.switches.read()[0]))
+        # what is left to the host once the containers are taken out
+        rest_counts = [list(event_counts) for event_counts in host_counts]
+        pid_dict = {}
+        for container_id, group in self.containers.items():
+            counts = group.read()
+            for index, event_counts in enumerate(counts):
+                for cpu, count in enumerate(event_counts):
+                    rest_counts[index][cpu] = max(rest_counts[index][cpu] - count, 0)
+            proc_info = self._build_proc_info(
+                self.cgroup_keys[container_id], container_id[0:12], counts, ts
+            )
+            proc_info.set_cgroup_id(container_id)
+            proc_info.set_container_id(container_id[0:12])
+            pid_dict[proc_info.get_pid()] = proc_info
+        pid_dict[HOST_KEY] = self._build_proc_info(HOST_KEY, "host", rest_counts, ts)
+
+        total_weighted_cycles = self._socket_totals(host_counts[self.cycles_index])
+        sockets = self.topology.get_sockets()
+        package_power = [rapl_measurement["package"][skt].power_milliw() for skt in sockets]
+        core_power = [rapl_measurement["core"][skt].power_milliw() for skt in sockets]
+        dram_power = [rapl_measurement["dram"][skt].power_milliw() for skt in sockets]
+        uncore_power = [max(package_power[i] - core_power[i], 0.0) for i in range(len(core_power))]
+        total_power = {
+            "package": sum(package_power),
+            "core": sum(core_power),
+            "uncore": sum(uncore_power),
+            "dram": sum(dram_power),
+        }
+
+        # every CPU for the whole window, like the idle rows of the BPF engines
+        total_execution_time = float(window_ns) * self.num_cpus / 1000000
+        for proc_info in pid_dict.values():
+            proc_info.set_power(self._get_pid_power(proc_info, total_weighted_cycles, core_power))
+            proc_info.compute_cpu_usage_millis(total_execution_time, self.num_cpus)
+        self._set_domain_power(pid_dict, total_power["uncore"], total_power["dram"])
+
+        epoch = self.epoch
+        self.epoch += 1
+        return BpfSample(
+            ts,
+            total_execution_time,
+            sched_switch_count,
+            self.timeslice,
+            total_power,
+            pid_dict,
+            self.topology.get_hyperthread_count(),
+            epoch=epoch,
+        )
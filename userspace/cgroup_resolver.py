@@ -0,0 +1,87 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Map the cgroup ids returned by bpf_get_current_cgroup_id() to Docker
+# container ids. On the unified (v2) hierarchy the id of a cgroup is the
+# inode number of its directory, so we walk the hierarchy once and walk it
+# again only when an unknown id shows up.
+
+import os
+import string
+
+CGROUP_ROOTS = ["/host/sys/fs/cgroup", "/sys/fs/cgroup"]
+
+
+class CgroupResolver:
+
+    def __init__(self, roots=CGROUP_ROOTS):
+        self.roots = roots
+        self.container_ids = {}
+        self.container_paths = {}
+        self.container_cgroups = {}
+
+    def _container_id(self, name):
+        # systemd Docker names the cgroup docker-<id>.scope
+        if name.startswith("docker-") and name.endswith(".scope"):
+            name = name[len("docker-"):-len(".scope")]
+        if len(name) == 64 and all(c in string.hexdigits for c in name):
+            return name
+        return None
+
+    def _scan(self):
+        for root in self.roots:
+            if not os.path.isdir(root):
+                continue
+            for dirpath, dirnames, filenames in os.walk(root):
+                for dirname in dirnames:
+                    container_id = self._container_id(dirname)
+                    if container_id is None:
+                        continue
+                    path = os.path.join(dirpath, dirname)
+                    try:
+                        inode = os.stat(path).st_ino
+                    except OSError:
+                        continue
+                    self.container_ids[inode] = container_id
+                    # on v1 hierarchies perf events need the perf_event one
+                    if container_id not in self.container_paths or "/perf_event/" in path:
+                        self.container_paths[container_id] = path
+                        self.container_cgroups[container_id] = inode
+            return
+
+    def containers(self):
+        """Rescan the hierarchy, return {container id: cgroup directory}"""
+        self.container_paths = {}
+        self.container_cgroups = {}
+        self._scan()
+        return dict(self.container_paths)
+
+    def cgroup_id(self, container_id):
+        """Return the cgroup id of the directory of a container found by
+        containers(), None if it is not known"""
+        return self.container_cgroups.get(container_id)
+
+    def resolve(self, cgroup_id):
+        """Return the container id of cgroup_id, None if not a container"""
+        if cgroup_id not in self.container_ids:
+            self._scan()
+            # remember the cgroups that are not containers as well
+            self.container_ids.setdefault(cgroup_id, None)
+        return self.container_ids[cgroup_id]
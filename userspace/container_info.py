@@ -40,7 +40,10 @@ class ContainerInfo:
         self.cache_misses = 0
         self.cache_refs = 0
         self.time_ns = 0
+        self.counters = {}
         self.power = 0.0
+        self.uncore_power = 0.0
+        self.dram_power = 0.0
         self.cpu_usage = 0.0
         self.pid_set = set()
         self.timestamp = 0
@@ -100,6 +103,12 @@ class ContainerInfo:
     def add_power(self, new_power):
         self.power = self.power + float(new_power)
 
+    def add_uncore_power(self, new_power):
+        self.uncore_power = self.uncore_power + float(new_power)
+
+    def add_dram_power(self, new_power):
+        self.dram_power = self.dram_power + float(new_power)
+
     def add_instructions(self, new_instructions):
         self.instruction_retired = self.instruction_retired + new_instructions
 
@@ -109,6 +118,10 @@ class ContainerInfo:
     def add_cache_refs(self, new_cache_refs):
         self.cache_refs = self.cache_refs + new_cache_refs
 
+    def add_counters(self, new_counters):
+        for name, value in new_counters.items():
+            self.counters[name] = self.counters.get(name, 0) + value
+
     def add_cpu_usage(self, cpu_usage):
         self.cpu_usage = self.cpu_usage + float(cpu_usage)
         self.add_weighted_cpu_usage(cpu_usage)
@@ -273,6 +286,9 @@ class ContainerInfo:
     def get_cache_misses(self):
         return self.cache_misses
 
+    def get_counters(self):
+        return self.counters
+
     def get_cache_refs(self):
         return self.cache_refs
 
@@ -282,6 +298,12 @@ class ContainerInfo:
     def get_power(self):
         return self.power
 
+    def get_uncore_power(self):
+        return self.uncore_power
+
+    def get_dram_power(self):
+        return self.dram_power
+
     def get_cpu_usage(self):
         return self.cpu_usage
 
@@ -422,7 +444,10 @@ class ContainerInfo:
                 'cache_misses': self.cache_misses,
                 'cache_refs': self.cache_refs,
                 'time_ns': self.time_ns,
+                'counters': self.counters,
                 'power': self.power,
+                'uncore_power': self.uncore_power,
+                'dram_power': self.dram_power,
                 'cpu_usage': self.cpu_usage,
                 'pid_set': list(self.pid_set),
                 # Memory
@@ -472,6 +497,14 @@ class ContainerInfo:
             "TOTAL POWER (mW): " + '{:.3f}'.format(self.power)
         )
 
+        if self.uncore_power > 0 or self.dram_power > 0:
+            fmt = '{:<20} {:<28} {:<28}'
+            output_line = output_line + "\n" + fmt.format(
+                "\tPower (mW):",
+                "UNCORE: " + '{:.3f}'.format(self.uncore_power),
+                "DRAM: " + '{:.3f}'.format(self.dram_power)
+            )
+
         if self.mem_RSS > 0:
             fmt = '{:<20} {:<23} {:<23} {:<23}'
             output_line = output_line + "\n" + fmt.format(
@@ -18,16 +18,26 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 """
 
-from bcc import BPF
+try:
+    from bcc import BPF
+except ImportError:
+    # only needed when the disk monitor is enabled
+    BPF = None
 import os
 import json
+from .map_sizes import MapSizes, FailedInserts
+from . import libbpf_loader
 
 class DiskCollector:
-    def __init__(self, monitor_disk, monitor_file):
+    def __init__(self, monitor_disk, monitor_file, map_sizes="", bpf_loader="auto", object_cache=None):
+        self.bpf_loader = bpf_loader
+        self.object_cache = object_cache
         self.monitor_file = monitor_file
         self.monitor_disk = monitor_disk
         self.disk_sample = None
         self.disk_monitor = None
+        self.map_sizes = MapSizes(map_sizes)
+        self.failed_inserts = None
         self.proc_path = "/host/proc"
         self.proc_files = [f for f in os.listdir(self.proc_path) if os.path.isfile(os.path.join(self.proc_path, f))]
         self.number_files_to_keep = 10
@@ -36,13 +46,26 @@ class DiskCollector:
         bpf_code_path = os.path.dirname(os.path.abspath(__file__)) \
                         + "/../bpf/vfs_monitor.c"
         #DNAME_INLINE_LEN = 32  # linux/dcache.h
-        self.disk_monitor = BPF(src_file=bpf_code_path, cflags=["-DNAME_INLINE_LEN=%d" % 32])
+        cflags = self.map_sizes.get_cflags("vfs_monitor")
+        # the libbpf build attaches its kprobe__ and kretprobe__ programs itself
+        self.disk_monitor, self.bpf_loader = libbpf_loader.load_or_compile(
+            bpf_code_path, cflags, self.bpf_loader, self.object_cache,
+            (lambda: BPF(src_file=bpf_code_path, cflags=["-DNAME_INLINE_LEN=%d" % 32] + cflags)) if BPF else None)
+        self.failed_inserts = FailedInserts(self.disk_monitor, "vfs_monitor")
+        if self.bpf_loader == "core":
+            return
         self.disk_monitor.attach_kprobe(event="vfs_read", fn_name="trace_rw_entry")
         self.disk_monitor.attach_kretprobe(event="vfs_read", fn_name="trace_read_return")
 
         self.disk_monitor.attach_kprobe(event="vfs_write", fn_name="trace_rw_entry")
         self.disk_monitor.attach_kretprobe(event="vfs_write", fn_name="trace_write_return")
 
+    def get_bpf_loader(self):
+        return self.bpf_loader
+
+    def get_failed_inserts(self):
+        return self.failed_inserts.read() if self.failed_inserts else {}
+
     def _include_file_path(self, file_name, file_parent, file_parent2):
         file_name = file_name.decode("utf-8")
         file_parent = file_parent.decode("utf-8")
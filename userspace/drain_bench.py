@@ -0,0 +1,152 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Syscalls and wall time to drain a pids-like map once per window, entry
+# by entry as items() does (get_next_key + lookup for each entry) and in
+# batches with map_batch.MapSnapshot. The map is a hash with the layout
+# of pid_status with the default PMU events, filled with the given number
+# of rows. Needs the rights to create BPF maps.
+#
+# Usage: python3 -m userspace.drain_bench [rows,rows,...] [windows]
+
+import ctypes as ct
+import os
+import sys
+import time
+
+from .map_batch import MapSnapshot, _bpf
+
+BPF_MAP_CREATE = 0
+BPF_MAP_LOOKUP_ELEM = 1
+BPF_MAP_UPDATE_ELEM = 2
+BPF_MAP_GET_NEXT_KEY = 4
+BPF_MAP_TYPE_HASH = 1
+
+SELECTOR_DIM = 4
+NUM_COUNTERS = 4
+
+
+class PidStatus(ct.Structure):
+    _fields_ = [
+        ("pid", ct.c_int),
+        ("tgid", ct.c_int),
+        ("comm", ct.c_char * 16),
+        ("weighted_cycles", ct.c_ulonglong * SELECTOR_DIM),
+        ("socket", ct.c_uint * SELECTOR_DIM),
+        ("counters", (ct.c_ulonglong * SELECTOR_DIM) * NUM_COUNTERS),
+        ("time_ns", ct.c_ulonglong * SELECTOR_DIM),
+        ("epoch", ct.c_uint * SELECTOR_DIM),
+        ("ts", ct.c_ulonglong * SELECTOR_DIM),
+    ]
+
+
+class MapCreateAttr(ct.Structure):
+    _fields_ = [
+        ("map_type", ct.c_uint),
+        ("key_size", ct.c_uint),
+        ("value_size", ct.c_uint),
+        ("max_entries", ct.c_uint),
+        ("map_flags", ct.c_uint),
+    ]
+
+
+class MapElemAttr(ct.Structure):
+    _fields_ = [
+        ("map_fd", ct.c_uint),
+        ("pad", ct.c_uint),
+        ("key", ct.c_ulonglong),
+        ("value", ct.c_ulonglong),
+        ("flags", ct.c_ulonglong),
+    ]
+
+
+def create_map(rows):
+    map_fd = _bpf(BPF_MAP_CREATE, MapCreateAttr(
+        BPF_MAP_TYPE_HASH, ct.sizeof(ct.c_int), ct.sizeof(PidStatus), rows, 0
+    ))
+    if map_fd < 0:
+        raise OSError(ct.get_errno(), "cannot create a BPF map")
+    for pid in range(1, rows + 1):
+        key = ct.c_int(pid)
+        value = PidStatus(pid=pid, tgid=pid, comm=b"bench")
+        _bpf(BPF_MAP_UPDATE_ELEM, MapElemAttr(map_fd, 0, ct.addressof(key), ct.addressof(value), 0))
+    return map_fd
+
+
+def drain_items(map_fd):
+    """Read every entry like items(), return (entries, syscalls)"""
+    rows = []
+    syscalls = 0
+    key = ct.c_int()
+    next_key = ct.c_int()
+    first = True
+    while True:
+        syscalls += 1
+        if _bpf(BPF_MAP_GET_NEXT_KEY, MapElemAttr(
+                map_fd, 0, 0 if first else ct.addressof(key), ct.addressof(next_key), 0)) < 0:
+            break
+        first = False
+        key.value = next_key.value
+        value = PidStatus()
+        syscalls += 1
+        if _bpf(BPF_MAP_LOOKUP_ELEM, MapElemAttr(
+                map_fd, 0, ct.addressof(key), ct.addressof(value), 0)) == 0:
+            rows.append((key.value, value))
+    return rows, syscalls
+
+
+def drain_batch(snapshot):
+    rows = snapshot.read()
+    return rows, snapshot.syscalls
+
+
+def bench(rows, windows):
+    map_fd = create_map(rows)
+    try:
+        snapshot = MapSnapshot(map_fd, ct.c_int, PidStatus, rows)
+        results = []
+        for name, drain in (("items", lambda: drain_items(map_fd)), ("batch", lambda: drain_batch(snapshot))):
+            elapsed = 0.0
+            syscalls = 0
+            for _ in range(windows):
+                start = time.perf_counter()
+                entries, calls = drain()
+                elapsed += time.perf_counter() - start
+                syscalls += calls
+                if len(entries) != rows:
+                    raise RuntimeError("%s read %d rows out of %d" % (name, len(entries), rows))
+            results.append((name, syscalls / windows, elapsed / windows * 1000))
+        return results
+    finally:
+        os.close(map_fd)
+
+
+def main(argv):
+    sizes = [int(n) for n in (argv[1] if len(argv) > 1 else "1000,10000,30000").split(",")]
+    windows = int(argv[2]) if len(argv) > 2 else 5
+    print("%8s %6s %12s %12s" % ("rows", "drain", "syscalls", "ms/window"))
+    for rows in sizes:
+        for name, syscalls, ms in bench(rows, windows):
+            print("%8d %6s %12.0f %12.2f" % (rows, name, syscalls, ms))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
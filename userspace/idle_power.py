@@ -0,0 +1,76 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Split the core power of each socket into a static part, drawn even when
+# all its CPUs are idle, and the dynamic part that the work running on it
+# adds. The busy fraction of a socket comes from the C-state residency
+# traced by bpf_monitor.c, and the core power is fitted online as
+# static + slope * busy with exponentially decayed least squares: the
+# static power is the intercept of the fit.
+
+MIN_WINDOWS = 10
+# the busy fraction must have moved for the intercept to mean anything
+MIN_BUSY_VARIANCE = 1e-4
+
+
+class SocketFit:
+    def __init__(self, decay):
+        self.decay = decay
+        self.windows = 0
+        self.weight = 0.0
+        self.sum_x = 0.0
+        self.sum_y = 0.0
+        self.sum_xx = 0.0
+        self.sum_xy = 0.0
+
+    def add(self, busy, power):
+        self.windows += 1
+        self.weight = self.decay * self.weight + 1.0
+        self.sum_x = self.decay * self.sum_x + busy
+        self.sum_y = self.decay * self.sum_y + power
+        self.sum_xx = self.decay * self.sum_xx + busy * busy
+        self.sum_xy = self.decay * self.sum_xy + busy * power
+
+    def intercept(self):
+        """Return the power at busy fraction 0, None until it can be told"""
+        if self.windows < MIN_WINDOWS:
+            return None
+        mean_x = self.sum_x / self.weight
+        mean_y = self.sum_y / self.weight
+        var_x = self.sum_xx / self.weight - mean_x * mean_x
+        if var_x < MIN_BUSY_VARIANCE:
+            return None
+        slope = (self.sum_xy / self.weight - mean_x * mean_y) / var_x
+        return mean_y - slope * mean_x
+
+
+class IdlePowerModel:
+
+    def __init__(self, sockets, decay=0.98):
+        self.fits = {socket: SocketFit(decay) for socket in sockets}
+
+    def update(self, socket, busy, power):
+        """Add a window and return the static power of the socket in it"""
+        fit = self.fits[socket]
+        fit.add(busy, power)
+        static_power = fit.intercept()
+        if static_power is None:
+            return 0.0
+        return min(max(static_power, 0.0), power)
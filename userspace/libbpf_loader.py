@@ -0,0 +1,555 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Load the objects produced by bpf_build.py through libbpf (>= 1.0).
+# LibbpfProgram exposes the subset of the bcc.BPF interface used by the
+# collectors, so the rest of the code does not care how the program was loaded.
+
+import ctypes as ct
+import ctypes.util
+import json
+import os
+import platform
+
+from . import bpf_build
+
+
+class PerfType:
+    HARDWARE = 0
+    SOFTWARE = 1
+    HW_CACHE = 3
+    RAW = 4
+
+
+class PerfHWConfig:
+    CPU_CYCLES = 0
+    INSTRUCTIONS = 1
+    CACHE_REFERENCES = 2
+    CACHE_MISSES = 3
+    BRANCH_INSTRUCTIONS = 4
+    BRANCH_MISSES = 5
+    BUS_CYCLES = 6
+    STALLED_CYCLES_FRONTEND = 7
+    STALLED_CYCLES_BACKEND = 8
+    REF_CPU_CYCLES = 9
+
+
+class PerfSWConfig:
+    CPU_CLOCK = 0
+    TASK_CLOCK = 1
+    PAGE_FAULTS = 2
+    CONTEXT_SWITCHES = 3
+    CPU_MIGRATIONS = 4
+
+
+class PerfEventAttr(ct.Structure):
+    _fields_ = [
+        ("type", ct.c_uint),
+        ("size", ct.c_uint),
+        ("config", ct.c_ulonglong),
+        ("sample_period", ct.c_ulonglong),
+        ("sample_type", ct.c_ulonglong),
+        ("read_format", ct.c_ulonglong),
+        ("flags", ct.c_ulonglong),
+        ("wakeup_events", ct.c_uint),
+        ("bp_type", ct.c_uint),
+        ("config1", ct.c_ulonglong),
+        ("config2", ct.c_ulonglong),
+        ("reserved", ct.c_ubyte * 64),
+    ]
+
+
+PERF_ATTR_FLAG_DISABLED = 1 << 0
+PERF_ATTR_FLAG_FREQ = 1 << 10
+PERF_FLAG_PID_CGROUP = 1 << 2
+PERF_FLAG_FD_CLOEXEC = 1 << 3
+PERF_FORMAT_TOTAL_TIME_ENABLED = 1 << 0
+PERF_FORMAT_TOTAL_TIME_RUNNING = 1 << 1
+PERF_EVENT_IOC_ENABLE = 0x2400
+
+SYS_PERF_EVENT_OPEN = {"x86_64": 298, "aarch64": 241}
+
+BPF_ANY = 0
+BPF_NOEXIST = 1
+
+PERF_SAMPLE_CB = ct.CFUNCTYPE(None, ct.c_void_p, ct.c_int, ct.c_void_p, ct.c_uint)
+PERF_LOST_CB = ct.CFUNCTYPE(None, ct.c_void_p, ct.c_int, ct.c_ulonglong)
+
+_libbpf = None
+_libc = ct.CDLL(None, use_errno=True)
+
+
+def libbpf():
+    global _libbpf
+    if _libbpf is None:
+        path = ctypes.util.find_library("bpf")
+        lib = ct.CDLL(path or "libbpf.so.1", use_errno=True)
+        for name in ("bpf_object__open_file", "bpf_object__find_map_by_name",
+                     "bpf_object__find_program_by_name", "bpf_object__next_map",
+                     "bpf_map__name", "bpf_program__attach_tracepoint",
+                     "bpf_program__attach_raw_tracepoint", "bpf_program__attach_trace",
+                     "bpf_program__attach_perf_event", "bpf_program__attach_iter",
+                     "bpf_program__attach",
+                     "perf_buffer__new"):
+            getattr(lib, name).restype = ct.c_void_p
+        lib.bpf_map__name.restype = ct.c_char_p
+        for name in ("bpf_object__find_map_by_name", "bpf_object__find_program_by_name"):
+            getattr(lib, name).argtypes = [ct.c_void_p, ct.c_char_p]
+        lib.bpf_object__open_file.argtypes = [ct.c_char_p, ct.c_void_p]
+        lib.bpf_object__next_map.argtypes = [ct.c_void_p, ct.c_void_p]
+        lib.bpf_object__load.argtypes = [ct.c_void_p]
+        lib.bpf_object__close.argtypes = [ct.c_void_p]
+        lib.bpf_map__name.argtypes = [ct.c_void_p]
+        lib.bpf_map__fd.argtypes = [ct.c_void_p]
+        lib.bpf_map__set_max_entries.argtypes = [ct.c_void_p, ct.c_uint]
+        lib.bpf_map__set_initial_value.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_size_t]
+        lib.bpf_map__max_entries.argtypes = [ct.c_void_p]
+        lib.bpf_program__attach_tracepoint.argtypes = [ct.c_void_p, ct.c_char_p, ct.c_char_p]
+        lib.bpf_program__attach_raw_tracepoint.argtypes = [ct.c_void_p, ct.c_char_p]
+        lib.bpf_program__attach_trace.argtypes = [ct.c_void_p]
+        lib.bpf_program__fd.argtypes = [ct.c_void_p]
+        lib.bpf_program__attach_perf_event.argtypes = [ct.c_void_p, ct.c_int]
+        lib.bpf_program__attach_iter.argtypes = [ct.c_void_p, ct.c_void_p]
+        lib.bpf_program__attach.argtypes = [ct.c_void_p]
+        lib.bpf_link__fd.argtypes = [ct.c_void_p]
+        lib.bpf_iter_create.argtypes = [ct.c_int]
+        lib.bpf_link__destroy.argtypes = [ct.c_void_p]
+        lib.libbpf_get_error.argtypes = [ct.c_void_p]
+        lib.libbpf_get_error.restype = ct.c_long
+        lib.bpf_map_lookup_elem.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p]
+        lib.bpf_map_update_elem.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_ulonglong]
+        lib.bpf_map_delete_elem.argtypes = [ct.c_int, ct.c_void_p]
+        lib.bpf_map_get_next_key.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p]
+        lib.perf_buffer__new.argtypes = [ct.c_int, ct.c_size_t, PERF_SAMPLE_CB,
+                                         PERF_LOST_CB, ct.c_void_p, ct.c_void_p]
+        lib.perf_buffer__poll.argtypes = [ct.c_void_p, ct.c_int]
+        lib.perf_buffer__free.argtypes = [ct.c_void_p]
+        _libbpf = lib
+    return _libbpf
+
+
+def perf_event_open(ev_type, ev_config, cpu, pid=-1, sample_period=0, sample_freq=0,
+                    read_format=0, flags=0):
+    # with PERF_FLAG_PID_CGROUP in flags pid is the fd of a cgroup directory
+    attr = PerfEventAttr()
+    attr.type = ev_type
+    attr.size = ct.sizeof(PerfEventAttr)
+    attr.config = ev_config
+    attr.read_format = read_format
+    if sample_freq > 0:
+        attr.sample_period = sample_freq
+        attr.flags |= PERF_ATTR_FLAG_FREQ
+    else:
+        attr.sample_period = sample_period
+    fd = _libc.syscall(SYS_PERF_EVENT_OPEN[platform.machine()], ct.byref(attr),
+                       pid, cpu, -1, PERF_FLAG_FD_CLOEXEC | flags)
+    if fd < 0:
+        raise OSError(ct.get_errno(), "perf_event_open failed for type %d config %d on cpu %d"
+                      % (ev_type, ev_config, cpu))
+    return fd
+
+
+def _ctype(desc):
+    """Build the ctypes type described by bpf_build._ctype_desc"""
+    if isinstance(desc, str):
+        return getattr(ct, desc)
+    fields = []
+    for name, field_desc, dims in desc["fields"]:
+        field_type = _ctype(field_desc)
+        for dim in reversed(dims):
+            field_type = field_type * dim
+        fields.append((name, field_type))
+    return type(str(desc["struct"]), (ct.Structure,), {"_fields_": fields})
+
+
+def _cpus(path):
+    cpus = []
+    with open(path) as f:
+        for chunk in f.read().strip().split(","):
+            first, _, last = chunk.partition("-")
+            cpus.extend(range(int(first), int(last or first) + 1))
+    return cpus
+
+
+class LibbpfTable(object):
+
+    def __init__(self, program, name, fd, desc, max_entries):
+        self.program = program
+        self.name = name
+        self.fd = fd
+        self.map_type = desc["type"]
+        self.max_entries = max_entries
+        self.Key = _ctype(desc["key"])
+        self.sLeaf = _ctype(desc["leaf"])
+        self.percpu = "PERCPU" in self.map_type
+        if self.percpu:
+            self.ncpus = len(_cpus("/sys/devices/system/cpu/possible"))
+            self.Leaf = self.sLeaf * self.ncpus
+            # the kernel copies the value of each CPU in a slot rounded up
+            # to 8 bytes: smaller leaves (a u32) are unpacked with that
+            # stride, as bcc does
+            self.stride = (ct.sizeof(self.sLeaf) + 7) & ~7
+            if self.stride != ct.sizeof(self.sLeaf):
+                self.RawLeaf = (ct.c_ubyte * self.stride) * self.ncpus
+            else:
+                self.RawLeaf = self.Leaf
+        else:
+            self.Leaf = self.sLeaf
+            self.RawLeaf = self.Leaf
+        self._perf_fds = []
+        self._perf_buffer = None
+
+    def _key(self, key):
+        return key if isinstance(key, self.Key) else self.Key(getattr(key, "value", key))
+
+    def unpack(self, raw):
+        """Leaf of a value in the layout of the kernel (RawLeaf)"""
+        if self.RawLeaf is self.Leaf:
+            return raw
+        leaf = self.Leaf()
+        size = ct.sizeof(self.sLeaf)
+        for cpu in range(self.ncpus):
+            ct.memmove(ct.addressof(leaf) + cpu * size, ct.addressof(raw) + cpu * self.stride, size)
+        return leaf
+
+    def _pack(self, leaf):
+        if self.RawLeaf is self.Leaf or not isinstance(leaf, self.Leaf):
+            return leaf
+        raw = self.RawLeaf()
+        size = ct.sizeof(self.sLeaf)
+        for cpu in range(self.ncpus):
+            ct.memmove(ct.addressof(raw) + cpu * self.stride, ct.addressof(leaf) + cpu * size, size)
+        return raw
+
+    def __getitem__(self, key):
+        raw = self.RawLeaf()
+        if libbpf().bpf_map_lookup_elem(self.fd, ct.byref(self._key(key)), ct.byref(raw)) < 0:
+            raise KeyError(key)
+        return self.unpack(raw)
+
+    def __setitem__(self, key, leaf):
+        leaf = self._pack(leaf)
+        if libbpf().bpf_map_update_elem(self.fd, ct.byref(self._key(key)), ct.byref(leaf), BPF_ANY) < 0:
+            raise OSError(ct.get_errno(), "could not update table %s" % self.name)
+
+    def __delitem__(self, key):
+        if libbpf().bpf_map_delete_elem(self.fd, ct.byref(self._key(key))) < 0:
+            raise KeyError(key)
+
+    def __len__(self):
+        return sum(1 for _ in self.keys())
+
+    def keys(self):
+        if "ARRAY" in self.map_type:
+            for i in range(self.max_entries):
+                yield self.Key(i)
+            return
+        key = None
+        while True:
+            next_key = self.Key()
+            if libbpf().bpf_map_get_next_key(self.fd, ct.byref(key) if key is not None else None,
+                                             ct.byref(next_key)) < 0:
+                return
+            yield next_key
+            key = next_key
+
+    def items(self):
+        items = []
+        for key in self.keys():
+            try:
+                items.append((key, self[key]))
+            except KeyError:
+                pass
+        return items
+
+    def values(self):
+        return [value for _, value in self.items()]
+
+    def clearitem(self, key):
+        self[key] = self.Leaf()
+
+    def clear(self):
+        if "ARRAY" in self.map_type:
+            for key in self.keys():
+                self.clearitem(key)
+        else:
+            for key in list(self.keys()):
+                try:
+                    del self[key]
+                except KeyError:
+                    pass
+
+    def sum(self, key):
+        return self.sLeaf(sum(getattr(v, "value", v) for v in self[key]))
+
+    def max(self, key):
+        return self.sLeaf(max(getattr(v, "value", v) for v in self[key]))
+
+    def open_perf_event(self, ev_type, ev_config):
+        for cpu in _cpus("/sys/devices/system/cpu/online"):
+            fd = perf_event_open(ev_type, ev_config, cpu)
+            self._perf_fds.append(fd)
+            self[self.Key(cpu)] = ct.c_int(fd)
+
+    def open_perf_buffer(self, callback, page_cnt=8, lost_cb=None):
+        def sample(ctx, cpu, data, size):
+            callback(cpu, data, size)
+
+        def lost(ctx, cpu, count):
+            if lost_cb is not None:
+                lost_cb(count)
+        # keep the trampolines alive as long as the buffer
+        self._callbacks = (PERF_SAMPLE_CB(sample), PERF_LOST_CB(lost))
+        pb = libbpf().perf_buffer__new(self.fd, page_cnt, self._callbacks[0], self._callbacks[1], None, None)
+        if not pb or libbpf().libbpf_get_error(pb):
+            raise OSError(ct.get_errno(), "could not open perf buffer %s" % self.name)
+        self._perf_buffer = pb
+        self.program.perf_buffers.append(pb)
+
+    def close(self):
+        for fd in self._perf_fds:
+            os.close(fd)
+        self._perf_fds = []
+
+
+class LibbpfFunction(object):
+
+    def __init__(self, name, fd):
+        self.name = name
+        self.fd = fd
+
+
+class LibbpfProgram(object):
+    """Subset of bcc.BPF backed by a precompiled object"""
+
+    TRACEPOINT = "tracepoint"
+    RAW_TRACEPOINT = "raw_tracepoint"
+    TRACING = "tracing"
+    PERF_EVENT = "perf_event"
+
+    def __init__(self, obj_path, constants):
+        with open(obj_path[:-len(".o")] + ".json") as f:
+            self.description = json.load(f)
+        # objects built on the kernel headers have no BTF tracepoints
+        self.btf = self.description.get("btf", True)
+        lib = libbpf()
+        self.obj = lib.bpf_object__open_file(obj_path.encode(), None)
+        if not self.obj or lib.libbpf_get_error(self.obj):
+            raise OSError(ct.get_errno(), "could not open %s" % obj_path)
+
+        self.max_entries = {}
+        for name, desc in self.description["maps"].items():
+            size = desc["max_entries"]
+            if desc["max_entries_expr"] is not None:
+                size = bpf_build._eval_dim(desc["max_entries_expr"], constants)
+                lib.bpf_map__set_max_entries(self._find_map(name), size)
+            self.max_entries[name] = size
+
+        if self.description["constants"]:
+            values = (ct.c_ulonglong * len(self.description["constants"]))(
+                *[constants[c] for c in self.description["constants"]])
+            lib.bpf_map__set_initial_value(self._rodata(), ct.byref(values), ct.sizeof(values))
+
+        if lib.bpf_object__load(self.obj) < 0:
+            err = ct.get_errno()
+            lib.bpf_object__close(self.obj)
+            raise OSError(err, "could not load %s" % obj_path)
+
+        self.tables = {}
+        self.links = {}
+        self.funcs = {}
+        self.perf_buffers = []
+
+        # kprobe__<fn> and kretprobe__<fn> are attached right away, like BCC
+        # does, to the function in their SEC()
+        try:
+            for fn_name in self.description.get("attach", []):
+                link = lib.bpf_program__attach(self._program(fn_name))
+                self.links["auto:" + fn_name] = [self._link(link, fn_name)]
+        except OSError:
+            self.cleanup()
+            raise
+
+    def _find_map(self, name):
+        m = libbpf().bpf_object__find_map_by_name(self.obj, name.encode())
+        if not m:
+            raise KeyError(name)
+        return m
+
+    def _rodata(self):
+        m = libbpf().bpf_object__next_map(self.obj, None)
+        while m:
+            if libbpf().bpf_map__name(m).endswith(b".rodata"):
+                return m
+            m = libbpf().bpf_object__next_map(self.obj, m)
+        raise KeyError(".rodata")
+
+    def _program(self, fn_name):
+        prog = libbpf().bpf_object__find_program_by_name(self.obj, fn_name.encode())
+        if not prog:
+            raise KeyError(fn_name)
+        return prog
+
+    def _link(self, link, what):
+        if not link or libbpf().libbpf_get_error(link):
+            raise OSError(ct.get_errno(), "could not attach %s" % what)
+        return link
+
+    def __getitem__(self, name):
+        return self.get_table(name)
+
+    def get_table(self, name):
+        if name not in self.tables:
+            m = self._find_map(name)
+            self.tables[name] = LibbpfTable(self, name, libbpf().bpf_map__fd(m),
+                                            self.description["maps"][name], self.max_entries[name])
+        return self.tables[name]
+
+    def load_func(self, fn_name, prog_type):
+        # programs are verified when the object is loaded
+        if fn_name not in self.funcs:
+            prog = self._program(fn_name)
+            self.funcs[fn_name] = LibbpfFunction(fn_name, libbpf().bpf_program__fd(prog))
+        return self.funcs[fn_name]
+
+    def attach_tracepoint(self, tp, fn_name):
+        category, _, event = tp.partition(":")
+        link = libbpf().bpf_program__attach_tracepoint(self._program(fn_name), category.encode(), event.encode())
+        self.links[tp] = [self._link(link, tp)]
+
+    def detach_tracepoint(self, tp):
+        for link in self.links.pop(tp, []):
+            libbpf().bpf_link__destroy(link)
+
+    def attach_raw_tracepoint(self, tp, fn_name):
+        link = libbpf().bpf_program__attach_raw_tracepoint(self._program(fn_name), tp.encode())
+        self.links["raw:" + tp] = [self._link(link, tp)]
+
+    def detach_raw_tracepoint(self, tp):
+        for link in self.links.pop("raw:" + tp, []):
+            libbpf().bpf_link__destroy(link)
+
+    def attach_btf_tracepoint(self, tp, fn_name):
+        # the tracepoint is the one in the SEC("tp_btf/...") of the program
+        link = libbpf().bpf_program__attach_trace(self._program(fn_name))
+        self.links["btf:" + tp] = [self._link(link, tp)]
+
+    def detach_btf_tracepoint(self, tp):
+        for link in self.links.pop("btf:" + tp, []):
+            libbpf().bpf_link__destroy(link)
+
+    def attach_iter(self, fn_name):
+        link = libbpf().bpf_program__attach_iter(self._program(fn_name), None)
+        self.links["iter:" + fn_name] = [self._link(link, fn_name)]
+
+    def read_iter(self, fn_name):
+        # each read of a new iterator runs the program over all the objects
+        link_fd = libbpf().bpf_link__fd(self.links["iter:" + fn_name][0])
+        fd = libbpf().bpf_iter_create(link_fd)
+        if fd < 0:
+            raise OSError(-fd, "could not run the %s iterator" % fn_name)
+        chunks = []
+        try:
+            while True:
+                chunk = os.read(fd, 1 << 16)
+                if not chunk:
+                    break
+                chunks.append(chunk)
+        finally:
+            os.close(fd)
+        return b"".join(chunks)
+
+    def attach_perf_event(self, ev_type, ev_config, fn_name, sample_period=0, sample_freq=0, cpu=-1):
+        links = []
+        cpus = [cpu] if cpu >= 0 else _cpus("/sys/devices/system/cpu/online")
+        for c in cpus:
+            fd = perf_event_open(ev_type, ev_config, c, sample_period=sample_period, sample_freq=sample_freq)
+            link = libbpf().bpf_program__attach_perf_event(self._program(fn_name), fd)
+            links.append(self._link(link, "%s on cpu %d" % (fn_name, c)))
+        self.links[(ev_type, ev_config)] = links
+
+    def detach_perf_event(self, ev_type, ev_config):
+        for link in self.links.pop((ev_type, ev_config), []):
+            libbpf().bpf_link__destroy(link)
+
+    def perf_buffer_poll(self, timeout=-1):
+        for pb in self.perf_buffers:
+            libbpf().perf_buffer__poll(pb, timeout)
+
+    kprobe_poll = perf_buffer_poll
+
+    def cleanup(self):
+        for key in list(self.links):
+            for link in self.links.pop(key):
+                libbpf().bpf_link__destroy(link)
+        for table in self.tables.values():
+            table.close()
+        for pb in self.perf_buffers:
+            libbpf().perf_buffer__free(pb)
+        self.perf_buffers = []
+        if self.obj:
+            libbpf().bpf_object__close(self.obj)
+            self.obj = None
+
+
+def find_object(src_path, cflags, obj_dir=bpf_build.OBJECT_DIR):
+    """Return the path of the precompiled object matching cflags, or None"""
+    program = bpf_build.program_name(src_path)
+    _, features = bpf_build.split_cflags(program, cflags)
+    path = os.path.join(obj_dir, bpf_build.object_name(program, features))
+    return path if os.path.exists(path) else None
+
+
+def load(src_path, cflags, obj_dir=bpf_build.OBJECT_DIR, cache=None):
+    """Load the precompiled version of src_path for cflags
+
+    Objects shipped in obj_dir are preferred, otherwise the object is taken
+    from (or built into) cache when one is given. The shipped objects are
+    CO-RE and need the kernel BTF, without it the cache builds the object
+    on the headers of the running kernel.
+    """
+    btf = bpf_build.kernel_has_btf()
+    obj_path = find_object(src_path, cflags, obj_dir) if btf else None
+    if obj_path is None and cache is not None:
+        obj_path = cache.get(src_path, cflags)
+    if obj_path is None:
+        if not btf:
+            raise OSError("kernel has no BTF, CO-RE objects cannot be loaded")
+        raise OSError("no precompiled object for %s %s" % (src_path, " ".join(cflags)))
+    constants, _ = bpf_build.split_cflags(bpf_build.program_name(src_path), cflags)
+    return LibbpfProgram(obj_path, constants)
+
+
+def load_or_compile(src_path, cflags, loader, cache, compile_bcc):
+    """Load src_path through libbpf ("core") or compile it with BCC ("bcc")
+
+    "auto" tries them in this order, compile_bcc() builds the BCC version
+    and is None when BCC is not installed. Return the program and the
+    loader that was used.
+    """
+    if loader in ("core", "auto"):
+        try:
+            return load(src_path, cflags, cache=cache), "core"
+        except Exception as e:
+            if loader == "core" or compile_bcc is None:
+                raise
+            print("Precompiled %s not available, compiling with bcc: %s"
+                  % (os.path.basename(src_path), e))
+    return compile_bcc(), "bcc"
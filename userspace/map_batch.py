@@ -0,0 +1,151 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Read a whole BPF map with BPF_MAP_LOOKUP_BATCH (>= 5.6). Iterating a
+# table with items() costs a get_next_key and a lookup syscall per entry,
+# here the keys and values are copied by the kernel into two contiguous
+# buffers, as many entries per syscall as they can hold. The buffers are
+# kept from a read to the next and grow with the map, so that a map read
+# every window costs one or two syscalls. The entries returned point into
+# the buffers and are only valid until the next read.
+
+import ctypes as ct
+import errno
+import platform
+
+SYS_BPF = {"x86_64": 321, "aarch64": 280}
+BPF_MAP_LOOKUP_BATCH = 24
+ENOTSUPP = 524
+# first size of the buffers, in entries
+INITIAL_CAPACITY = 1024
+
+
+class BpfBatchAttr(ct.Structure):
+    _fields_ = [
+        ("in_batch", ct.c_ulonglong),
+        ("out_batch", ct.c_ulonglong),
+        ("keys", ct.c_ulonglong),
+        ("values", ct.c_ulonglong),
+        ("count", ct.c_uint),
+        ("map_fd", ct.c_uint),
+        ("elem_flags", ct.c_ulonglong),
+        ("flags", ct.c_ulonglong),
+    ]
+
+
+_libc = ct.CDLL(None, use_errno=True)
+
+
+def _bpf(cmd, attr):
+    return _libc.syscall(SYS_BPF[platform.machine()], cmd, ct.byref(attr), ct.sizeof(attr))
+
+
+def bpf_syscall_known():
+    return platform.machine() in SYS_BPF
+
+
+class MapSnapshot:
+
+    def __init__(self, map_fd, key_type, leaf_type, max_entries, unpack=None):
+        self.map_fd = map_fd
+        # turns a value in the layout of the kernel into the table leaf
+        self.unpack = unpack
+        self.Key = key_type
+        self.Leaf = leaf_type
+        self.max_entries = max_entries
+        self.capacity = min(INITIAL_CAPACITY, max_entries)
+        self.keys = (key_type * self.capacity)()
+        self.values = (leaf_type * self.capacity)()
+        # position in the map between two calls, opaque (a bucket for
+        # hashes, an index for arrays) and at most as large as a key
+        token_size = max(ct.sizeof(key_type), 8)
+        self.in_batch = (ct.c_ubyte * token_size)()
+        self.out_batch = (ct.c_ubyte * token_size)()
+        # without the number of the bpf syscall the table is read with items()
+        self.supported = bpf_syscall_known()
+        # syscalls of the last read
+        self.syscalls = 0
+
+    def _grow(self, count):
+        capacity = min(self.capacity * 2, self.max_entries)
+        keys = (self.Key * capacity)()
+        values = (self.Leaf * capacity)()
+        ct.memmove(keys, self.keys, count * ct.sizeof(self.Key))
+        ct.memmove(values, self.values, count * ct.sizeof(self.Leaf))
+        self.keys, self.values, self.capacity = keys, values, capacity
+
+    def read(self):
+        """Return [(key, value)] of every entry of the map, or None when
+        the kernel does not support batch lookups on it"""
+        if not self.supported:
+            return None
+        count = 0
+        first = True
+        self.syscalls = 0
+        while True:
+            if count == self.capacity:
+                if self.capacity == self.max_entries:
+                    break
+                self._grow(count)
+            attr = BpfBatchAttr(
+                0 if first else ct.addressof(self.in_batch),
+                ct.addressof(self.out_batch),
+                ct.addressof(self.keys) + count * ct.sizeof(self.Key),
+                ct.addressof(self.values) + count * ct.sizeof(self.Leaf),
+                self.capacity - count,
+                self.map_fd,
+                0,
+                0,
+            )
+            ret = _bpf(BPF_MAP_LOOKUP_BATCH, attr)
+            self.syscalls += 1
+            err = ct.get_errno() if ret < 0 else 0
+            if ret < 0 and err not in (errno.ENOENT, errno.ENOSPC):
+                if err in (errno.EINVAL, errno.EOPNOTSUPP, ENOTSUPP) and first:
+                    self.supported = False
+                    return None
+                raise OSError(err, "batch lookup of map fd %d failed" % self.map_fd)
+            if err == errno.ENOSPC:
+                # a hash bucket did not fit in what is left of the buffers,
+                # nothing was copied: retry from the same position
+                if self.capacity == self.max_entries:
+                    break
+                self._grow(count)
+                continue
+            # on ENOENT count is what was copied before the end of the map
+            count += attr.count
+            if err == errno.ENOENT:
+                break
+            ct.memmove(self.in_batch, self.out_batch, ct.sizeof(self.in_batch))
+            first = False
+        if self.unpack is not None:
+            return [(self.keys[i], self.unpack(self.values[i])) for i in range(count)]
+        return [(self.keys[i], self.values[i]) for i in range(count)]
+
+
+def snapshot_of(table):
+    """MapSnapshot of a BCC or libbpf_loader table"""
+    map_fd = getattr(table, "map_fd", None)
+    if map_fd is None:
+        map_fd = table.fd
+    raw_leaf = getattr(table, "RawLeaf", table.Leaf)
+    if raw_leaf is not table.Leaf:
+        return MapSnapshot(map_fd, table.Key, raw_leaf, table.max_entries, table.unpack)
+    return MapSnapshot(map_fd, table.Key, table.Leaf, table.max_entries)
@@ -0,0 +1,85 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Capacity of the hash maps of our BPF programs. It is declared in
+# config.yaml (map_sizes) as a comma separated list of name=entries, e.g.
+# "pids=65536,graveyard=4096,recv_cache=200000", the maps that are not
+# listed keep the default of their program. Each name becomes the
+# <NAME>_MAP_SIZE cflag of the program that owns the map. The libbpf build
+# takes them as load time constants (bpf_build.py), so the prebuilt objects
+# serve any size.
+
+import ctypes as ct
+
+# maps of each program that can be sized, see the *_MAP_SIZE defaults there
+PROGRAM_MAPS = {
+    "bpf_monitor": ["pids", "aggregates", "graveyard", "foreign_cycles", "migrations"],
+    "tcp_monitor": [
+        "endpoints", "connections", "summary", "http_summary", "latency",
+        "http_latency", "set_state_cache", "recv_cache", "rewrite_cache", "rewritten_rules",
+    ],
+    "vfs_monitor": ["counts_by_pid", "counts_by_file", "entryinfo"],
+}
+
+# tables counted in the failed_inserts array of a program, by FAILED_* index
+FAILED_INSERTS = {
+    "tcp_monitor": ["summary", "http_summary", "latency", "http_latency", "rewritten_rules"],
+    "vfs_monitor": ["counts_by_pid", "counts_by_file"],
+}
+
+
+class MapSizes:
+    def __init__(self, spec=""):
+        known = [name for names in PROGRAM_MAPS.values() for name in names]
+        self.sizes = {}
+        for item in [i.strip() for i in (spec or "").split(",") if i.strip()]:
+            name, _, entries = item.partition("=")
+            name = name.strip()
+            if name not in known:
+                raise ValueError("unknown map %s in map_sizes, known maps: %s" % (name, ", ".join(known)))
+            self.sizes[name] = int(entries, 0)
+            if self.sizes[name] <= 0:
+                raise ValueError("the size of map %s must be positive" % name)
+
+    def get_cflags(self, program):
+        return [
+            "-D%s_MAP_SIZE=%d" % (name.upper(), self.sizes[name])
+            for name in PROGRAM_MAPS[program] if name in self.sizes
+        ]
+
+
+class FailedInserts:
+    """Rows that did not fit in the full tables of a program since the
+    previous read, from its per-CPU failed_inserts array"""
+
+    def __init__(self, bpf_program, program):
+        self.table = bpf_program.get_table("failed_inserts")
+        self.names = FAILED_INSERTS[program]
+        self.totals = [0] * len(self.names)
+
+    def read(self):
+        failed = {}
+        for index, name in enumerate(self.names):
+            total = self.table.sum(ct.c_int(index)).value
+            count = total - self.totals[index]
+            self.totals[index] = total
+            if count > 0:
+                failed[name.upper() + "_INSERT_FAILED"] = count
+        return failed
@@ -19,12 +19,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 """
 
 from .bpf_collector import BpfCollector
+from .cgroup_perf_collector import CgroupPerfCollector
+from .pmu_events import DEFAULT_EVENTS
 from .proc_topology import ProcTopology
 from .sample_controller import SampleController
 from .process_table import ProcTable
 from .net_collector import NetCollector
 from .mem_collector import MemCollector
 from .disk_collector import DiskCollector
+from .object_cache import ObjectCache
 from .rapl.rapl import RaplMonitor
 import time
 import re
@@ -48,17 +51,48 @@ class MonitorMain:
         memory_measure,
         disk_measure,
         file_measure,
+        accounting_engine="hash",
+        bpf_loader="auto",
+        bpf_cache_dir=None,
+        sched_attach_mode="auto",
+        pmu_events=DEFAULT_EVENTS,
+        aggregation="thread",
+        trace_errors=False,
+        window_trigger="auto",
+        window_period_ms=500,
+        smt_overlap="sched",
+        attribution="cycles",
+        idle_power=False,
+        energy_source="auto",
+        energy_replay_file=None,
+        energy_sample_period_ms=0,
+        capture_mode="switch",
+        sampling_rate_hz=997,
+        counter_backend="bpf",
+        map_sizes="",
     ):
         self.output_format = output_format
         self.window_mode = window_mode
-        # TODO: Don't hardcode the frequency
-        self.frequency = 2
+        # length of the fixed windows
+        self.frequency = 1000.0 / float(window_period_ms)
 
         self.topology = ProcTopology()
-        self.collector = BpfCollector(self.topology, debug_mode, power_measure)
+        # shared by the BPF programs, objects built on this host by a previous run
+        self.object_cache = ObjectCache(bpf_cache_dir) if bpf_cache_dir else None
+        if counter_backend == "cgroup_perf":
+            self.collector = CgroupPerfCollector(self.topology, pmu_events)
+        else:
+            self.collector = BpfCollector(
+                self.topology, debug_mode, power_measure, accounting_engine, bpf_loader,
+                self.object_cache, sched_attach_mode, pmu_events, aggregation, trace_errors,
+                window_trigger, smt_overlap, attribution, idle_power, capture_mode,
+                sampling_rate_hz, map_sizes
+            )
         self.sample_controller = SampleController(self.topology.get_hyperthread_count())
         self.process_table = ProcTable()
-        self.rapl_monitor = RaplMonitor(self.topology)
+        self.rapl_monitor = RaplMonitor(
+            self.topology, energy_source, energy_replay_file, energy_sample_period_ms
+        )
         self.started = False
 
         self.print_net_details = print_net_details
@@ -77,13 +111,18 @@ class MonitorMain:
             self.net_collector = NetCollector(
                 trace_nat=nat_trace,
                 dynamic_tcp_client_port_masking=dynamic_tcp_client_port_masking,
+                map_sizes=map_sizes,
+                bpf_loader=bpf_loader,
+                object_cache=self.object_cache,
             )
 
         if self.mem_measure:
             self.mem_collector = MemCollector()
 
         if self.disk_measure or self.file_measure:
-            self.disk_collector = DiskCollector(disk_measure, file_measure)
+            self.disk_collector = DiskCollector(
+                disk_measure, file_measure, map_sizes, bpf_loader, self.object_cache
+            )
 
     def get_window_mode(self):
         return self.window_mode
@@ -106,6 +145,23 @@ class MonitorMain:
                 self.disk_collector.start_capture()
         else:
             print("Please provide a window mode")
+        self._log_bpf_setup()
+
+    def _log_bpf_setup(self):
+        # what the collectors ended up with once their fallbacks were taken
+        if isinstance(self.collector, BpfCollector):
+            print("BPF loader: %s, accounting engine: %s, window trigger: %s, capture mode: %s" % (
+                self.collector.get_bpf_loader(), self.collector.get_accounting_engine(),
+                self.collector.get_window_trigger(), self.collector.get_capture_mode()))
+        if self.net_monitor:
+            print("Network monitor BPF loader: %s" % self.net_collector.get_bpf_loader())
+        if self.disk_measure or self.file_measure:
+            print("Disk monitor BPF loader: %s" % self.disk_collector.get_bpf_loader())
+        if self.object_cache is not None:
+            totals = self.object_cache.stats()
+            print("BPF object cache: %d hits, %d misses (%d hits, %d misses in %s)" % (
+                self.object_cache.hits, self.object_cache.misses,
+                totals.get("hits", 0), totals.get("misses", 0), self.object_cache.stats_path))
 
     def get_sample(self):
         if not self.started:
@@ -131,10 +187,12 @@ class MonitorMain:
                 disk_dict = aggregate_disk_sample["disk_sample"]
             if self.file_measure:
                 file_dict = aggregate_disk_sample["file_sample"]
+            sample.add_errors(self.disk_collector.get_failed_inserts())
 
         nat_data = []
         if self.net_monitor:
             net_sample = self.net_collector.get_sample()
+            sample.add_errors(self.net_collector.get_failed_inserts())
             self.process_table.add_process_from_sample(
                 sample,
                 net_dictionary=net_sample.get_pid_dictionary(),
@@ -18,7 +18,11 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 """
 
-from bcc import BPF
+try:
+    from bcc import BPF
+except ImportError:
+    # only needed when the network monitor is enabled
+    BPF = None
 import ctypes as ct
 import numpy as np
 from socket import inet_ntop, AF_INET, AF_INET6
@@ -26,6 +30,8 @@ from struct import pack
 from collections import namedtuple
 import os
 from ddsketch.ddsketch import DDSketch
+from .map_sizes import MapSizes, FailedInserts
+from . import libbpf_loader
 
 
 from enum import Enum
@@ -308,8 +314,13 @@ class NetSample:
 
 class NetCollector:
 
-    def __init__(self, trace_nat=False, dynamic_tcp_client_port_masking=False):
+    def __init__(self, trace_nat=False, dynamic_tcp_client_port_masking=False, map_sizes="",
+                 bpf_loader="auto", object_cache=None):
         self.ebpf_tcp_monitor = None
+        self.bpf_loader = bpf_loader
+        self.object_cache = object_cache
+        self.map_sizes = MapSizes(map_sizes)
+        self.failed_inserts = None
         self.nat = trace_nat
         self.dynamic_tcp_client_port_masking = dynamic_tcp_client_port_masking
 
@@ -343,19 +354,18 @@ class NetCollector:
         if self.nat:
             cflags.append("-DBYPASS")
             cflags.append("-DREVERSE_BYPASS")
-        if BPF.tracepoint_exists("sock", "inet_sock_set_state"):
-            cflags.append("-DSET_STATE_4_16")
-        elif BPF.tracepoint_exists("tcp", "tcp_set_state"):
-            cflags.append("-DSET_STATE_4_15")
-        else:
-            cflags.append("-DSET_STATE_KPROBE")
         if self.dynamic_tcp_client_port_masking:
             cflags.append("-DDYN_TCP_CLIENT_PORT_MASKING")
             cflags.append("-DDYN_TCP_CLIENT_PORT_MASKING_THRESHOLD=%d" % self.tcp_dyn_masking_threshold)
 
+        cflags.extend(self.map_sizes.get_cflags("tcp_monitor"))
         # print(cflags)
 
-        self.ebpf_tcp_monitor = BPF(src_file=bpf_code_path, cflags=cflags)
+        # the libbpf build traces tcp_set_state with fentry (a kprobe without
+        # kernel BTF) on any kernel, BCC uses the tracepoint where there is one
+        self.ebpf_tcp_monitor, self.bpf_loader = libbpf_loader.load_or_compile(
+            bpf_code_path, cflags + ["-DSET_STATE_KPROBE"], self.bpf_loader, self.object_cache,
+            (lambda: BPF(src_file=bpf_code_path, cflags=cflags + self._set_state_cflags())) if BPF else None)
 
         self.ipv4_summary[0] = self.ebpf_tcp_monitor["ipv4_summary"]
         self.ipv6_summary[0] = self.ebpf_tcp_monitor["ipv6_summary"]
@@ -378,8 +388,22 @@ class NetCollector:
         self.ipv6_http_latency[1] = self.ebpf_tcp_monitor["ipv6_http_latency_1"]
 
         self.bpf_config = self.ebpf_tcp_monitor["conf"]
-        self.selector = 0
-        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.selector)
+        self.failed_inserts = FailedInserts(self.ebpf_tcp_monitor, "tcp_monitor")
+        self.epoch = 1
+        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.epoch)
+
+    def get_bpf_loader(self):
+        return self.bpf_loader
+
+    def _set_state_cflags(self):
+        if BPF.tracepoint_exists("sock", "inet_sock_set_state"):
+            return ["-DSET_STATE_4_16"]
+        elif BPF.tracepoint_exists("tcp", "tcp_set_state"):
+            return ["-DSET_STATE_4_15"]
+        return ["-DSET_STATE_KPROBE"]
+
+    def get_failed_inserts(self):
+        return self.failed_inserts.read() if self.failed_inserts else {}
 
     def get_sample(self):
         #iterate over summary tables
@@ -392,13 +416,11 @@ class NetCollector:
 
         bucket_count = 0
 
-        old_selector = self.selector
-
-        if self.selector == 0:
-            self.selector = 1
-        else:
-            self.selector = 0
-        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.selector)
+        # drain the tables of the epoch that just ended while eBPF writes
+        # the ones of the next epoch
+        old_selector = self.epoch % len(self.ipv4_summary)
+        self.epoch = self.epoch + 1
+        self.bpf_config[ct.c_int(0)] = ct.c_uint(self.epoch)
 
         # set the types and tables to iterate on
         transaction_types = [TransactionType.ipv4_tcp, TransactionType.ipv6_tcp, TransactionType.ipv4_http, TransactionType.ipv6_http]
@@ -0,0 +1,102 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# On disk store of the objects built by bpf_build.py on this host.
+# Objects are keyed by kernel release, program source, translator and
+# compile time cflags, so that a restart on the same kernel reuses the
+# object built by the previous run instead of compiling it again. On
+# kernels without BTF the objects are built on the kernel headers, like
+# BCC does, so hosts that would compile with BCC at every start are
+# covered too.
+
+import hashlib
+import json
+import os
+import shutil
+import tempfile
+
+from . import bpf_build
+
+DEFAULT_CACHE_DIR = "/var/cache/deep-mon"
+
+
+class ObjectCache:
+
+    def __init__(self, cache_dir=DEFAULT_CACHE_DIR):
+        self.cache_dir = os.path.join(cache_dir, os.uname().release)
+        self.stats_path = os.path.join(cache_dir, "stats.json")
+        # lookups of this run, stats() has the totals of all the runs
+        self.hits = 0
+        self.misses = 0
+
+    def key(self, src_path, cflags, btf=True):
+        program = bpf_build.program_name(src_path)
+        _, features = bpf_build.split_cflags(program, cflags)
+        digest = hashlib.sha256()
+        digest.update(os.uname().release.encode())
+        digest.update(b"vmlinux" if btf else b"kernel headers")
+        for path in (src_path, bpf_build.__file__):
+            with open(path, "rb") as f:
+                digest.update(f.read())
+        digest.update(" ".join(sorted(features)).encode())
+        return "%s.%s.bpf.o" % (program, digest.hexdigest()[:16])
+
+    def get(self, src_path, cflags):
+        """Return the cached object for src_path and cflags, building it on a miss"""
+        btf = bpf_build.kernel_has_btf()
+        program = bpf_build.program_name(src_path)
+        bpf_build.check_features(bpf_build.split_cflags(program, cflags)[1], btf)
+        obj_path = os.path.join(self.cache_dir, self.key(src_path, cflags, btf))
+        if os.path.exists(obj_path):
+            self._count("hits")
+            return obj_path
+
+        self._count("misses")
+        os.makedirs(self.cache_dir, exist_ok=True)
+        if btf:
+            bpf_build.generate_vmlinux_header(self.cache_dir)
+        # build aside and move in place, a concurrent start never sees a partial object
+        build_dir = tempfile.mkdtemp(dir=self.cache_dir)
+        try:
+            built = bpf_build.build(src_path, cflags, build_dir, (self.cache_dir,),
+                                    os.path.basename(obj_path), btf)
+            os.replace(built[:-len(".o")] + ".json", obj_path[:-len(".o")] + ".json")
+            os.replace(built, obj_path)
+        finally:
+            shutil.rmtree(build_dir, ignore_errors=True)
+        return obj_path
+
+    def stats(self):
+        try:
+            with open(self.stats_path) as f:
+                return json.load(f)
+        except (IOError, ValueError):
+            return {"hits": 0, "misses": 0}
+
+    def _count(self, what):
+        setattr(self, what, getattr(self, what) + 1)
+        stats = self.stats()
+        stats[what] = stats.get(what, 0) + 1
+        try:
+            os.makedirs(os.path.dirname(self.stats_path), exist_ok=True)
+            with open(self.stats_path, "w") as f:
+                json.dump(stats, f)
+        except IOError:
+            pass
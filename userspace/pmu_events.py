@@ -0,0 +1,116 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# The set of PMU events read by bpf_monitor.c at each context switch.
+# It is declared in config.yaml (pmu_events) as a comma separated list of
+# names from EVENT_CATALOG or of custom events written as name=type:config,
+# e.g. "cycles_thread,instr_thread,l2_misses=4:0x3f24".
+# The BPF program is compiled for exactly these events.
+
+from .libbpf_loader import PerfType, PerfHWConfig
+
+# name: (perf type, perf config, ProcessInfo field or None)
+EVENT_CATALOG = {
+    "cycles_thread": (PerfType.HARDWARE, PerfHWConfig.CPU_CYCLES, "cycles"),
+    # UNHALTED_CORE_CYCLES with AnyThread, only on Intel cores that still have it
+    "cycles_core": (PerfType.RAW, 0x73003c, None),
+    "instr_thread": (PerfType.HARDWARE, PerfHWConfig.INSTRUCTIONS, "instruction_retired"),
+    "cache_misses": (PerfType.HARDWARE, PerfHWConfig.CACHE_MISSES, "cache_misses"),
+    "cache_refs": (PerfType.HARDWARE, PerfHWConfig.CACHE_REFERENCES, "cache_refs"),
+    "branch_instructions": (PerfType.HARDWARE, PerfHWConfig.BRANCH_INSTRUCTIONS, None),
+    "branch_misses": (PerfType.HARDWARE, PerfHWConfig.BRANCH_MISSES, None),
+    "bus_cycles": (PerfType.HARDWARE, PerfHWConfig.BUS_CYCLES, None),
+    "stalled_cycles_frontend": (PerfType.HARDWARE, PerfHWConfig.STALLED_CYCLES_FRONTEND, None),
+    "stalled_cycles_backend": (PerfType.HARDWARE, PerfHWConfig.STALLED_CYCLES_BACKEND, None),
+    "ref_cycles": (PerfType.HARDWARE, PerfHWConfig.REF_CPU_CYCLES, None),
+}
+
+# the power attribution is based on these, they are always read for the
+# SMT overlap engine (smt_overlap in config.yaml)
+POWER_EVENTS = {
+    "sched": ["cycles_thread"],
+    "any_thread": ["cycles_thread", "cycles_core"],
+}
+
+# and these for the attribution mode (attribution in config.yaml). With
+# ref_cycles in the set the effective frequency of each CPU is tracked
+ATTRIBUTION_EVENTS = {
+    "cycles": [],
+    "frequency": ["ref_cycles"],
+}
+
+DEFAULT_EVENTS = "cycles_thread,instr_thread,cache_misses,cache_refs"
+
+
+class PmuEvent:
+    def __init__(self, name, ev_type, ev_config, field=None):
+        self.name = name
+        self.ev_type = ev_type
+        self.ev_config = ev_config
+        self.field = field
+
+    def __repr__(self):
+        return "%s=%d:%#x" % (self.name, self.ev_type, self.ev_config)
+
+
+class PmuEventSet:
+    def __init__(self, spec=DEFAULT_EVENTS, smt_overlap="sched", attribution="cycles"):
+        names = POWER_EVENTS[smt_overlap] + ATTRIBUTION_EVENTS[attribution] \
+            + [n.strip() for n in (spec or "").split(",") if n.strip()]
+        self.events = []
+        for name in names:
+            if any(event.name == name.partition("=")[0] for event in self.events):
+                continue
+            self.events.append(self._parse(name))
+
+    def _parse(self, name):
+        if "=" in name:
+            name, _, definition = name.partition("=")
+            ev_type, _, ev_config = definition.partition(":")
+            return PmuEvent(name, int(ev_type, 0), int(ev_config, 0))
+        if name not in EVENT_CATALOG:
+            raise ValueError("unknown PMU event %s, use name=type:config for custom events" % name)
+        return PmuEvent(name, *EVENT_CATALOG[name])
+
+    def __iter__(self):
+        return iter(self.events)
+
+    def __len__(self):
+        return len(self.events)
+
+    def __contains__(self, name):
+        return any(event.name == name for event in self.events)
+
+    def index(self, name):
+        for i, event in enumerate(self.events):
+            if event.name == name:
+                return i
+        raise KeyError(name)
+
+    def get_cflags(self):
+        cflags = [
+            "-DNUM_COUNTERS=%d" % len(self.events),
+            "-DCOUNTER_CYCLES_THREAD=%d" % self.index("cycles_thread"),
+        ]
+        if "cycles_core" in self:
+            cflags.append("-DCOUNTER_CYCLES_CORE=%d" % self.index("cycles_core"))
+        if "ref_cycles" in self:
+            cflags.append("-DCOUNTER_REF_CYCLES=%d" % self.index("ref_cycles"))
+        return cflags
@@ -0,0 +1,54 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Attribution of the RAPL power of a window to its rows, shared by the BPF
+# collector and the cgroup perf event backend. The rows are ProcessInfo in
+# a pid_dict keyed by pid, by -(1 + cpu) for the idle rows and by
+# _cgroup_key(cgroup id) for the cgroup rows. Needs self.topology and
+# self.num_cpus.
+
+
+class PowerAttribution:
+
+    def _cgroup_key(self, key):
+        # cgroup id <-> pid_dict key, the mapping is its own inverse
+        return -1 * (1 + self.num_cpus + key)
+
+    def _set_domain_power(self, pid_dict, uncore_power, dram_power):
+        # Uncore power goes to the processes by their LLC references and
+        # DRAM power by their LLC misses, the traffic that keeps the two
+        # domains busy. The counters are per thread and not per socket, so
+        # the two domains are split host wide
+        total_refs = float(sum(proc_info.get_cache_refs() for proc_info in pid_dict.values()))
+        total_misses = float(sum(proc_info.get_cache_misses() for proc_info in pid_dict.values()))
+        for proc_info in pid_dict.values():
+            if total_refs > 0:
+                proc_info.set_uncore_power(uncore_power * proc_info.get_cache_refs() / total_refs)
+            if total_misses > 0:
+                proc_info.set_dram_power(dram_power * proc_info.get_cache_misses() / total_misses)
+
+    def _get_pid_power(self, pid, total_cycles, core_power):
+        pid_power = 0.0
+        for socket in self.topology.get_sockets():
+            tc = float(total_cycles[socket])
+            if tc > 0:
+                wc = float(pid.get_socket_data(socket).get_weighted_cycles())
+                pid_power += core_power[socket] * (wc / tc)
+        return pid_power
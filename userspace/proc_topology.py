@@ -23,20 +23,6 @@ import os
 import ctypes as ct
 import pprint
 
-class BpfProcTopology(ct.Structure):
-    _fields_ = [("ht_id", ct.c_ulonglong),
-                ("sibling_id", ct.c_ulonglong),
-                ("core_id", ct.c_ulonglong),
-                ("processor_id", ct.c_ulonglong),
-                ("cycles_core", ct.c_ulonglong),
-                ("cycles_core_delta_sibling", ct.c_ulonglong),
-                ("cycles_thread", ct.c_ulonglong),
-                ("cache_misses", ct.c_ulonglong),
-                ("cache_refs", ct.c_ulonglong),
-                ("instr_thread", ct.c_ulonglong),
-                ("ts", ct.c_ulonglong),
-                ("running_pid", ct.c_int)]
-
 class ProcTopology:
     processors_path = '/proc/cpuinfo'
 
@@ -88,21 +74,16 @@ class ProcTopology:
     def get_hyperthread_count(self):
         return len(self.coresDict)
 
-    def get_new_bpf_topology(self):
+    def get_new_bpf_topology(self, leaf_type):
+        # leaf_type is the proc_topology type of the processors table, the
+        # counters and timestamps start from zero
         bpf_dict = {}
         for key,value in self.coresDict.items():
-            core = BpfProcTopology(ct.c_ulonglong(value[0]), \
-                                ct.c_ulonglong(value[1]), \
-                                ct.c_ulonglong(value[2]), \
-                                ct.c_ulonglong(value[3]), \
-                                ct.c_ulonglong(0), \
-                                ct.c_ulonglong(0), \
-                                ct.c_ulonglong(0), \
-                                ct.c_ulonglong(0), \
-                                ct.c_ulonglong(0), \
-                                ct.c_ulonglong(0), \
-                                ct.c_ulonglong(0), \
-                                ct.c_int(0))
+            core = leaf_type()
+            core.ht_id = ct.c_ulonglong(value[0]).value
+            core.sibling_id = ct.c_ulonglong(value[1]).value
+            core.core_id = ct.c_ulonglong(value[2]).value
+            core.processor_id = ct.c_ulonglong(value[3]).value
             bpf_dict[key] = core
             # pprint.pprint(bpf_dict)
         return bpf_dict
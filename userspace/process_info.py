@@ -74,6 +74,9 @@ class ProcessInfo:
         self.tgid = -1
         self.comm = ""
         self.power = 0.0
+        # power of the uncore and DRAM domains, attributed by LLC refs/misses
+        self.uncore_power = 0.0
+        self.dram_power = 0.0
         self.cpu_usage = 0.0
         self.socket_data = []
         self.cgroup_id = ""
@@ -84,6 +87,8 @@ class ProcessInfo:
         self.cache_misses = 0
         self.cache_refs = 0
         self.time_ns = 0
+        # extra pmu events without a dedicated field, by event name
+        self.counters = {}
 
         self.network_transactions = []
         self.nat_rules = []
@@ -103,6 +108,12 @@ class ProcessInfo:
     def set_power(self, power):
         self.power = float(power)
 
+    def set_uncore_power(self, uncore_power):
+        self.uncore_power = float(uncore_power)
+
+    def set_dram_power(self, dram_power):
+        self.dram_power = float(dram_power)
+
     def set_cpu_usage(self, cpu_usage):
         self.cpu_usage = float(cpu_usage)
 
@@ -121,6 +132,12 @@ class ProcessInfo:
     def set_time_ns(self, time_ns):
         self.time_ns = time_ns
 
+    def set_counter(self, name, value):
+        self.counters[name] = value
+
+    def set_counters(self, counters):
+        self.counters = dict(counters)
+
     def compute_cpu_usage_millis(self, total_execution_time_millis, total_cores):
         self.cpu_usage = 0
         if total_execution_time_millis != 0:
@@ -155,6 +172,7 @@ class ProcessInfo:
         self.cycles = 0
         self.cache_misses = 0
         self.time_ns = 0
+        self.counters = {}
         self.network_transactions = []
         self.nat_rules = []
         for item in self.socket_data:
@@ -172,6 +190,12 @@ class ProcessInfo:
     def get_power(self):
         return self.power
 
+    def get_uncore_power(self):
+        return self.uncore_power
+
+    def get_dram_power(self):
+        return self.dram_power
+
     def get_cpu_usage(self):
         return self.cpu_usage
 
@@ -190,6 +214,9 @@ class ProcessInfo:
     def get_time_ns(self):
         return self.time_ns
 
+    def get_counters(self):
+        return self.counters
+
     def get_socket_data(self, socket_index = -1):
         if socket_index < 0:
             return self.socket_data
@@ -39,6 +39,8 @@ class ProcTable:
                 evicted_keys.append(proc_table_key)
             else:
                 proc_table_value.set_power(0)
+                proc_table_value.set_uncore_power(0)
+                proc_table_value.set_dram_power(0)
                 proc_table_value.set_cpu_usage(0)
                 proc_table_value.reset_data()
 
@@ -58,6 +60,8 @@ class ProcTable:
                 if value.get_comm() == self.proc_table[key].get_comm():
                     # ok, update stuff
                     self.proc_table[key].set_power(value.get_power())
+                    self.proc_table[key].set_uncore_power(value.get_uncore_power())
+                    self.proc_table[key].set_dram_power(value.get_dram_power())
                     self.proc_table[key].set_cpu_usage(value.get_cpu_usage())
                     self.proc_table[key].set_instruction_retired(
                         value.get_instruction_retired()
@@ -66,11 +70,12 @@ class ProcTable:
                     self.proc_table[key].set_cache_misses(value.get_cache_misses())
                     self.proc_table[key].set_cache_refs(value.get_cache_refs())
                     self.proc_table[key].set_time_ns(value.get_time_ns())
+                    self.proc_table[key].set_counters(value.get_counters())
                     self.proc_table[key].set_socket_data_array(value.get_socket_data())
                 else:
                     # process is changed, replace entry and find cgroup_id
                     try:
-                        cgroup_id = self.find_cgroup_id(key, value.tgid)
+                        cgroup_id = value.get_cgroup_id() or self.find_cgroup_id(key, value.tgid)
                         if cgroup_id is not None:
                             value.set_cgroup_id(cgroup_id)
                             value.set_container_id(cgroup_id[0:12])
@@ -82,7 +87,8 @@ class ProcTable:
             else:
                 # new process, add it and find cgroup_id
                 try:
-                    cgroup_id = self.find_cgroup_id(key, value.tgid)
+                    # cgroup rows come with their cgroup already resolved
+                    cgroup_id = value.get_cgroup_id() or self.find_cgroup_id(key, value.tgid)
                     if cgroup_id is not None:
                         value.set_cgroup_id(cgroup_id)
                         value.set_container_id(cgroup_id[0:12])
@@ -234,8 +240,11 @@ class ProcTable:
                 )
                 # print(f"Adding time_ns for container {value.container_id}: {value.get_time_ns()}")
                 container_dict[value.container_id].add_time_ns(value.get_time_ns())
+                container_dict[value.container_id].add_counters(value.get_counters())
                 # print(f"Adding power for container {value.container_id}: {value.get_power()}")
                 container_dict[value.container_id].add_power(value.get_power())
+                container_dict[value.container_id].add_uncore_power(value.get_uncore_power())
+                container_dict[value.container_id].add_dram_power(value.get_dram_power())
                 # print(f"Adding cpu usage for container {value.container_id}: {value.get_cpu_usage()}")
                 container_dict[value.container_id].add_cpu_usage(value.get_cpu_usage())
                 # print(f"Adding pid for container {value.container_id}: {value.get_pid()}")
@@ -0,0 +1,218 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Where the RAPL energy counters are read from (energy_source in
+# config.yaml): the powercap sysfs files, the perf power PMU or a file
+# recorded earlier. Each source returns one reading of every domain and
+# socket, stamped with CLOCK_MONOTONIC like bpf_ktime_get_ns so that the
+# energy deltas line up with the BPF windows.
+
+import json
+import os
+import struct
+import time
+
+from ..libbpf_loader import perf_event_open
+
+DOMAINS = ["package", "core", "dram"]
+
+POWERCAP_PATH = "/sys/class/powercap"
+# name of the powercap zone of each domain, package zones are package-<id>
+POWERCAP_NAMES = {"core": "core", "dram": "dram"}
+
+POWER_PMU_PATH = "/sys/bus/event_source/devices/power"
+POWER_PMU_EVENTS = {"package": "energy-pkg", "core": "energy-cores", "dram": "energy-ram"}
+
+
+class EnergyReading:
+    def __init__(self, energy_uj, timestamp_ns, max_energy_uj):
+        self.energy_uj = energy_uj
+        self.timestamp_ns = timestamp_ns
+        # the counter wraps around after max_energy_uj
+        self.max_energy_uj = max_energy_uj
+
+
+class SysfsEnergySource:
+    """energy_uj files of the intel-rapl powercap zones, kept open and read with pread"""
+
+    def __init__(self, topology, root=POWERCAP_PATH):
+        self.sockets = sorted(topology.get_sockets())
+        self.fds = {}
+        self.max_energy = {}
+        zones = self._find_zones(root)
+        if not zones:
+            raise OSError("no intel-rapl powercap zones in %s" % root)
+        for (domain, socket), path in zones.items():
+            if socket not in self.sockets:
+                continue
+            self.fds[(domain, socket)] = os.open(os.path.join(path, "energy_uj"), os.O_RDONLY)
+            self.max_energy[(domain, socket)] = self._read_int(
+                os.path.join(path, "max_energy_range_uj"), 2**32
+            )
+
+    def _read_int(self, path, default):
+        try:
+            with open(path) as f:
+                return int(f.read().strip())
+        except (EnvironmentError, ValueError):
+            return default
+
+    def _read_name(self, path):
+        try:
+            with open(os.path.join(path, "name")) as f:
+                return f.read().strip()
+        except EnvironmentError:
+            return ""
+
+    def _find_zones(self, root):
+        # the core and dram subzones are not numbered in the same way on
+        # every CPU, tell them by name
+        zones = {}
+        for zone in sorted(os.listdir(root)) if os.path.isdir(root) else []:
+            if not zone.startswith("intel-rapl:") or zone.count(":") != 1:
+                continue
+            path = os.path.join(root, zone)
+            name = self._read_name(path)
+            if not name.startswith("package-"):
+                continue
+            socket = int(name[len("package-"):])
+            zones[("package", socket)] = path
+            for subzone in sorted(os.listdir(path)):
+                if not subzone.startswith(zone + ":"):
+                    continue
+                subname = self._read_name(os.path.join(path, subzone))
+                for domain, powercap_name in POWERCAP_NAMES.items():
+                    if subname == powercap_name:
+                        zones[(domain, socket)] = os.path.join(path, subzone)
+        return zones
+
+    def read(self):
+        readings = {}
+        for domain in DOMAINS:
+            readings[domain] = []
+            for socket in self.sockets:
+                fd = self.fds.get((domain, socket))
+                energy = 0
+                if fd is not None:
+                    try:
+                        energy = int(os.pread(fd, 32, 0).strip())
+                    except (OSError, ValueError):
+                        pass
+                readings[domain].append(EnergyReading(
+                    energy, time.monotonic_ns(), self.max_energy.get((domain, socket), 2**32)
+                ))
+        return readings
+
+    def close(self):
+        for fd in self.fds.values():
+            os.close(fd)
+        self.fds = {}
+
+
+class PerfEnergySource:
+    """power/energy-* events of the perf power PMU, one CPU per socket"""
+
+    def __init__(self, topology, root=POWER_PMU_PATH):
+        self.sockets = sorted(topology.get_sockets())
+        self.fds = {}
+        self.scales = {}
+        with open(os.path.join(root, "type")) as f:
+            pmu_type = int(f.read().strip())
+        # the events of a socket are read on any of its CPUs
+        socket_cpus = {}
+        for cpu, core in sorted(topology.get_topology().items()):
+            socket_cpus.setdefault(core[3], cpu)
+        for domain, event in POWER_PMU_EVENTS.items():
+            event_path = os.path.join(root, "events", event)
+            if not os.path.exists(event_path):
+                continue
+            with open(event_path) as f:
+                config = int(f.read().strip().partition("=")[2], 0)
+            with open(event_path + ".scale") as f:
+                # Joules per count
+                self.scales[domain] = float(f.read().strip())
+            for socket in self.sockets:
+                self.fds[(domain, socket)] = perf_event_open(pmu_type, config, socket_cpus[socket])
+        if not self.fds:
+            raise OSError("no energy events in %s" % root)
+
+    def read(self):
+        readings = {}
+        for domain in DOMAINS:
+            readings[domain] = []
+            for socket in self.sockets:
+                fd = self.fds.get((domain, socket))
+                energy = 0
+                if fd is not None:
+                    count, = struct.unpack("Q", os.read(fd, 8))
+                    energy = int(count * self.scales[domain] * 1000000)
+                # 64 bit counters, they do not wrap around in practice
+                readings[domain].append(EnergyReading(energy, time.monotonic_ns(), 2**64))
+        return readings
+
+    def close(self):
+        for fd in self.fds.values():
+            os.close(fd)
+        self.fds = {}
+
+
+class ReplayEnergySource:
+    """Readings recorded in a file, one JSON object per line, e.g.
+    {"ts": 1000000000, "package": [10, 20], "core": [5, 8], "dram": [1, 2]}
+    with the energy in uJ of each socket and the CLOCK_MONOTONIC time in ns.
+    The last reading is repeated when the file is over."""
+
+    def __init__(self, topology, path):
+        self.sockets = sorted(topology.get_sockets())
+        with open(path) as f:
+            self.records = [json.loads(line) for line in f if line.strip()]
+        if not self.records:
+            raise ValueError("no readings in %s" % path)
+        self.position = 0
+
+    def read(self):
+        record = self.records[min(self.position, len(self.records) - 1)]
+        self.position += 1
+        readings = {}
+        for domain in DOMAINS:
+            energies = record.get(domain, [0] * len(self.sockets))
+            readings[domain] = [
+                EnergyReading(energy, record["ts"], record.get("max_energy_uj", 2**32))
+                for energy in energies
+            ]
+        return readings
+
+    def close(self):
+        pass
+
+
+def open_energy_source(kind, topology, replay_path=None):
+    """Open the energy source kind, "auto" tries sysfs then the perf PMU"""
+    if kind == "replay":
+        return ReplayEnergySource(topology, replay_path)
+    if kind == "perf":
+        return PerfEnergySource(topology)
+    try:
+        return SysfsEnergySource(topology)
+    except OSError as e:
+        if kind == "sysfs":
+            raise
+        print("RAPL powercap files not available, using the power PMU: %s" % e)
+    return PerfEnergySource(topology)
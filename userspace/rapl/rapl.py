@@ -18,54 +18,16 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 """
 
-from datetime import datetime
-
-
-class RaplReader:
-    def _read_sysfs_file(self, path):
-        try:
-            with open(path, "r") as f:
-                contents = f.read().strip()
-                # print("Contents are: ", contents)
-                return contents
-        except EnvironmentError:
-            return "0"
-
-    def read_energy_core_sample(self, package=0):
-        energy = int(
-            self._read_sysfs_file(
-                "/sys/class/powercap/intel-rapl/"
-                + "intel-rapl:{}/intel-rapl:{}:0/energy_uj".format(package, package)
-            )
-        )
-        # print("Energy Core sample is: ", energy)
-        return RaplSample(energy, datetime.now())
-
-    def read_energy_dram_sample(self, package=0):
-        energy = int(
-            self._read_sysfs_file(
-                "/sys/class/powercap/intel-rapl/"
-                + "intel-rapl:{}/intel-rapl:{}:1/energy_uj".format(package, package)
-            )
-        )
-        # print("Energy DRAM sample is: ", energy)
-        return RaplSample(energy, datetime.now())
-
-    def read_energy_package_sample(self, package=0):
-        energy = int(
-            self._read_sysfs_file(
-                "/sys/class/powercap/intel-rapl/"
-                + "intel-rapl:{}/energy_uj".format(package)
-            )
-        )
-        # print("Energy Package sample is: ", energy)
-        return RaplSample(energy, datetime.now())
+from .energy_sources import open_energy_source
+from .sampler import EnergySampler
 
 
 class RaplSample:
-    def __init__(self, energy, timestamp):
+    def __init__(self, energy, timestamp_ns, max_energy=2**32):
         self.energy_uj = energy
-        self.sample_time = timestamp
+        # CLOCK_MONOTONIC, like bpf_ktime_get_ns
+        self.sample_time = timestamp_ns
+        self.max_energy_uj = max_energy
 
     @property
     def energy(self):
@@ -77,10 +39,10 @@ class RaplSample:
 
     def __sub__(self, other):
         energy_diff = self.energy_uj - other.energy_uj
-        delta_time = (self.sample_time - other.sample_time).total_seconds()
-        # this is overflow!
+        delta_time = (self.sample_time - other.sample_time) / 1000000000.0
+        # this is overflow! the counter wraps at max_energy_range_uj
         if energy_diff < 0 and delta_time > 0:
-            energy_diff = 2**32 + self.energy_uj - other.energy_uj
+            energy_diff = self.max_energy_uj + self.energy_uj - other.energy_uj
         return RaplDiff(energy_diff, delta_time)
 
 class RaplDiff:
@@ -110,62 +72,73 @@ class RaplDiff:
 
 
 class RaplMonitor:
-    def __init__(self, topology):
-        self.rapl_reader = RaplReader()
+    def __init__(self, topology, energy_source="auto", replay_path=None, sample_period_ms=0):
         self.topology = topology
-        self.sample_core = [
-            self.rapl_reader.read_energy_core_sample(skt)
-            for skt in self.topology.get_sockets()
-        ]
-        self.sample_pkg = [
-            self.rapl_reader.read_energy_package_sample(skt)
-            for skt in self.topology.get_sockets()
-        ]
-        self.sample_dram = [
-            self.rapl_reader.read_energy_dram_sample(skt)
-            for skt in self.topology.get_sockets()
-        ]
-
-    def take_sample_package(self):
-        package_sample = [
-            self.rapl_reader.read_energy_package_sample(skt)
-            for skt in self.topology.get_sockets()
-        ]
-        return package_sample
-
-    def take_sample_core(self):
-        core_sample = [
-            self.rapl_reader.read_energy_core_sample(skt)
-            for skt in self.topology.get_sockets()
-        ]
-        return core_sample
-
-    def take_sample_dram(self):
-        dram_sample = [
-            self.rapl_reader.read_energy_dram_sample(skt)
-            for skt in self.topology.get_sockets()
-        ]
-        return dram_sample
+        self.energy_source = open_energy_source(energy_source, topology, replay_path)
+        # readings are in socket order, keep them indexed by socket id
+        self.socket_index = {skt: i for i, skt in enumerate(sorted(topology.get_sockets()))}
+        self.sampler = None
+        if sample_period_ms > 0:
+            self.sampler = EnergySampler(self.energy_source, sample_period_ms)
+            self.last_end_ns = self.sampler.latest_ts()
+            self.sampler.start()
+        else:
+            self.sample = self.take_sample()
+
+    def is_sampling(self):
+        return self.sampler is not None
+
+    def take_sample(self):
+        readings = self.energy_source.read()
+        return {
+            domain: {
+                skt: RaplSample(r.energy_uj, r.timestamp_ns, r.max_energy_uj)
+                for skt, r in zip(sorted(self.socket_index), readings[domain])
+            }
+            for domain in readings
+        }
 
     def diff_samples(self, final_sample, initial_sample):
-        rapl_diff = [
-            final_sample[skt] - initial_sample[skt]
+        rapl_diff = {
+            skt: final_sample[skt] - initial_sample[skt]
             for skt in self.topology.get_sockets()
-        ]
+        }
         return rapl_diff
 
-    def get_rapl_measure(self):
+    def get_rapl_measure(self, start_ns=None, end_ns=None):
+        # with the background sampler the energy is interpolated between
+        # start_ns and end_ns (CLOCK_MONOTONIC), by default from the end of
+        # the previous measure to the latest reading
+        if self.sampler is not None:
+            return self._get_interpolated_measure(start_ns, end_ns)
         ret = {}
-        package_sample = self.take_sample_package()
-        core_sample = self.take_sample_core()
-        dram_sample = self.take_sample_dram()
-
-        ret["package"] = self.diff_samples(package_sample, self.sample_pkg)
-        ret["core"] = self.diff_samples(core_sample, self.sample_core)
-        ret["dram"] = self.diff_samples(dram_sample, self.sample_dram)
-
-        self.sample_pkg = package_sample
-        self.sample_core = core_sample
-        self.sample_dram = dram_sample
+        sample = self.take_sample()
+        for domain in ["package", "core", "dram"]:
+            ret[domain] = self.diff_samples(sample[domain], self.sample[domain])
+        self.sample = sample
+        return ret
 
+    def _get_interpolated_measure(self, start_ns, end_ns):
+        if end_ns is None:
+            end_ns = self.sampler.latest_ts()
+        if start_ns is None:
+            start_ns = self.last_end_ns
+        self.last_end_ns = end_ns
+        start_energy = self.sampler.energy_at(start_ns)
+        end_energy = self.sampler.energy_at(end_ns)
+        duration = max(end_ns - start_ns, 0) / 1000000000.0
+        ret = {}
+        for domain in ["package", "core", "dram"]:
+            ret[domain] = {
+                skt: RaplDiff(
+                    end_energy[domain][i] - start_energy[domain][i] if duration > 0 else 0,
+                    duration,
+                )
+                for skt, i in self.socket_index.items()
+            }
         return ret
+
+    def close(self):
+        if self.sampler is not None:
+            self.sampler.stop()
+        self.energy_source.close()
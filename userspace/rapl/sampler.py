@@ -0,0 +1,114 @@
+"""
+DEEP-mon
+Copyright (C) 2020  Brondolin Rolando
+
+This file is part of DEEP-mon
+
+DEEP-mon is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+DEEP-mon is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+# Background sampling of the energy counters (energy_sample_period_ms in
+# config.yaml). A thread reads the energy source every period into a ring
+# of unwrapped, cumulative energies, so that the energy of a window can be
+# interpolated over the exact span of its BPF timestamps instead of being
+# taken between two reads that happen at some other instant.
+#
+# The thread holds the GIL while it reads, so it competes with the drain of
+# the BPF maps: while a window is collected the readings are late and the
+# actual period is longer than the configured one. Periods of a few ms are
+# enough for windows of hundreds of ms.
+
+import bisect
+import collections
+import threading
+import time
+
+
+class EnergySampler:
+
+    def __init__(self, energy_source, period_ms=1, history_s=10):
+        self.energy_source = energy_source
+        self.period_s = period_ms / 1000.0
+        # parallel rings of timestamps and cumulative energies, so that a
+        # timestamp can be searched in place
+        size = max(2, int(history_s / self.period_s))
+        self.times = collections.deque(maxlen=size)
+        self.energies = collections.deque(maxlen=size)
+        self.lock = threading.Lock()
+        self.last_readings = None
+        self.totals = None
+        self.running = False
+        self.thread = None
+        self._sample()
+
+    def _sample(self):
+        readings = self.energy_source.read()
+        ts = readings["package"][0].timestamp_ns
+        if self.totals is None:
+            self.totals = {domain: [0] * len(values) for domain, values in readings.items()}
+        else:
+            for domain, values in readings.items():
+                for i, reading in enumerate(values):
+                    diff = reading.energy_uj - self.last_readings[domain][i].energy_uj
+                    if diff < 0:
+                        diff += reading.max_energy_uj
+                    self.totals[domain][i] += diff
+        self.last_readings = readings
+        with self.lock:
+            self.times.append(ts)
+            self.energies.append({domain: list(values) for domain, values in self.totals.items()})
+
+    def _run(self):
+        next_sample = time.monotonic()
+        while self.running:
+            self._sample()
+            next_sample += self.period_s
+            delay = next_sample - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            else:
+                # too late, do not try to catch up with a burst of reads
+                next_sample = time.monotonic()
+
+    def start(self):
+        self.running = True
+        self.thread = threading.Thread(target=self._run, name="energy-sampler", daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.running = False
+        if self.thread is not None:
+            self.thread.join()
+            self.thread = None
+
+    def latest_ts(self):
+        with self.lock:
+            return self.times[-1]
+
+    def energy_at(self, ts):
+        """Return {domain: [uJ per socket]} accumulated up to ts, interpolated
+        between the two readings around it and clamped to the ring"""
+        with self.lock:
+            index = bisect.bisect_left(self.times, ts)
+            if index == 0:
+                return self.energies[0]
+            if index == len(self.times):
+                return self.energies[-1]
+            ts0, energy0 = self.times[index - 1], self.energies[index - 1]
+            ts1, energy1 = self.times[index], self.energies[index]
+        weight = float(ts - ts0) / (ts1 - ts0) if ts1 > ts0 else 1.0
+        return {
+            domain: [e0 + (e1 - e0) * weight for e0, e1 in zip(energy0[domain], energy1[domain])]
+            for domain in energy0
+        }